@@ -1,58 +1,247 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <sched.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <sys/signalfd.h>
 #include "chatServer.h"
+#include "upgrade.h"
+
+static conn_t* findConn(int sd, conn_pool_t* pool);
+static int broadcastText(conn_t* origin, char* buffer, int len, int tagged, conn_pool_t* pool);
+static int readFromClient(conn_t* conn, conn_pool_t* pool);
+static long batchWaitUs(conn_pool_t* pool);
+static void notifyWriters(conn_pool_t* pool);
+static void printMemReport(conn_pool_t* pool);
 
 //This variable is used as a flag to control the server loop. When it's set to 1, the server loop will end.
 static int end_server = 0;
+//Set by SIGUSR1 to print the memory report at the start of the next loop iteration.
+static int report_mem = 0;
+//Set by SIGHUP to read the config file and the filter patterns again at the start of the next loop iteration.
+static int reload_config = 0;
 
 /**
-* @brief Signal handler for SIGINT (Ctrl+C)
-*
-* This function is called when the server receives the SIGINT signal (Ctrl+C).
-* It sets the `end_server` flag to 1, which will cause the server loop to end.
-*
-* @param SIG_INT The signal number (SIGINT)
-*/
-void intHandler(int SIG_INT) {
-    end_server = 1; // Set flag to end the server loop
+ * @brief Opens the descriptor the server's signals are read from
+ *
+ * SIGINT, SIGTERM, SIGHUP and SIGUSR1 are blocked and read from a signalfd
+ * in the select set, so a signal wakes the loop and is handled between two
+ * connections, not in the middle of one.
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int openSignals(conn_pool_t* pool) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        return -1;
+    }
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) {
+        return -1;
+    }
+    if (newConn(sfd, CONN_SIGNAL, pool) == NULL) {
+        close(sfd);
+        return -1;
+    }
+    return 0;
 }
 
 /**
- * @brief Main function of the chat server program
+ * @brief Starts a graceful shutdown
  *
- * This function initializes the server, creates a socket, binds it to a port,
- * and enters the main server loop where it handles incoming connections and
- * messages from clients.
+ * The listeners are closed and input is no longer handled. Held back
+ * broadcasts are published and every client is told, then the loop keeps
+ * writing until each connection has written everything queued to it or
+ * the drain deadline passes.
  *
- * @param argc The number of command-line arguments
- * @param argv An array of command-line argument strings
- * @return 0 on success, non-zero on failure
+ * @param pool A pointer to the connection pool structure
  */
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: Server <port>\n");
-        exit(EXIT_FAILURE);
+static void startDrain(conn_pool_t* pool) {
+    pool->draining = 1;
+    clock_gettime(CLOCK_MONOTONIC, &pool->drain_deadline);
+    pool->drain_deadline.tv_sec += pool->drain_ms / 1000;
+    pool->drain_deadline.tv_nsec += (pool->drain_ms % 1000) * 1000000L;
+    if (pool->drain_deadline.tv_nsec >= 1000000000L) {
+        pool->drain_deadline.tv_sec++;
+        pool->drain_deadline.tv_nsec -= 1000000000L;
+    }
+    if (flushBatch(pool) == -1) {
+        perror("Error flushing batch");
     }
+    for (conn_t *conn = pool->conn_head; conn != NULL; conn = conn->next) {
+        if (conn->type == CONN_LISTEN) {
+            markClosing(conn, pool);
+        } else if (conn->type == CONN_CLIENT && !conn->closing &&
+                   sendNotice(conn, pool, "* server shutting down\n") == -1) {
+            perror("Error queueing shutdown notice");
+        }
+    }
+    printf("Draining for %u ms at most\n", pool->drain_ms);
+}
 
-    int port = atoi(argv[1]);
-    if (port < 1 || port > 65535) {
-        printf("Usage: Server <port>\n");
-        exit(EXIT_FAILURE);
+/**
+ * @brief Reads the pending signals and acts on them
+ *
+ * SIGINT and SIGTERM start draining, or end the loop at once when draining
+ * is disabled or already under way. SIGUSR1 and SIGHUP are handled at the
+ * start of the next loop iteration.
+ *
+ * @param conn The CONN_SIGNAL connection
+ * @param pool A pointer to the connection pool structure
+ */
+static void readSignals(conn_t* conn, conn_pool_t* pool) {
+    struct signalfd_siginfo info;
+    while (read(conn->fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+            case SIGINT:
+            case SIGTERM:
+                if (pool->draining || pool->drain_ms == 0) {
+                    end_server = 1;
+                } else {
+                    startDrain(pool);
+                }
+                break;
+            case SIGUSR1:
+                report_mem = 1;
+                break;
+            case SIGHUP:
+                reload_config = 1;
+                break;
+        }
+    }
+}
+
+/**
+ * @brief Returns the time left before the drain deadline
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return The time left in us, 0 if it passed, -1 if not draining
+ */
+static long drainWaitUs(conn_pool_t* pool) {
+    if (!pool->draining) {
+        return -1;
     }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left_us = (pool->drain_deadline.tv_sec - now.tv_sec) * 1000000L +
+                   (pool->drain_deadline.tv_nsec - now.tv_nsec) / 1000;
+    return left_us > 0 ? left_us : 0;
+}
 
-    signal(SIGINT, intHandler);
+/**
+ * @brief Tells whether draining is over
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return 1 if every connection wrote everything queued to it or the deadline passed, 0 otherwise
+ */
+static int drainDone(conn_pool_t* pool) {
+    readers_t *r = &pool->readers;
+    unsigned int pending = 0;
+    for (unsigned int i = 0; i < r->count; i++) {
+        pending += !r->closing[i] && (r->cursor[i] < pool->history.next_seq || r->conn[i]->write_msg_head != NULL);
+    }
+    if (pending == 0) {
+        printf("Drained\n");
+        return 1;
+    }
+    if (drainWaitUs(pool) == 0) {
+        printf("Drain deadline passed, %u connections not drained\n", pending);
+        return 1;
+    }
+    return 0;
+}
 
-    // Initialize connection pool
-    conn_pool_t* pool = malloc(sizeof(conn_pool_t));
-    if (initPool(pool) == -1) {
-        perror("Error initializing connection pool");
-        exit(EXIT_FAILURE);
+/**
+ * @brief Applies a configuration to the running server
+ *
+ * The filter is loaded first, the only step that can fail, so a
+ * configuration is applied whole or not at all. Broadcasts held back are
+ * published under the batch limits they were held with.
+ *
+ * @param cfg The configuration
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 if the filter cannot be loaded and nothing changed
+ */
+static int applyConfig(const config_t* cfg, conn_pool_t* pool) {
+    filter_t *filter = NULL;
+    if (cfg->filter_path[0] != '\0') {
+        if ((filter = loadFilter(cfg->filter_path)) == NULL) {
+            perror("Error loading filter");
+            return -1;
+        }
+        printf("filter: %u patterns, %u states, %zu bytes\n", filter->nr_patterns, filter->nr_states, filterBytes(filter));
+    }
+    if (flushBatch(pool) == -1) {
+        perror("Error flushing batch");
+    }
+    pool->batch.max = cfg->batch_max;
+    pool->batch.delay_us = cfg->batch_delay_us;
+    pool->lag_policy = cfg->lag_policy;
+    pool->codec_level = cfg->codec_level;
+    pool->session_grace_ms = cfg->session_grace_ms;
+    pool->transforms = cfg->transforms;
+    freeFilter(pool->filter);
+    pool->filter = filter;
+    pool->filter_action = cfg->filter_action;
+    pool->max_msg = cfg->max_msg;
+    pool->drain_ms = cfg->drain_ms;
+    pool->spin_us = cfg->spin_us;
+    pool->log_level = cfg->log_level;
+    if (memcmp(&pool->sock_opts, &cfg->sock_opts, sizeof(sock_opts_t)) != 0) {
+        sock_opts_t old = pool->sock_opts;
+        pool->sock_opts = cfg->sock_opts;
+        for (conn_t *conn = pool->conn_head; conn != NULL; conn = conn->next) {
+            if (conn->type == CONN_CLIENT && !conn->closing) {
+                tuneSocket(conn, &old, pool);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the config file again and applies it
+ *
+ * Without a config file, the filter patterns are loaded again.
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 if the running configuration was kept
+ */
+static int reloadConfig(conn_pool_t* pool) {
+    config_t cfg = pool->config_base;
+    if ((pool->config_path != NULL && readConfig(pool->config_path, &cfg) == -1) || applyConfig(&cfg, pool) == -1) {
+        printf("config: reload failed, keeping the running configuration\n");
+        return -1;
     }
+    printf("config: reloaded\n");
+    return 0;
+}
 
+/**
+ * @brief Creates a listening socket
+ *
+ * A socket file left at a Unix socket path is replaced; a listener still
+ * owned by a running server is taken over before this is called.
+ *
+ * @param addr The address to listen on, AF_INET or AF_UNIX
+ * @param addr_len The size of the address
+ * @return The listening socket, -1 on failure
+ */
+static int openListener(const struct sockaddr* addr, socklen_t addr_len) {
     // Create socket
-    int listen_sd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int listen_sd = socket(addr->sa_family, SOCK_STREAM, addr->sa_family == AF_INET ? IPPROTO_TCP : 0);
     if (listen_sd < 0) {
         perror("Error creating socket");
-        free(pool);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Set socket to non-blocking
@@ -60,48 +249,438 @@ int main(int argc, char *argv[]) {
     if (ioctl(listen_sd, FIONBIO, (char *)&on) < 0) {
         perror("Error setting socket to non-blocking");
         close(listen_sd);
-        free(pool);
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+    if (addr->sa_family == AF_INET) {
+        // Allow rebinding the port right after a restart
+        if (setsockopt(listen_sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+            perror("Error setting SO_REUSEADDR");
+        }
+    } else {
+        const struct sockaddr_un *un = (const struct sockaddr_un*)addr;
+        if (un->sun_path[0] != '\0') {
+            unlink(un->sun_path);
+        }
     }
     // Bind socket
+    if (bind(listen_sd, addr, addr_len) < 0) {
+        close(listen_sd);
+        perror("Error binding socket");
+        return -1;
+    }
+
+    // Listen, with room for bursts of connecting clients
+    if (listen(listen_sd, SOMAXCONN) < 0) {
+        perror("Error listening on socket");
+        close(listen_sd);
+        return -1;
+    }
+    return listen_sd;
+}
+
+/**
+ * @brief Fills the address of a Unix socket listener
+ *
+ * A path starting with '@' names a socket in the abstract namespace, which
+ * leaves no file behind.
+ *
+ * @param path The socket path
+ * @param un The address to fill
+ * @param addr_len Set to the size of the address
+ * @return 0 on success, -1 if the path is too long
+ */
+static int unixAddr(const char* path, struct sockaddr_un* un, socklen_t* addr_len) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(un->sun_path)) {
+        return -1;
+    }
+    memset(un, 0, sizeof(*un));
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path, len);
+    if (path[0] == '@') {
+        un->sun_path[0] = '\0';
+        *addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+    } else {
+        *addr_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens a listening socket unless one was taken over for the address
+ *
+ * The listener is a CONN_LISTEN connection whose proto is the protocol of
+ * the clients it accepts.
+ *
+ * @param addr The address to listen on
+ * @param addr_len The size of the address
+ * @param proto The protocol of the clients, one of the PROTO_* values
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int addListener(const struct sockaddr* addr, socklen_t addr_len, int proto, conn_pool_t* pool) {
+    for (conn_t *conn = pool->conn_head; conn != NULL; conn = conn->next) {
+        struct sockaddr_storage bound;
+        socklen_t bound_len = sizeof(bound);
+        if (conn->type == CONN_LISTEN && getsockname(conn->fd, (struct sockaddr*)&bound, &bound_len) == 0 &&
+            bound_len == addr_len && memcmp(&bound, addr, addr_len) == 0) {
+            conn->proto = proto;
+            return 0;
+        }
+    }
+    int listen_sd = openListener(addr, addr_len);
+    if (listen_sd < 0) {
+        return -1;
+    }
+    conn_t *conn = newConn(listen_sd, CONN_LISTEN, pool);
+    if (conn == NULL) {
+        perror("Failed to add listen_sd\n");
+        close(listen_sd);
+        return -1;
+    }
+    conn->proto = proto;
+    return 0;
+}
+
+/**
+ * @brief Opens a TCP listener on every interface unless one was taken over
+ *
+ * @param port The port to listen on
+ * @param proto The protocol of the clients, one of the PROTO_* values
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int addTcpListener(int port, int proto, conn_pool_t* pool) {
     struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(listen_sd));
+    memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(port);
+    return addListener((struct sockaddr*)&addr, sizeof(addr), proto, pool);
+}
 
-    if (bind(listen_sd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(listen_sd);
-        free(pool);
-        perror("Error binding socket");
+/**
+ * @brief Applies the configured socket options to a client socket
+ *
+ * TCP options are applied to TCP sockets only. A socket whose
+ * TCP_NOTSENT_LOWAT is set is paced by writeToClient. On a reload, the
+ * TCP options set before and no longer configured go back to their
+ * defaults: 0 is the system default of TCP_NOTSENT_LOWAT. The kernel has
+ * no way back to automatic buffer sizes, so SO_SNDBUF and SO_RCVBUF keep
+ * the last size set.
+ *
+ * @param conn The client connection
+ * @param old The options the socket had, NULL for a new socket
+ * @param pool A pointer to the connection pool structure
+ */
+void tuneSocket(conn_t* conn, const sock_opts_t* old, conn_pool_t* pool) {
+    const sock_opts_t *opts = &pool->sock_opts;
+    int sd = conn->fd;
+    if (opts->sndbuf > 0 && setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf, sizeof(opts->sndbuf)) < 0) {
+        perror("Error setting SO_SNDBUF");
+    }
+    if (opts->rcvbuf > 0 && setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, sizeof(opts->rcvbuf)) < 0) {
+        perror("Error setting SO_RCVBUF");
+    }
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(sd, (struct sockaddr*)&addr, &addr_len) < 0 || addr.ss_family != AF_INET) {
+        return;
+    }
+    if ((opts->nodelay || (old != NULL && old->nodelay)) &&
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &opts->nodelay, sizeof(opts->nodelay)) < 0) {
+        perror("Error setting TCP_NODELAY");
+    }
+    if ((opts->busy_poll > 0 || (old != NULL && old->busy_poll > 0)) &&
+        setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &opts->busy_poll, sizeof(opts->busy_poll)) < 0) {
+        perror("Error setting SO_BUSY_POLL");
+    }
+    // Unpaced unless the mark is in place: writeToClient measures room against it
+    conn->paced = 0;
+    if ((opts->notsent_lowat > 0 || (old != NULL && old->notsent_lowat > 0)) &&
+        setsockopt(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opts->notsent_lowat, sizeof(opts->notsent_lowat)) < 0) {
+        perror("Error setting TCP_NOTSENT_LOWAT");
+    } else {
+        conn->paced = opts->notsent_lowat > 0;
+    }
+}
+
+/**
+ * @brief Accepts a client on a listening socket
+ *
+ * @param listener The listening connection
+ * @param pool A pointer to the connection pool structure
+ */
+static void acceptClient(conn_t* listener, conn_pool_t* pool) {
+    int new_sd = accept(listener->fd, NULL, NULL);
+    if (new_sd < 0) {
+        perror("Error accepting new connection");
+        return;
+    }
+    printf("New incoming connection on sd %d\n", new_sd);
+    // Slow clients must not block the loop, they fall behind in the ring instead
+    int on = 1;
+    conn_t *conn = NULL;
+    if (ioctl(new_sd, FIONBIO, (char *)&on) < 0 || (conn = newConn(new_sd, CONN_CLIENT, pool)) == NULL) {
+        perror("Error adding new connection");
+        close(new_sd);
+        return;
+    }
+    conn->proto = listener->proto;
+    tuneSocket(conn, NULL, pool);
+}
+
+/**
+ * @brief Waits for descriptors of the pool to become ready
+ *
+ * With a spin budget (-B), the sets are first polled without blocking until
+ * a descriptor is ready or the budget is spent; select only blocks after
+ * that, for what is left of the timeout. A loop that is still spinning when
+ * a message arrives picks it up without being woken by the scheduler, which
+ * saves the wake-up latency at the cost of keeping its core busy.
+ *
+ * @param pool A pointer to the connection pool structure
+ * @param timeout The longest wait, NULL for no limit; updated by the time spent spinning
+ * @return The number of ready descriptors, -1 on failure
+ */
+static int waitReady(conn_pool_t* pool, struct timeval* timeout) {
+    if (pool->spin_us > 0) {
+        long budget_us = pool->spin_us;
+        if (timeout != NULL && timeout->tv_sec * 1000000L + timeout->tv_usec < budget_us) {
+            budget_us = timeout->tv_sec * 1000000L + timeout->tv_usec;
+        }
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long spun_us;
+        do {
+            struct timeval poll = { 0, 0 };
+            memcpy(&pool->ready_read_set, &pool->read_set, sizeof(fd_set));
+            memcpy(&pool->ready_write_set, &pool->write_set, sizeof(fd_set));
+            int nready = select(pool->maxfd + 1, &pool->ready_read_set, &pool->ready_write_set, NULL, &poll);
+            if (nready != 0) {
+                return nready;
+            }
+            // Let a thread sharing the core run, a no-op on a core of its own
+            sched_yield();
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            spun_us = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+        } while (spun_us < budget_us);
+        if (timeout != NULL) {
+            long left_us = timeout->tv_sec * 1000000L + timeout->tv_usec - spun_us;
+            if (left_us < 0) {
+                left_us = 0;
+            }
+            timeout->tv_sec = left_us / 1000000;
+            timeout->tv_usec = left_us % 1000000;
+        }
+    }
+    memcpy(&pool->ready_read_set, &pool->read_set, sizeof(fd_set));
+    memcpy(&pool->ready_write_set, &pool->write_set, sizeof(fd_set));
+    return select(pool->maxfd + 1, &pool->ready_read_set, &pool->ready_write_set, NULL, timeout);
+}
+
+/**
+ * @brief Main function of the chat server program
+ *
+ * This function initializes the server, creates a socket, binds it to a port,
+ * and enters the main server loop where it handles incoming connections and
+ * messages from clients.
+ *
+ * @param argc The number of command-line arguments
+ * @param argv An array of command-line argument strings
+ * @return 0 on success, non-zero on failure
+ */
+int main(int argc, char *argv[]) {
+    const char *log_dir = NULL;
+    const char *upgrade_path = NULL;
+    const char *config_path = NULL;
+    int sync_ms = 0;
+    int cpu = -1;
+    int ws_port = 0;
+    const char *unix_paths[FD_SETSIZE];
+    int nr_unix = 0;
+    config_t cfg;
+    initConfig(&cfg);
+    unsigned long node_id = 0;
+    const char *peers[FD_SETSIZE];
+    int nr_peers = 0;
+    int opt;
+    long n;
+    while ((opt = getopt(argc, argv, "l:F:u:b:d:S:z:G:T:f:A:M:D:C:B:c:L:w:U:o:N:P:")) != -1) {
+        switch (opt) {
+            case 'l':
+                log_dir = optarg;
+                break;
+            case 'F':
+                if (parseNumber(optarg, 0, INT_MAX, &n) == -1) {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+                sync_ms = n;
+                break;
+            case 'u':
+                upgrade_path = optarg;
+                break;
+            case 'C':
+                if (parseNumber(optarg, -1, CPU_SETSIZE - 1, &n) == -1) {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+                cpu = n;
+                break;
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'w':
+                if (parseNumber(optarg, 1, 65535, &n) == -1) {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+                ws_port = n;
+                break;
+            case 'U':
+                if (nr_unix < FD_SETSIZE) {
+                    unix_paths[nr_unix++] = optarg;
+                }
+                break;
+            case 'N':
+                if (parseNumber(optarg, 1, UINT32_MAX, &n) == -1) {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+                node_id = n;
+                break;
+            case 'P':
+                if (nr_peers < FD_SETSIZE) {
+                    peers[nr_peers++] = optarg;
+                }
+                break;
+            default:
+                // The tunables, which the config file may set too
+                if (configOption(&cfg, opt, optarg) != 0) {
+                    printf(USAGE);
+                    exit(EXIT_FAILURE);
+                }
+        }
+    }
+    if (optind != argc - 1) {
+        printf(USAGE);
         exit(EXIT_FAILURE);
     }
 
-    // Listen
-    //TODO:check how many in the listen ? in the last work was 5
-    if (listen(listen_sd, 5) < 0) {
-        perror("Error listening on socket");
-        free(pool);
+    int port = atoi(argv[optind]);
+    if (port < 1 || port > 65535) {
+        printf(USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep the loop on one core, its caches warm and its spinning off the others
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+            perror("Error pinning to CPU");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Writing to a client that went away must fail, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Initialize connection pool
+    conn_pool_t* pool = malloc(sizeof(conn_pool_t));
+    if (initPool(pool) == -1) {
+        perror("Error initializing connection pool");
+        exit(EXIT_FAILURE);
+    }
+    pool->config_path = config_path;
+    pool->config_base = cfg;
+    if ((config_path != NULL && readConfig(config_path, &cfg) == -1) || applyConfig(&cfg, pool) == -1) {
         exit(EXIT_FAILURE);
     }
+    // Any id unlikely to be taken by another node will do unless given
+    if (node_id == 0) {
+        node_id = ((unsigned long)getpid() << 16 ^ (unsigned long)time(NULL)) & UINT32_MAX;
+    }
+    pool->fed.node_id = node_id != 0 ? node_id : 1;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pool->fed.epoch = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    for (int i = 0; i < nr_peers; i++) {
+        if (addPeer(peers[i], pool) == -1) {
+            printf(USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Node id %u\n", pool->fed.node_id);
+
+    // Take over from a server running with the same upgrade socket, if any
+    int taken_over = 0;
+    if (upgrade_path != NULL) {
+        int ret = takeOver(upgrade_path, pool);
+        if (ret == -2) {
+            perror("Error taking over from the running server");
+            exit(EXIT_FAILURE);
+        }
+        taken_over = ret == 0;
+    }
+
+    // Open the persistent log, rebuilding the history from it unless it was taken over
+    msglog_t log;
+    if (log_dir != NULL) {
+        if (openLog(&log, log_dir, sync_ms, &pool->history, taken_over) == -1) {
+            perror("Error opening message log");
+            exit(EXIT_FAILURE);
+        }
+        pool->log = &log;
+    }
+
+    // Connections write from the ring recovered from the old server or the log
+    pool->published = pool->history.next_seq;
+    pool->min_cursor = minCursor(pool);
+
     // Clear sets
     FD_ZERO(&pool->read_set);
     FD_ZERO(&pool->write_set);
     FD_ZERO(&pool->ready_read_set);
     FD_ZERO(&pool->ready_write_set);
 
-    if (addConn(listen_sd, pool) == -1) {
-        perror("Failed to add listen_sd\n");
-        close(listen_sd);
+    // Listeners taken over are kept, the others are opened
+    if (addTcpListener(port, PROTO_LINE, pool) == -1 ||
+        (ws_port > 0 && addTcpListener(ws_port, PROTO_WS_HANDSHAKE, pool) == -1)) {
         free(pool);
         exit(EXIT_FAILURE);
     }
-    pool->maxfd = listen_sd;
+    // Local clients may skip the TCP/IP stack
+    for (int i = 0; i < nr_unix; i++) {
+        struct sockaddr_un addr;
+        socklen_t addr_len;
+        if (unixAddr(unix_paths[i], &addr, &addr_len) == -1) {
+            printf(USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if (addListener((struct sockaddr*)&addr, addr_len, PROTO_LINE, pool) == -1) {
+            free(pool);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (openSignals(pool) == -1) {
+        perror("Error opening signalfd");
+        exit(EXIT_FAILURE);
+    }
+    // Wait for the next server process to take over
+    if (upgrade_path != NULL) {
+        int upgrade_sd = listenUpgrade(upgrade_path);
+        if (upgrade_sd < 0 || newConn(upgrade_sd, CONN_UPGRADE, pool) == NULL) {
+            perror("Error listening on upgrade socket");
+            exit(EXIT_FAILURE);
+        }
+    }
     // Add active connections to sets
     conn_t *curr_conn = pool->conn_head;
     while (curr_conn != NULL) {
         FD_SET(curr_conn->fd, &pool->read_set);
-        if (curr_conn->write_msg_head != NULL) {
+        if (curr_conn->write_msg_head != NULL || curr_conn->cursor_off > 0) {
             FD_SET(curr_conn->fd, &pool->write_set);
         }
         if (curr_conn->fd > pool->maxfd) {
@@ -111,309 +690,1829 @@ int main(int argc, char *argv[]) {
     }
     // Main server loop
     do {
-        // Make a copy of the sets for select
-        memcpy(&pool->ready_read_set, &pool->read_set, sizeof(fd_set));
-        memcpy(&pool->ready_write_set, &pool->write_set, sizeof(fd_set));
-        // Print before calling select
-        printf("waiting on select()...\nMaxFd %d\n", pool->maxfd);
-        int counter=0;
-        // Call select
-        pool->nready = select(pool->maxfd + 1, &pool->ready_read_set, &pool->ready_write_set, NULL, NULL);
-        if (pool->nready < 0) {
-            perror("Error in select");
+        if (pool->draining && drainDone(pool)) {
+            break;
+        }
+        if (report_mem) {
+            report_mem = 0;
+            printMemReport(pool);
+        }
+        expireSessions(pool);
+        if (reload_config) {
+            reload_config = 0;
+            reloadConfig(pool);
+        }
+        // Flush the coalesced broadcasts once their delay has passed
+        long wait_us = batchWaitUs(pool);
+        if (wait_us == 0) {
+            if (flushBatch(pool) == -1) {
+                perror("Error flushing batch");
+            }
+            wait_us = -1;
+        }
+        // Group commit everything logged during the last iteration
+        struct timeval tv, *timeout = NULL;
+        int wait_ms = -1;
+        if (pool->log != NULL && logCommit(pool->log, 0, &wait_ms) == -1) {
+            perror("Error committing message log");
+        }
+        if (wait_ms >= 0 && (wait_us < 0 || wait_ms * 1000L < wait_us)) {
+            wait_us = wait_ms * 1000L;
+        }
+        // (Re)connect to the peers without a link
+        long peer_ms = pool->draining ? -1 : connectPeers(pool);
+        if (peer_ms >= 0 && (wait_us < 0 || peer_ms * 1000L < wait_us)) {
+            wait_us = peer_ms * 1000L;
+        }
+        long drain_us = drainWaitUs(pool);
+        if (drain_us >= 0 && (wait_us < 0 || drain_us < wait_us)) {
+            wait_us = drain_us;
+        }
+        if (wait_us >= 0) {
+            tv.tv_sec = wait_us / 1000000;
+            tv.tv_usec = wait_us % 1000000;
+            timeout = &tv;
+        }
+        // Select must not block while a shared memory ring has bytes pending
+        if (!pool->draining && armShm(pool)) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+            timeout = &tv;
+        }
+        notifyWriters(pool);
+        // Print before calling select
+        if (pool->log_level >= LOG_DEBUG) {
+            printf("waiting on select()...\nMaxFd %d\n", pool->maxfd);
+        }
+        int counter=0;
+        // Call select, spinning first if asked to
+        pool->nready = waitReady(pool, timeout);
+        if (pool->nready < 0) {
+            perror("Error in select");
+            continue;
+        }
+        if (!pool->draining) {
+            pollShm(pool);
+        }
+
+        // Handle active connections round-robin, starting one connection further every iteration
+        pool->sched_round++;
+        curr_conn = pool->sched_start != NULL ? pool->sched_start : pool->conn_head;
+        pool->sched_start = curr_conn != NULL ? curr_conn->next : NULL;
+        while (curr_conn != NULL && curr_conn->sched_round != pool->sched_round) {
+            if(counter==pool->nready){
+                break;
+            }
+            curr_conn->sched_round = pool->sched_round;
+            conn_t* next_conn = curr_conn->next; // Store the next pointer before removing the current connection
+            int sd = curr_conn->fd;
+            if (curr_conn->type == CONN_LISTEN && FD_ISSET(sd, &pool->ready_read_set)) {
+                counter++;
+                acceptClient(curr_conn, pool);
+            }
+            if (curr_conn->type == CONN_SIGNAL && FD_ISSET(sd, &pool->ready_read_set)) {
+                counter++;
+                readSignals(curr_conn, pool);
+            }
+            if (curr_conn->type == CONN_SHM && FD_ISSET(sd, &pool->ready_read_set)) {
+                counter++;
+                readShmEvent(curr_conn);
+            }
+            if (curr_conn->type == CONN_UPGRADE && FD_ISSET(sd, &pool->ready_read_set)) {
+                counter++;
+                if (handOver(sd, pool) == 0) {
+                    end_server = 1;
+                    break;
+                }
+                perror("Error handing over to the new server");
+            }
+            if (readsRing(curr_conn) && !curr_conn->closing) {
+                int removed = 0;
+                if (FD_ISSET(sd, &pool->ready_read_set)) {
+                    if (pool->log_level >= LOG_DEBUG) {
+                        printf("Descriptor %d is readable\n", sd);
+                    }
+                    counter++;
+                    removed = readFromClient(curr_conn, pool);
+                }
+                if (!removed && FD_ISSET(sd, &pool->ready_write_set)) {
+                    counter++;
+                    if (writeToClient(sd, pool) == -1) {
+                        perror("Error writing to client");
+                    }
+                }
+            }
+            // Wrap around to the connections before the starting point
+            curr_conn = next_conn != NULL ? next_conn : pool->conn_head;
+        }
+        removeClosing(pool);
+    } while (end_server == 0);
+
+    printMemReport(pool);
+    // Cleanup connections
+    conn_t *curr_conn_cleanup = pool->conn_head;
+    while (curr_conn_cleanup != NULL) {
+        conn_t* next_conn = curr_conn_cleanup->next;
+        removeConn(curr_conn_cleanup->fd, pool);
+        curr_conn_cleanup = next_conn;
+    }
+    if (pool->log != NULL) {
+        closeLog(pool->log);
+    }
+    printCodecStats(&pool->codec_stats);
+    freeRing(&pool->history);
+    freeFederation(&pool->fed);
+    freeNicks(&pool->nicks);
+    freeTopics(&pool->topics);
+    freeSessions(pool);
+    freeFilter(pool->filter);
+    free(pool->readers.cursor);
+    free(pool->readers.fd);
+    free(pool->readers.closing);
+    free(pool->readers.conn);
+    free(pool);
+
+    return 0;
+}
+
+
+/**
+ * @brief Initializes the connection pool
+ *
+ * This function initializes the connection pool by setting up the necessary
+ * data structures and resetting the file descriptor sets.
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int initPool(conn_pool_t* pool) {
+    if (pool == NULL) {
+        return -1;
+    }
+    pool->maxfd = -1;
+    pool->nready = 0;
+    FD_ZERO(&pool->read_set);
+    FD_ZERO(&pool->ready_read_set);
+    FD_ZERO(&pool->write_set);
+    FD_ZERO(&pool->ready_write_set);
+    pool->conn_head=NULL;
+    pool->nr_conns = 0;
+    pool->log = NULL;
+    memset(&pool->batch, 0, sizeof(pool->batch));
+    memset(&pool->fed, 0, sizeof(pool->fed));
+    memset(&pool->codec_stats, 0, sizeof(pool->codec_stats));
+    memset(&pool->sock_opts, 0, sizeof(pool->sock_opts));
+    memset(&pool->readers, 0, sizeof(pool->readers));
+    pool->codec_level = CODEC_LEVEL;
+    pool->nr_zipping = 0;
+    pool->published = 1;
+    pool->notified = 0;
+    pool->min_cursor = 1;
+    pool->lag_policy = LAG_DROP;
+    pool->next_conn_id = 1;
+    pool->closing_pending = 0;
+    pool->sched_start = NULL;
+    pool->sched_round = 0;
+    pool->session_grace_ms = SESSION_GRACE_MS;
+    parseTransforms(TRANSFORMS_DEFAULT, &pool->transforms);
+    pool->filter = NULL;
+    pool->filter_action = FILTER_DROP;
+    pool->max_msg = MESSAGE_MAX;
+    pool->shm_rings = NULL;
+    pool->nr_recv_fds = 0;
+    pool->config_path = NULL;
+    initConfig(&pool->config_base);
+    pool->log_level = LOG_DEBUG;
+    pool->draining = 0;
+    pool->drain_ms = DRAIN_MS;
+    pool->spin_us = 0;
+    memset(pool->by_fd, 0, sizeof(pool->by_fd));
+    if (initNicks(&pool->nicks) == -1 || initTopics(&pool->topics) == -1 || initSessions(&pool->sessions) == -1) {
+        return -1;
+    }
+    if (initRing(&pool->history, HISTORY_LEN, HISTORY_BYTES) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds a new connection to the connection pool
+ *
+ * This function adds a new client connection to the connection pool.
+ *
+ * @param sd The socket descriptor of the new connection
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int addConn(int sd, conn_pool_t* pool) {
+    return newConn(sd, CONN_CLIENT, pool) == NULL ? -1 : 0;
+}
+
+/**
+ * @brief Gives a connection reading the ring a slot in the readers arrays
+ *
+ * The connection starts with the next broadcast.
+ *
+ * @param conn The connection
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int addReader(conn_t* conn, conn_pool_t* pool) {
+    readers_t *r = &pool->readers;
+    if (r->count == r->capacity) {
+        unsigned int capacity = r->capacity > 0 ? r->capacity * 2 : 64;
+        unsigned long long *cursor = realloc(r->cursor, capacity * sizeof(*cursor));
+        if (cursor != NULL) {
+            r->cursor = cursor;
+        }
+        int *fd = realloc(r->fd, capacity * sizeof(*fd));
+        if (fd != NULL) {
+            r->fd = fd;
+        }
+        unsigned char *closing = realloc(r->closing, capacity * sizeof(*closing));
+        if (closing != NULL) {
+            r->closing = closing;
+        }
+        conn_t **conns = realloc(r->conn, capacity * sizeof(*conns));
+        if (conns != NULL) {
+            r->conn = conns;
+        }
+        if (cursor == NULL || fd == NULL || closing == NULL || conns == NULL) {
+            return -1;
+        }
+        r->capacity = capacity;
+    }
+    conn->slot = r->count++;
+    r->cursor[conn->slot] = pool->published;
+    r->fd[conn->slot] = conn->fd;
+    r->closing[conn->slot] = 0;
+    r->conn[conn->slot] = conn;
+    return 0;
+}
+
+/**
+ * @brief Releases the slot of a connection, moving the last slot into it
+ *
+ * @param conn The connection
+ * @param pool A pointer to the connection pool structure
+ */
+static void removeReader(conn_t* conn, conn_pool_t* pool) {
+    readers_t *r = &pool->readers;
+    unsigned int slot = conn->slot;
+    unsigned int last = --r->count;
+    if (slot != last) {
+        r->cursor[slot] = r->cursor[last];
+        r->fd[slot] = r->fd[last];
+        r->closing[slot] = r->closing[last];
+        r->conn[slot] = r->conn[last];
+        r->conn[slot]->slot = slot;
+    }
+    conn->slot = -1;
+}
+
+/**
+ * @brief Adds a descriptor of any type to the connection pool
+ *
+ * This function creates a new `conn_t` structure, links it at the head of
+ * the connection list and adds the descriptor to the read set. Descriptors
+ * select cannot watch (FD_SETSIZE and above) are refused.
+ *
+ * @param sd The descriptor
+ * @param type The connection type, one of the CONN_* values
+ * @param pool A pointer to the connection pool structure
+ * @return The new connection, NULL on failure
+ */
+conn_t* newConn(int sd, int type, conn_pool_t* pool) {
+    if (pool == NULL || sd < 0 || sd >= FD_SETSIZE) {
+        return NULL;
+    }
+    conn_t *new_conn = (conn_t *)malloc(sizeof(conn_t));
+    if (new_conn == NULL) {
+        return NULL;
+    }
+    new_conn->fd = sd;
+    new_conn->type = type;
+    new_conn->proto = PROTO_LINE;
+    new_conn->codec = CODEC_NONE;
+    new_conn->id = pool->next_conn_id++;
+    new_conn->slot = -1;
+    if (readsRing(new_conn) && addReader(new_conn, pool) == -1) {
+        free(new_conn);
+        return NULL;
+    }
+    new_conn->cursor_off = 0;
+    new_conn->replay_end = 0;
+    new_conn->closing = 0;
+    new_conn->sched_round = 0;
+    new_conn->paced = 0;
+    if (new_conn->slot >= 0 && connCursor(pool, new_conn) < pool->min_cursor) {
+        pool->min_cursor = connCursor(pool, new_conn);
+    }
+    new_conn->write_msg_head = NULL;
+    new_conn->write_msg_tail = NULL;
+    new_conn->write_msg_ctrl = NULL;
+    new_conn->in_buf = NULL;
+    new_conn->in_len = 0;
+    new_conn->link = NULL;
+    new_conn->nick = NULL;
+    new_conn->session = NULL;
+    new_conn->topics = NULL;
+    new_conn->topic_round = 0;
+    new_conn->stream_chunks = 0;
+
+    if (pool->conn_head == NULL) {
+        new_conn->prev = new_conn->next = NULL;
+        pool->conn_head = new_conn;
+    } else {
+        new_conn->prev = NULL;
+        new_conn->next = pool->conn_head;
+        pool->conn_head->prev = new_conn;
+        pool->conn_head = new_conn;
+    }
+    pool->by_fd[sd] = new_conn;
+    pool->nr_conns++;
+    if (sd > pool->maxfd) pool->maxfd = sd;
+    FD_SET(sd, &(pool->read_set));
+    return new_conn;
+}
+
+
+/**
+ * @brief Marks a connection to be removed at the end of the loop iteration
+ *
+ * Nothing more is written to it; the connection list stays intact for the
+ * caller.
+ *
+ * @param conn The connection
+ * @param pool A pointer to the connection pool structure
+ */
+void markClosing(conn_t* conn, conn_pool_t* pool) {
+    conn->closing = 1;
+    if (conn->slot >= 0) {
+        pool->readers.closing[conn->slot] = 1;
+    }
+    pool->closing_pending = 1;
+    FD_CLR(conn->fd, &pool->write_set);
+}
+
+/**
+ * @brief Removes a connection from the connection pool
+ *
+ * This function removes a connection from the connection pool by finding the
+ * corresponding `conn_t` structure, updating the necessary data structures,
+ * and freeing any associated resources.
+ *
+ * @param sd The socket descriptor of the connection to remove
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 if the connection is not found
+ */
+int removeConn(int sd, conn_pool_t* pool) {
+    if (pool == NULL) {
+        return -1;
+    }
+    conn_t *curr_conn = findConn(sd, pool);
+    if (curr_conn == NULL) {
+        return -1; // Connection not found
+    }
+    if (pool->sched_start == curr_conn) {
+        pool->sched_start = curr_conn->next;
+    }
+    // Remove from connection pool
+    if (curr_conn->prev != NULL) {
+        curr_conn->prev->next = curr_conn->next;
+    }else {
+        pool->conn_head = curr_conn->next;
+    }
+    if (curr_conn->next != NULL) {
+        curr_conn->next->prev = curr_conn->prev;
+    }
+    if (curr_conn->write_msg_head) {
+        // Free messages in the queue if any
+        msg_t* msg = curr_conn->write_msg_head;
+        while (msg) {
+            msg_t* temp = msg;
+            msg = msg->next;
+            payloadUnref(temp->payload);
+            free(temp);
+        }
+    }
+    if (curr_conn->slot >= 0) {
+        removeReader(curr_conn, pool);
+    }
+    free(curr_conn->in_buf);
+    free(curr_conn->link);
+    if (curr_conn->codec != CODEC_NONE) {
+        pool->nr_zipping--;
+    }
+    removeNick(&pool->nicks, curr_conn);
+    detachSession(curr_conn, pool);
+    unsubscribeAll(&pool->topics, curr_conn);
+    if (pool->shm_rings != NULL) {
+        detachShm(curr_conn, pool);
+    }
+
+    close(sd);
+    FD_CLR(sd, &(pool->read_set));
+    FD_CLR(sd, &(pool->write_set));
+    pool->by_fd[sd] = NULL;
+    free(curr_conn);
+    if(pool->maxfd==sd){
+        // Find the new largest descriptor
+        pool->maxfd = -1;
+        for (conn_t *c = pool->conn_head; c != NULL; c = c->next) {
+            if (c->fd > pool->maxfd) {
+                pool->maxfd = c->fd;
+            }
+        }
+    }
+    pool->nr_conns--;
+    printf("removing connection with sd %d \n", sd);
+    return 0;
+}
+
+
+/**
+ * @brief Finds the connection object of a socket descriptor
+ *
+ * @param sd The socket descriptor
+ * @param pool A pointer to the connection pool structure
+ * @return The connection, NULL if it is not in the pool
+ */
+static conn_t* findConn(int sd, conn_pool_t* pool) {
+    if (sd < 0 || sd >= FD_SETSIZE) {
+        return NULL;
+    }
+    return pool->by_fd[sd];
+}
+
+/**
+ * @brief Appends a shared payload to the write queue of a connection
+ *
+ * The queue entry takes its own reference to the payload, the message bytes
+ * are not copied. The message goes to the chat lane.
+ *
+ * @param conn The connection
+ * @param payload The payload to queue
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int queueMsg(conn_t* conn, payload_t* payload, conn_pool_t* pool) {
+    return queueSlice(conn, payload, 0, payload->size, LANE_CHAT, pool);
+}
+
+/**
+ * @brief Adds a shared payload to a lane of the write queue of a connection
+ *
+ * @param conn The connection
+ * @param payload The payload to queue
+ * @param lane One of the LANE_* values
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int queueLane(conn_t* conn, payload_t* payload, int lane, conn_pool_t* pool) {
+    return queueSlice(conn, payload, 0, payload->size, lane, pool);
+}
+
+/**
+ * @brief Adds a slice of a shared payload to a lane of the write queue of a connection
+ *
+ * The queue is one list whose front is the control lane: a control message
+ * is linked in after write_msg_ctrl, ahead of the chat messages, so a
+ * notice or an ack does not wait behind a backlog of chat. Both lanes are
+ * written before the broadcasts from the ring. A control message never
+ * overtakes a message already partly written, nor a protocol switch and
+ * what was queued before it, which is written in the old protocol.
+ *
+ * @param conn The connection
+ * @param payload The payload to queue
+ * @param offset The offset of the slice in the payload
+ * @param len The length of the slice
+ * @param lane One of the LANE_* values
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int queueSlice(conn_t* conn, payload_t* payload, int offset, int len, int lane, conn_pool_t* pool) {
+    msg_t *new_msg = (msg_t*)malloc(sizeof(msg_t));
+    if (new_msg == NULL) {
+        return -1;
+    }
+    new_msg->payload = payloadRef(payload);
+    new_msg->offset = offset;
+    new_msg->len = len;
+    // Link after the control lane, or at the tail of the chat lane
+    msg_t *after = lane == LANE_CONTROL ? conn->write_msg_ctrl : conn->write_msg_tail;
+    new_msg->prev = after;
+    new_msg->next = after != NULL ? after->next : conn->write_msg_head;
+    if (new_msg->next != NULL) {
+        new_msg->next->prev = new_msg;
+    } else {
+        conn->write_msg_tail = new_msg;
+    }
+    if (after != NULL) {
+        after->next = new_msg;
+    } else {
+        conn->write_msg_head = new_msg;
+    }
+    if (lane != LANE_CHAT) {
+        conn->write_msg_ctrl = new_msg;
+    }
+    // Update file descriptor set
+    FD_SET(conn->fd, &pool->write_set);
+    return 0;
+}
+
+/**
+ * @brief Builds the bytes written before a broadcast on a connection
+ *
+ * The sequence tag of a session connection and the frame header of a
+ * framed connection are not in the ring; they are built on the fly. The
+ * next chunks of a streamed line get no tag on a line connection, where
+ * they continue the line tagged with the first chunk's number. A
+ * connection using a codec gets the compressed payload shared by all such
+ * connections, a WebSocket client the frame shared by all WebSocket clients.
+ *
+ * @param conn The connection
+ * @param payload The broadcast, replaced with the bytes written after the prefix
+ * @param seq Its sequence number
+ * @param pre The buffer, at least BROADCAST_PRE_MAX bytes
+ * @return The length of the prefix
+ */
+static int broadcastPrefix(conn_t* conn, payload_t** payload, unsigned long long seq, char* pre) {
+    if (isWs(conn->proto)) {
+        *payload = wsFrame(*payload);
+        return 0;
+    }
+    int len = conn->proto == PROTO_LINE && (*payload)->cont ? 0 : sessionTag(conn, seq, pre);
+    if (conn->proto == PROTO_FRAME) {
+        int type;
+        frame_hdr_t hdr;
+        *payload = frameBody(conn, *payload, &type);
+        setFrameHdr(&hdr, type, (*payload)->size);
+        memcpy(pre + len, &hdr, sizeof(hdr));
+        len += sizeof(hdr);
+    }
+    return len;
+}
+
+/**
+ * @brief Moves the unwritten rest of a partly written broadcast to the write queue
+ *
+ * Used before the cursor of a connection jumps, so the client never sees a
+ * broadcast cut in the middle. The rest is queued in front of the queue,
+ * where it is written first.
+ *
+ * @param conn The connection
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int detachPartial(conn_t* conn, conn_pool_t* pool) {
+    if (conn->cursor_off == 0) {
+        return 0;
+    }
+    payload_t *payload = ringGet(&pool->history, connCursor(pool, conn));
+    msg_t *new_msg = (msg_t*)malloc(sizeof(msg_t));
+    if (payload == NULL || new_msg == NULL) {
+        free(new_msg);
+        return -1;
+    }
+    char pre[BROADCAST_PRE_MAX];
+    int pre_len = broadcastPrefix(conn, &payload, connCursor(pool, conn), pre);
+    if (payload == NULL) {
+        free(new_msg);
+        return -1;
+    }
+    if (pre_len > 0) {
+        // The offset counts the prefix, which is not in the ring
+        char *buf = malloc(pre_len + payload->size);
+        if (buf == NULL) {
+            free(new_msg);
+            return -1;
+        }
+        memcpy(buf, pre, pre_len);
+        memcpy(buf + pre_len, payload->data, payload->size);
+        new_msg->payload = newPayload(buf, pre_len + payload->size);
+        free(buf);
+        if (new_msg->payload == NULL) {
+            free(new_msg);
+            return -1;
+        }
+    } else {
+        new_msg->payload = payloadRef(payload);
+    }
+    new_msg->offset = conn->cursor_off;
+    new_msg->len = new_msg->payload->size - conn->cursor_off;
+    new_msg->prev = NULL;
+    new_msg->next = conn->write_msg_head;
+    if (conn->write_msg_head == NULL) {
+        conn->write_msg_tail = new_msg;
+    } else {
+        conn->write_msg_head->prev = new_msg;
+    }
+    conn->write_msg_head = new_msg;
+    if (conn->write_msg_ctrl == NULL) {
+        // Partly written, nothing overtakes it
+        conn->write_msg_ctrl = new_msg;
+    }
+    connCursor(pool, conn)++;
+    conn->cursor_off = 0;
+    FD_SET(conn->fd, &pool->write_set);
+    return 0;
+}
+
+/**
+ * @brief Allocates a line private to one connection, framed for its protocol
+ *
+ * @param conn The connection
+ * @param type The frame type used on a framed connection
+ * @param line The line, including its newline
+ * @param len The length of the line
+ * @return The payload with a reference count of 1, NULL on failure
+ */
+static payload_t* newPrivateLine(conn_t* conn, int type, const char* line, int len) {
+    if (conn->proto == PROTO_FRAME) {
+        return newFrame(type, line, len);
+    }
+    payload_t *payload = newPayload(line, len);
+    if (payload != NULL && isWs(conn->proto)) {
+        payload_t *frame = payloadRef(wsFrame(payload));
+        payloadUnref(payload);
+        return frame;
+    }
+    return payload;
+}
+
+/**
+ * @brief Queues a server notice line to a single connection
+ *
+ * Notices are private to the connection and never enter the history ring.
+ * They take the control lane, ahead of queued chat.
+ *
+ * @param conn The connection
+ * @param pool A pointer to the connection pool structure
+ * @param fmt printf style format of the notice
+ * @return 0 on success, -1 on failure
+ */
+int sendNotice(conn_t* conn, conn_pool_t* pool, const char* fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return -1;
+    }
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    payload_t *payload = newPrivateLine(conn, FRAME_NOTICE, line, len);
+    if (payload == NULL) {
+        return -1;
+    }
+    int ret = queueLane(conn, payload, LANE_CONTROL, pool);
+    payloadUnref(payload);
+    return ret;
+}
+
+/**
+ * @brief Registers the nickname given by a "/nick" line or a FRAME_JOIN frame
+ *
+ * Nicknames are up to NICK_MAX letters, digits, '_' and '-'.
+ *
+ * @param conn The connection
+ * @param nick The nickname
+ * @param len The length of the nickname
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int registerNick(conn_t* conn, const char* nick, int len, conn_pool_t* pool) {
+    if (!validNick(nick, len)) {
+        return sendNotice(conn, pool, "* invalid nick\n");
+    }
+    int ret = setNick(&pool->nicks, conn, nick, len);
+    if (ret == 1) {
+        return sendNotice(conn, pool, "* nick %.*s is taken\n", len, nick);
+    }
+    if (ret == -1) {
+        return -1;
+    }
+    return sendNotice(conn, pool, "* you are %s\n", conn->nick);
+}
+
+/**
+ * @brief Writes the prefix naming the sender of a message
+ *
+ * @param conn The sending connection
+ * @param buf The buffer, at least SENDER_TAG_MAX bytes
+ * @return The length of the prefix: "[nick] ", or "[#id] " without a nickname
+ */
+static int senderTag(conn_t* conn, char* buf) {
+    return conn->nick != NULL ? snprintf(buf, SENDER_TAG_MAX, "[%s] ", conn->nick)
+                              : snprintf(buf, SENDER_TAG_MAX, "[#%llu] ", conn->id);
+}
+
+/**
+ * @brief Runs a message from a client through the content filter
+ *
+ * @param conn The sending connection, NULL if unknown
+ * @param buf The message, masked in place under FILTER_MASK
+ * @param len The length of the message
+ * @param pool A pointer to the connection pool structure
+ * @return 1 if the message is dropped, 0 if it passes, -1 on failure
+ */
+int filterMessage(conn_t* conn, char* buf, int len, conn_pool_t* pool) {
+    if (pool->filter == NULL || filterScan(pool->filter, buf, len, pool->filter_action == FILTER_MASK) == 0 ||
+        pool->filter_action == FILTER_MASK) {
+        return 0;
+    }
+    if (conn != NULL && sendNotice(conn, pool, "* message filtered\n") == -1) {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends the text of a "/msg <nick> <text>" line to one connection only
+ *
+ * One hash lookup finds the recipient and the message is queued to it
+ * alone, passed through the filter and the transforms like broadcasts and
+ * prefixed with the sender's nickname (or connection id).
+ *
+ * @param conn The sending connection
+ * @param args The line after "/msg ", including its newline
+ * @param len The length of args
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int directMessage(conn_t* conn, char* args, int len, conn_pool_t* pool) {
+    char *space = memchr(args, ' ', len);
+    if (space == NULL) {
+        return sendNotice(conn, pool, "* usage: /msg <nick> <text>\n");
+    }
+    int nick_len = space - args;
+    conn_t *target = findNick(&pool->nicks, args, nick_len);
+    if (target == NULL || target->closing) {
+        return sendNotice(conn, pool, "* no such nick %.*s\n", nick_len > NICK_MAX ? NICK_MAX : nick_len, args);
+    }
+    char *text = space + 1;
+    int text_len = args + len - text;
+    int filtered = filterMessage(conn, text, text_len, pool);
+    if (filtered != 0) {
+        return filtered == 1 ? 0 : -1;
+    }
+    char sender[SENDER_TAG_MAX];
+    int sender_len = senderTag(conn, sender);
+    char *line = malloc(sender_len + text_len);
+    if (line == NULL) {
+        return -1;
+    }
+    int line_len = runTransforms(&pool->transforms, sender, sender_len, text, text_len, line);
+    payload_t *payload = newPrivateLine(target, FRAME_DIRECT, line, line_len);
+    free(line);
+    if (payload == NULL) {
+        return -1;
+    }
+    int ret = queueMsg(target, payload, pool);
+    payloadUnref(payload);
+    return ret;
+}
+
+/**
+ * @brief Sends the text of a "/pub <topic> <text>" line to the subscribers of the topic
+ *
+ * The text is filtered and transformed once. Subscribers share one payload
+ * per protocol, built when the first of them needs it.
+ *
+ * @param conn The publishing connection, which does not get the message back
+ * @param args The line after "/pub ", including its newline
+ * @param len The length of args
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int publishTopic(conn_t* conn, char* args, int len, conn_pool_t* pool) {
+    char *space = memchr(args, ' ', len);
+    if (space == NULL || !validTopic(args, space - args, 0)) {
+        return sendNotice(conn, pool, "* usage: /pub <topic> <text>\n");
+    }
+    int topic_len = space - args;
+    char *text = space + 1;
+    int text_len = args + len - text;
+    int filtered = filterMessage(conn, text, text_len, pool);
+    if (filtered != 0) {
+        return filtered == 1 ? 0 : -1;
+    }
+    const conn_set_t *subs = resolveTopic(&pool->topics, args, topic_len);
+    if (subs == NULL) {
+        return -1;
+    }
+    if (subs->count == 0 || (subs->count == 1 && subs->conns[0] == conn)) {
+        return 0;
+    }
+    char prefix[TOPIC_MAX + 3 + SENDER_TAG_MAX];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "{%.*s} ", topic_len, args);
+    if (pool->transforms.tag) {
+        prefix_len += senderTag(conn, prefix + prefix_len);
+    }
+    char *line = malloc(prefix_len + text_len);
+    if (line == NULL) {
+        return -1;
+    }
+    int line_len = runTransforms(&pool->transforms, prefix, prefix_len, text, text_len, line);
+    // Line, frame and WebSocket payloads
+    payload_t *payloads[3] = { NULL, NULL, NULL };
+    int ret = 0;
+    for (uint32_t i = 0; i < subs->count && ret == 0; i++) {
+        conn_t *sub = subs->conns[i];
+        if (sub == conn || sub->closing) {
+            continue;
+        }
+        int kind = sub->proto == PROTO_FRAME ? 1 : isWs(sub->proto) ? 2 : 0;
+        if (payloads[kind] == NULL && (payloads[kind] = newPrivateLine(sub, FRAME_TOPIC, line, line_len)) == NULL) {
+            ret = -1;
+            break;
+        }
+        ret = queueMsg(sub, payloads[kind], pool);
+    }
+    for (int i = 0; i < 3; i++) {
+        payloadUnref(payloads[i]);
+    }
+    free(line);
+    return ret;
+}
+
+/**
+ * @brief Handles "/sub <pattern>" and "/unsub <pattern>"
+ *
+ * @param conn The connection
+ * @param pattern The pattern, followed by the line's newline
+ * @param len The length up to the end of the line
+ * @param subscribe Set for /sub
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int subscribeCommand(conn_t* conn, const char* pattern, int len, int subscribe, conn_pool_t* pool) {
+    while (len > 0 && isspace((unsigned char)pattern[len - 1])) {
+        len--;
+    }
+    if (!validTopic(pattern, len, 1)) {
+        return sendNotice(conn, pool, "* invalid topic pattern\n");
+    }
+    if (!subscribe) {
+        if (unsubscribeTopic(&pool->topics, conn, pattern, len) == 1) {
+            return sendNotice(conn, pool, "* not subscribed to %.*s\n", len, pattern);
+        }
+        return sendNotice(conn, pool, "* unsubscribed from %.*s\n", len, pattern);
+    }
+    int ret = subscribeTopic(&pool->topics, conn, pattern, len);
+    if (ret == -1) {
+        return -1;
+    }
+    return sendNotice(conn, pool, ret == 1 ? "* already subscribed to %.*s\n" : "* subscribed to %.*s\n", len, pattern);
+}
+
+/**
+ * @brief Tells whether a client may run admin commands
+ *
+ * Admins are the clients on a Unix socket running as the server's user
+ * or as root.
+ *
+ * @param conn The client connection
+ * @return 1 if it may, 0 if not
+ */
+static int isAdmin(conn_t* conn) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockname(conn->fd, (struct sockaddr*)&addr, &addr_len) < 0 || addr.ss_family != AF_UNIX ||
+        getsockopt(conn->fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+        return 0;
+    }
+    return cred.uid == 0 || cred.uid == geteuid();
+}
+
+/**
+ * @brief Handles one complete line read from a client
+ *
+ * Lines starting with a known command are served to the client itself:
+ *   /history <n>  - replay the last n broadcasts held by the history ring
+ *   /since <seq>  - replay every held broadcast with a sequence above seq
+ *   /session      - open a resumable session, see session.h
+ *   /ack <seq>    - acknowledge the broadcasts of the session up to seq
+ *   /resume <token> - take over a session whose connection was lost
+ *   /peer <node> <epoch> - turn the connection into a link from a configured peer
+ *   /nick <name>  - register a nickname
+ *   /msg <nick> <text> - send text to the connection with that nickname only
+ *   /sub <pattern>, /unsub <pattern> - follow or leave topics, see topic.h
+ *   /pub <topic> <text> - send text to the subscribers of a topic
+ *   /binary [codec] - switch the connection to length-prefixed frames
+ * The last two are line connections only. Every other line is broadcast to
+ * the other connections.
+ *
+ * @param conn The connection the line was read from
+ * @param line The line, including its terminating newline
+ * @param len The length of the line
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int handleLine(conn_t* conn, char* line, int len, conn_pool_t* pool) {
+    if (len > 5 && memcmp(line, "/msg ", 5) == 0) {
+        return directMessage(conn, line + 5, len - 5, pool);
+    }
+    if (len > 5 && memcmp(line, "/pub ", 5) == 0) {
+        return publishTopic(conn, line + 5, len - 5, pool);
+    }
+    if (len > 5 && memcmp(line, "/sub ", 5) == 0) {
+        return subscribeCommand(conn, line + 5, len - 5, 1, pool);
+    }
+    if (len > 7 && memcmp(line, "/unsub ", 7) == 0) {
+        return subscribeCommand(conn, line + 7, len - 7, 0, pool);
+    }
+    if (len > 6 && memcmp(line, "/nick ", 6) == 0) {
+        int nick_len = len - 6;
+        while (nick_len > 0 && isspace((unsigned char)line[6 + nick_len - 1])) {
+            nick_len--;
+        }
+        return registerNick(conn, line + 6, nick_len, pool);
+    }
+    if (line[0] == '/') {
+        char cmd[64];
+        int n = len < (int)sizeof(cmd) ? len : (int)sizeof(cmd) - 1;
+        memcpy(cmd, line, n);
+        cmd[n] = '\0';
+        unsigned long long arg;
+        unsigned long long next_seq = pool->history.next_seq;
+        if (sscanf(cmd, "/history %llu", &arg) == 1) {
+            return replayHistory(conn->fd, arg < next_seq ? next_seq - arg : 1, pool) < 0 ? -1 : 0;
+        }
+        if (sscanf(cmd, "/since %llu", &arg) == 1) {
+            return replayHistory(conn->fd, arg + 1, pool) < 0 ? -1 : 0;
+        }
+        if (sscanf(cmd, "/ack %llu", &arg) == 1) {
+            ackSession(conn, arg, pool);
+            return 0;
+        }
+        if (strcmp(cmd, "/session\n") == 0 || strcmp(cmd, "/session\r\n") == 0) {
+            return startSession(conn, pool);
+        }
+        if (sscanf(cmd, "/resume %llx", &arg) == 1) {
+            return resumeSession(conn, arg, pool);
+        }
+        char name[16] = "none";
+        if (conn->proto != PROTO_LINE) {
+            return addMsg(conn->fd, line, len, pool);
+        }
+        if (strcmp(cmd, "/binary\n") == 0 || strcmp(cmd, "/binary\r\n") == 0 ||
+            sscanf(cmd, "/binary %15s", name) == 1) {
+            int codec = codecByName(name);
+            if (codec == -1) {
+                return sendNotice(conn, pool, "* unknown codec %s\n", name);
+            }
+            // Frames must not start in the middle of a line
+            if (detachPartial(conn, pool) == -1) {
+                return -1;
+            }
+            return startFrames(conn, codec, pool);
+        }
+        if (strcmp(cmd, "/shm\n") == 0 || strcmp(cmd, "/shm\r\n") == 0) {
+            if (pool->nr_recv_fds != 2) {
+                return sendNotice(conn, pool, "* shm refused: send a memfd and an eventfd with /shm\n");
+            }
+            pool->nr_recv_fds = 0;
+            int size = attachShm(conn, pool->recv_fds[0], pool->recv_fds[1], pool);
+            if (size == -1) {
+                return sendNotice(conn, pool, "* shm refused: %s\n", strerror(errno));
+            }
+            return sendNotice(conn, pool, "* shm attached, %d bytes\n", size);
+        }
+        if (strcmp(cmd, "/reload\n") == 0 || strcmp(cmd, "/reload\r\n") == 0) {
+            if (!isAdmin(conn)) {
+                return sendNotice(conn, pool, "* reload refused\n");
+            }
+            return sendNotice(conn, pool, reloadConfig(pool) == 0 ? "* reloaded\n" : "* reload failed, see the server log\n");
+        }
+        unsigned int node;
+        if (sscanf(cmd, "/peer %u %llu", &node, &arg) == 2) {
+            if (!knownPeer(conn, pool)) {
+                return sendNotice(conn, pool, "* peer refused\n");
+            }
+            // Records must not start in the middle of a line written as a client
+            if (detachPartial(conn, pool) == -1) {
+                return -1;
+            }
+            return startPeer(conn, node, arg, pool);
+        }
+    }
+    return addMsg(conn->fd, line, len, pool);
+}
+
+/**
+ * @brief Broadcasts the next chunk of a line being streamed
+ *
+ * The first chunk is tagged with the sender like any broadcast, the next
+ * ones continue its line. The line is cut at the longest message accepted,
+ * or at the trim transform's length if shorter, and the rest of it is
+ * discarded as it arrives; so is the rest of a line the filter dropped a
+ * chunk of. A line cut after some of it was broadcast is ended with a
+ * newline, so its recipients do not see the next broadcast joined to it.
+ *
+ * @param conn The sending connection
+ * @param buf The chunk, changed in place when the line is cut
+ * @param len The length of the chunk
+ * @param last Set when the chunk ends the line with its newline
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int streamChunk(conn_t* conn, char* buf, int len, int last, conn_pool_t* pool) {
+    if (conn->stream_chunks == STREAM_DISCARD) {
+        if (last) {
+            conn->stream_chunks = 0;
+        }
+        return 0;
+    }
+    int first = conn->stream_chunks == 0;
+    size_t sent = (size_t)conn->stream_chunks * BUFFER_SIZE;
+    size_t limit = pool->max_msg;
+    if (pool->transforms.max_len > 0 && (size_t)pool->transforms.max_len < limit) {
+        limit = pool->transforms.max_len;
+    }
+    int cut = sent + len - last > limit;
+    if (cut) {
+        // The newline takes the place of a byte cut off
+        len = limit - sent;
+        buf[len++] = '\n';
+    }
+    int ret = 0;
+    int filtered = broadcastText(conn, buf, len, first, pool);
+    if (filtered == -1) {
+        ret = -1;
+    } else if (filtered == 1 && !first) {
+        char nl[] = "\n";
+        ret |= broadcastText(conn, nl, 1, 0, pool) == -1 ? -1 : 0;
+    }
+    if (cut && limit == pool->max_msg &&
+        sendNotice(conn, pool, "* message longer than %u bytes, cut\n", pool->max_msg) == -1) {
+        ret = -1;
+    }
+    if (last) {
+        conn->stream_chunks = 0;
+    } else if (cut || filtered == 1) {
+        conn->stream_chunks = STREAM_DISCARD;
+    } else {
+        conn->stream_chunks++;
+    }
+    return ret;
+}
+
+/**
+ * @brief Splits the bytes read from a client into lines
+ *
+ * Bytes read from a peer link, a framed connection or a WebSocket client are
+ * handed to peerInput, frameInput or wsInput instead.
+ *
+ * Complete lines are handed to handleLine straight from the read buffer. A
+ * trailing incomplete line is kept in the connection's input buffer, which is
+ * allocated only while such a line is pending. A pending line that grows to
+ * BUFFER_SIZE without a newline is streamed: each BUFFER_SIZE chunk is
+ * broadcast as soon as it is complete, so the line is never held whole, and
+ * is shared by the recipients through the ring like any broadcast. The end
+ * of a streamed line is not parsed for commands. A line that arrives whole
+ * but is longer than the maximum is refused.
+ *
+ * @param conn The connection the bytes were read from
+ * @param buffer The bytes read
+ * @param len The number of bytes read
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int processInput(conn_t* conn, char* buffer, int len, conn_pool_t* pool) {
+    if (conn->type == CONN_PEER) {
+        return peerInput(conn, buffer, len, pool);
+    }
+    if (conn->proto == PROTO_FRAME) {
+        return frameInput(conn, buffer, len, pool);
+    }
+    if (isWs(conn->proto)) {
+        return wsInput(conn, buffer, len, pool);
+    }
+    int ret = 0;
+    char *start = buffer;
+    char *end = buffer + len;
+    char *nl;
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        char *line = start;
+        int line_len = nl + 1 - start;
+        char *joined = NULL;
+        if (conn->in_len > 0) {
+            joined = realloc(conn->in_buf, conn->in_len + line_len);
+            if (joined == NULL) {
+                return -1;
+            }
+            memcpy(joined + conn->in_len, start, line_len);
+            line = joined;
+            line_len += conn->in_len;
+            conn->in_buf = NULL;
+            conn->in_len = 0;
+        }
+        if (conn->stream_chunks > 0) {
+            ret |= streamChunk(conn, line, line_len, 1, pool);
+        } else if ((unsigned int)line_len - 1 > pool->max_msg) {
+            ret |= sendNotice(conn, pool, "* message longer than %u bytes, refused\n", pool->max_msg);
+        } else {
+            ret |= handleLine(conn, line, line_len, pool);
+        }
+        free(joined);
+        start = nl + 1;
+        if (conn->type == CONN_PEER || conn->proto == PROTO_FRAME) {
+            // The rest is binary records from a peer or frames
+            return start < end ? ret | processInput(conn, start, end - start, pool) : ret;
+        }
+    }
+    if (start < end && conn->stream_chunks != STREAM_DISCARD) {
+        char *pending = realloc(conn->in_buf, conn->in_len + (end - start));
+        if (pending == NULL) {
+            return -1;
+        }
+        memcpy(pending + conn->in_len, start, end - start);
+        conn->in_buf = pending;
+        conn->in_len += end - start;
+        int off = 0;
+        while (conn->in_len - off >= BUFFER_SIZE) {
+            ret |= streamChunk(conn, conn->in_buf + off, BUFFER_SIZE, 0, pool);
+            off += BUFFER_SIZE;
+        }
+        if (off == conn->in_len || conn->stream_chunks == STREAM_DISCARD) {
+            free(conn->in_buf);
+            conn->in_buf = NULL;
+            conn->in_len = 0;
+        } else if (off > 0) {
+            // At most BUFFER_SIZE bytes stay, in a buffer at least twice as large
+            memmove(conn->in_buf, conn->in_buf + off, conn->in_len - off);
+            conn->in_len -= off;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Keeps the descriptors a client passed with the bytes just read
+ *
+ * They are offered to the "/shm" command among those bytes; the first two
+ * are kept, the rest closed at once.
+ *
+ * @param msg The message received
+ * @param pool A pointer to the connection pool structure
+ */
+static void takeFds(struct msghdr* msg, conn_pool_t* pool) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
             continue;
         }
-
-        // Handle listening socket
-        if (FD_ISSET(listen_sd, &pool->ready_read_set)) {
-            int new_sd = accept(listen_sd, NULL, NULL);
-            if (new_sd < 0) {
-                perror("Error accepting new connection");
+        int nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < nr_fds; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (pool->nr_recv_fds < 2) {
+                pool->recv_fds[pool->nr_recv_fds++] = fd;
             } else {
-                printf("New incoming connection on sd %d\n", new_sd);
-                if (addConn(new_sd, pool) == -1) {
-                    perror("Error adding new connection");
-                }
+                close(fd);
             }
         }
+    }
+}
 
-        // Handle active connections
-        curr_conn = pool->conn_head;
-        while (curr_conn != NULL) {
-            if(counter==pool->nready){
-                break;
-            }
-            conn_t* next_conn = curr_conn->next; // Store the next pointer before removing the current connection
-            int sd = curr_conn->fd;
-            if(sd==listen_sd){
-                curr_conn = curr_conn->next;
-                continue;
-            }
-            if (FD_ISSET(sd, &pool->ready_read_set)) {
-                printf("Descriptor %d is readable\n", sd);
-                counter++;
-                char buffer[BUFFER_SIZE];
-                int len = read(sd, buffer, BUFFER_SIZE);
-                if (len < 0) {
-                    perror("Error reading from client");
-                }
-                else if (len == 0) {
-                    printf("%d bytes received from sd %d\n", len, sd);
-                    removeConn(sd, pool);
-                    printf("Connection closed for sd %d\n", sd);
-                }
-                else {
-                    printf("%d bytes received from sd %d\n", len, sd);
-                    if(addMsg(sd, buffer, len, pool)==-1){
-                        perror("Failed to add mag");
-                    }
-                }
-            }
-            if (FD_ISSET(sd, &pool->ready_write_set)) {
-                counter++;
-                if (writeToClient(sd, pool) == -1) {
-                    perror("Error writing to client");
-                }
+/**
+ * @brief Reads from a client, within its read budget
+ *
+ * Reads until the socket is drained or READ_BUDGET bytes were read in this
+ * loop iteration. The rest is left in the socket, which stays readable, and
+ * is read in the next iteration after the other ready connections had
+ * their turn. Descriptors passed over a Unix socket are received along,
+ * and closed unless a "/shm" command claimed them.
+ *
+ * @param conn The connection
+ * @param pool A pointer to the connection pool structure
+ * @return 1 if the client closed the connection and it was removed, 0 otherwise
+ */
+static int readFromClient(conn_t* conn, conn_pool_t* pool) {
+    int sd = conn->fd;
+    for (int budget = READ_BUDGET; budget > 0 && !conn->closing; ) {
+        char buffer[BUFFER_SIZE];
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        struct iovec iov = { buffer, BUFFER_SIZE };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        int len = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC);
+        if (len > 0 && msg.msg_controllen > 0) {
+            takeFds(&msg, pool);
+        }
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error reading from client");
+                markClosing(conn, pool);
             }
-            curr_conn = next_conn;
+            return 0;
         }
-    } while (end_server == 0);
+        if (pool->log_level >= LOG_DEBUG) {
+            printf("%d bytes received from sd %d\n", len, sd);
+        }
+        if (len == 0) {
+            removeConn(sd, pool);
+            printf("Connection closed for sd %d\n", sd);
+            return 1;
+        }
+        // Input is read but dropped while draining, so closing does not reset the connection
+        if(!pool->draining && processInput(conn, buffer, len, pool)==-1){
+            perror("Failed to add mag");
+        }
+        while (pool->nr_recv_fds > 0) {
+            close(pool->recv_fds[--pool->nr_recv_fds]);
+        }
+        budget -= len;
+        if (len < BUFFER_SIZE) {
+            return 0; // Drained
+        }
+    }
+    return 0;
+}
 
-    // Cleanup connections
-    conn_t *curr_conn_cleanup = pool->conn_head;
-    while (curr_conn_cleanup != NULL) {
-        conn_t* next_conn = curr_conn_cleanup->next;
-        removeConn(curr_conn_cleanup->fd, pool);
-        curr_conn_cleanup = next_conn;
+/**
+ * @brief Prints the user-space memory held per connection and in shared structures
+ *
+ * Counts what the server allocated, not allocator overhead. Payloads queued
+ * to a single connection are counted with it, broadcasts held by the ring
+ * once for all.
+ *
+ * @param pool A pointer to the connection pool structure
+ */
+static void printMemReport(conn_pool_t* pool) {
+    size_t conns = 0, input = 0, msgs = 0, queued = 0, nicks = 0, links = 0, subs = 0;
+    for (conn_t *conn = pool->conn_head; conn != NULL; conn = conn->next) {
+        conns++;
+        input += conn->in_len;
+        for (msg_t *msg = conn->write_msg_head; msg != NULL; msg = msg->next) {
+            msgs++;
+            queued += sizeof(msg_t) + (msg->payload->seq == 0 ? sizeof(payload_t) + msg->payload->size + 1 : 0);
+        }
+        nicks += conn->nick != NULL ? strlen(conn->nick) + 1 : 0;
+        links += conn->link != NULL ? sizeof(*conn->link) : 0;
+        for (topic_sub_t *sub = conn->topics; sub != NULL; sub = sub->next) {
+            subs += sizeof(topic_sub_t) + sub->len;
+        }
     }
-    free(pool);
-    //close(listen_sd);
+    size_t sessions = pool->sessions.count;
+    readers_t *r = &pool->readers;
+    size_t slots = r->capacity * (sizeof(*r->cursor) + sizeof(*r->fd) + sizeof(*r->closing) + sizeof(*r->conn));
+    size_t total = conns * sizeof(conn_t) + slots + input + queued + nicks + links + subs;
+    ring_t *history = &pool->history;
+    size_t held = history->next_seq - history->first_seq;
+    printf("memory: %zu connections of %zu bytes, %zu reader slot bytes, %zu input bytes, %zu queued messages (%zu bytes), "
+           "%zu nick bytes, %zu peer link bytes, %zu subscription bytes: %.1f bytes per connection\n",
+           conns, sizeof(conn_t), slots, input, msgs, queued, nicks, links, subs, conns > 0 ? (double)total / conns : 0.0);
+    size_t mapped;
+    size_t rings = shmRings(pool, &mapped);
+    printf("memory: ring %zu bytes in %zu broadcasts, nick table %zu bytes, %zu sessions (%zu bytes), filter %zu bytes, "
+           "%zu shm rings (%zu bytes mapped), pool %zu bytes\n",
+           history->capacity * sizeof(payload_t*) + held * sizeof(payload_t) + history->bytes, held,
+           pool->nicks.capacity * sizeof(nick_slot_t), sessions,
+           pool->sessions.capacity * sizeof(session_t*) + sessions * sizeof(session_t),
+           filterBytes(pool->filter), rings, mapped, sizeof(conn_pool_t));
+    topics_t *topics = &pool->topics;
+    printf("memory: topic trie %u nodes, %zu bytes with the cache; cache hits %llu of %llu\n",
+           topics->nr_nodes, topicsBytes(topics), topics->hits, topics->lookups);
+}
 
-    return 0;
+/**
+ * @brief Removes the connections marked closing
+ *
+ * @param pool A pointer to the connection pool structure
+ */
+void removeClosing(conn_pool_t* pool) {
+    if (!pool->closing_pending) {
+        return;
+    }
+    // Connections marked while removing others (a ring's eventfd) go in the next iteration
+    pool->closing_pending = 0;
+    conn_t *conn = pool->conn_head;
+    while (conn != NULL) {
+        conn_t *next_conn = conn->next;
+        if (conn->closing) {
+            removeConn(conn->fd, pool);
+        }
+        conn = next_conn;
+    }
 }
 
+/**
+ * @brief Returns the lowest cursor of all client and peer connections
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return The lowest cursor, the published sequence number if there is no client
+ */
+unsigned long long minCursor(conn_pool_t* pool) {
+    unsigned long long min = pool->published;
+    readers_t *r = &pool->readers;
+    for (unsigned int i = 0; i < r->count; i++) {
+        if (!r->closing[i] && r->cursor[i] < min) {
+            min = r->cursor[i];
+        }
+    }
+    return min;
+}
 
 /**
- * @brief Initializes the connection pool
+ * @brief Makes room in the ring for a new broadcast
  *
- * This function initializes the connection pool by setting up the necessary
- * data structures and resetting the file descriptor sets.
+ * The slowest cursor bounds reclamation: when pushing would evict a
+ * broadcast some client has not written yet, the lag policy is applied to
+ * every client behind. LAG_DROP marks the clients that would lose
+ * broadcasts closing; they are disconnected at the end of the loop
+ * iteration, so the connection list stays intact for the caller. LAG_SKIP moves every client within LAG_SLACK of being overrun
+ * ahead of the evicted range and tells it how many broadcasts it missed; the
+ * slack keeps this from happening again on the very next push. A peer link
+ * is always dropped, a skip would go unnoticed there; it is connected again.
+ *
+ * @param pool A pointer to the connection pool structure
+ * @param size The size of the broadcast about to be pushed
+ */
+static void reclaimRing(conn_pool_t* pool, int size) {
+    unsigned long long need = ringFirstAfterPush(&pool->history, size);
+    if (need <= pool->min_cursor) {
+        return;
+    }
+    pool->min_cursor = minCursor(pool);
+    if (need <= pool->min_cursor) {
+        return;
+    }
+    unsigned long long skip_to = need + LAG_SLACK;
+    if (skip_to > pool->published) {
+        skip_to = pool->published;
+    }
+    if (skip_to < need) {
+        skip_to = need;
+    }
+    readers_t *r = &pool->readers;
+    for (unsigned int i = 0; i < r->count; i++) {
+        if (r->closing[i] || r->cursor[i] >= skip_to) {
+            continue;
+        }
+        conn_t *conn = r->conn[i];
+        if ((pool->lag_policy == LAG_DROP || conn->type == CONN_PEER) && connCursor(pool, conn) < need) {
+            printf("sd %d fell %llu messages behind, dropping\n", conn->fd, pool->published - connCursor(pool, conn));
+            markClosing(conn, pool);
+        } else if (pool->lag_policy == LAG_SKIP && connCursor(pool, conn) < skip_to) {
+            detachPartial(conn, pool);
+            if (connCursor(pool, conn) < skip_to) {
+                sendNotice(conn, pool, "* skipped %llu messages\n", skip_to - connCursor(pool, conn));
+                connCursor(pool, conn) = skip_to;
+            }
+        }
+    }
+    pool->min_cursor = minCursor(pool);
+}
+
+/**
+ * @brief Broadcasts a message to every other connection
+ *
+ * The message is stored once in a shared payload: it is passed through the
+ * content filter and the transforms and appended to the ring (and to the persistent log when
+ * enabled). No connection is touched, each one writes the broadcast from
+ * the ring when its cursor reaches it. Unless coalescing holds it back, the
+ * broadcast is published right away.
+ *
+ * @param origin The origin connection, NULL if unknown
+ * @param buffer The buffer containing the message data
+ * @param len The length of the message data
+ * @param tagged Set to prefix the message with its sender if the transforms ask for it, clear for the next chunks of a streamed line
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, 1 if the filter dropped the message, -1 on failure
+ */
+static int broadcastText(conn_t* origin, char* buffer, int len, int tagged, conn_pool_t* pool) {
+    int filtered = filterMessage(origin, buffer, len, pool);
+    if (filtered != 0) {
+        return filtered;
+    }
+    char tag[SENDER_TAG_MAX];
+    int tag_len = tagged && pool->transforms.tag && origin != NULL ? senderTag(origin, tag) : 0;
+    payload_t *payload = allocPayload(tag_len + len);
+    if (payload == NULL) {
+        return -1;
+    }
+    // Transform once for all recipients, while copying the message in
+    payload->size = runTransforms(&pool->transforms, tag_len > 0 ? tag : NULL, tag_len, buffer, len, payload->data);
+    payload->data[payload->size] = '\0';
+    if (payload->size == 0) {
+        payloadUnref(payload);
+        return 0;
+    }
+    payload->origin = origin != NULL ? origin->id : 0;
+    payload->node = pool->fed.node_id;
+    payload->cont = !tagged;
+    int ret = broadcastPayload(payload, pool);
+    payloadUnref(payload);
+    return ret;
+}
+
+/**
+ * @brief Broadcasts a message from a descriptor to every other connection
  *
+ * @param sd The socket descriptor of the origin connection
+ * @param buffer The buffer containing the message data
+ * @param len The length of the message data
  * @param pool A pointer to the connection pool structure
  * @return 0 on success, -1 on failure
  */
-int initPool(conn_pool_t* pool) {
-    if (pool == NULL) {
+int addMsg(int sd, char* buffer, int len, conn_pool_t* pool) {
+    if (pool == NULL || buffer==NULL || len<=0) {
         return -1;
     }
-    pool->maxfd = -1;
-    pool->nready = 0;
-    FD_ZERO(&pool->read_set);
-    FD_ZERO(&pool->ready_read_set);
-    FD_ZERO(&pool->write_set);
-    FD_ZERO(&pool->ready_write_set);
-    pool->conn_head=NULL;
-    pool->nr_conns = 0;
-    return 0;
+    return broadcastText(findConn(sd, pool), buffer, len, 1, pool) == -1 ? -1 : 0;
 }
 
 /**
- * @brief Adds a new connection to the connection pool
+ * @brief Appends a payload to the ring and publishes it
  *
- * This function adds a new connection to the connection pool by creating a
- * new `conn_t` structure and updating the necessary data structures.
+ * Broadcasts accepted from local clients and received from peers both go
+ * through here. While some connection uses a codec, the broadcast is
+ * compressed here, once for all of them. A payload without a node sequence number originated on this
+ * node and takes its ring sequence number. A payload larger than the
+ * ring's byte bound would not fit the ring and is dropped.
  *
- * @param sd The socket descriptor of the new connection
+ * @param payload The payload, its origin set
  * @param pool A pointer to the connection pool structure
  * @return 0 on success, -1 on failure
  */
-int addConn(int sd, conn_pool_t* pool) {
+int broadcastPayload(payload_t* payload, conn_pool_t* pool) {
+    if ((size_t)payload->size > pool->history.max_bytes) {
+        printf("Broadcast of %d bytes larger than the history, dropped\n", payload->size);
+        return 0;
+    }
+    // Compress once for every connection using a codec
+    if (pool->nr_zipping > 0 && compressPayload(payload, pool->codec_level, &pool->codec_stats) == -1) {
+        perror("Error compressing broadcast");
+    }
+    reclaimRing(pool, payload->size);
+    ringPush(&pool->history, payload);
+    if (payload->node_seq == 0) {
+        payload->node_seq = payload->seq;
+    }
+    int ret = 0;
+    if (pool->log != NULL && logAppend(pool->log, payload) == -1) {
+        ret = -1;
+    }
+    batch_t *batch = &pool->batch;
+    if (batch->len == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &batch->start);
+    }
+    batch->len += payload->size;
+    if (batch->max == 0 || batch->len >= batch->max) {
+        ret |= flushBatch(pool);
+    }
+    return ret;
+}
+
+/**
+ * @brief Publishes the broadcasts held back for coalescing
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int flushBatch(conn_pool_t* pool) {
     if (pool == NULL) {
         return -1;
     }
-    conn_t *new_conn = (conn_t *)malloc(sizeof(conn_t));
-    if (new_conn == NULL) {
+    pool->published = pool->history.next_seq;
+    pool->batch.len = 0;
+    return 0;
+}
+
+/**
+ * @brief Returns the time left before the held back broadcasts must be published
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return The time left in us, 0 if publishing is due, -1 if nothing is held back
+ */
+static long batchWaitUs(conn_pool_t* pool) {
+    batch_t *batch = &pool->batch;
+    if (batch->len == 0) {
         return -1;
     }
-    new_conn->fd = sd;
-    new_conn->write_msg_head = NULL;
-    new_conn->write_msg_tail = NULL;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - batch->start.tv_sec) * 1000000 + (now.tv_nsec - batch->start.tv_nsec) / 1000;
+    return elapsed >= (long)batch->delay_us ? 0 : batch->delay_us - elapsed;
+}
 
-    if (pool->conn_head == NULL) {
-        new_conn->prev = new_conn->next = NULL;
-        pool->conn_head = new_conn;
-    } else {
-        new_conn->prev = NULL;
-        new_conn->next = pool->conn_head;
-        pool->conn_head->prev = new_conn;
-        pool->conn_head = new_conn;
+/**
+ * @brief Adds the connections behind the published broadcasts to the write set
+ *
+ * Runs once per loop iteration and only when something was published, so
+ * the cost of fan-out does not depend on the number of broadcasts.
+ *
+ * @param pool A pointer to the connection pool structure
+ */
+static void notifyWriters(conn_pool_t* pool) {
+    if (pool->notified == pool->published) {
+        return;
     }
-    pool->nr_conns++;
-    if (sd > pool->maxfd) pool->maxfd = sd;
-    FD_SET(sd, &(pool->read_set));
-    return 0;
+    readers_t *r = &pool->readers;
+    for (unsigned int i = 0; i < r->count; i++) {
+        if (!r->closing[i] && r->cursor[i] < pool->published) {
+            FD_SET(r->fd[i], &pool->write_set);
+        }
+    }
+    pool->notified = pool->published;
 }
 
-
 /**
- * @brief Removes a connection from the connection pool
+ * @brief Rewinds the cursor of a client to replay the history ring
  *
- * This function removes a connection from the connection pool by finding the
- * corresponding `conn_t` structure, updating the necessary data structures,
- * and freeing any associated resources.
+ * Every broadcast still held by the ring from from_seq on is written to the
+ * client again (its own included), preceded by a notice telling the range
+ * replayed. Nothing is copied, the cursor just moves back.
  *
- * @param sd The socket descriptor of the connection to remove
+ * @param sd The socket descriptor of the client
+ * @param from_seq The first sequence number to replay
  * @param pool A pointer to the connection pool structure
- * @return 0 on success, -1 if the connection is not found
+ * @return The number of messages to replay, -1 on failure
  */
-int removeConn(int sd, conn_pool_t* pool) {
+int replayHistory(int sd, unsigned long long from_seq, conn_pool_t* pool) {
     if (pool == NULL) {
         return -1;
     }
-    conn_t *curr_conn = pool->conn_head;
-    while (curr_conn != NULL) {
-        if (curr_conn->fd == sd) {
-            conn_t* update_max_fd = curr_conn->next;
-            if(update_max_fd == NULL){
-                pool->maxfd =0;
-            }
-            else if(pool->maxfd==curr_conn->fd){
-                pool->maxfd=update_max_fd->fd;
-            }
-            // Remove from connection pool
-            if (curr_conn->prev != NULL) {
-                curr_conn->prev->next = curr_conn->next;
-            }else {
-                pool->conn_head = curr_conn->next;
-            }
-            if (curr_conn->next != NULL) {
-                curr_conn->next->prev = curr_conn->prev;
-            }
-            if (curr_conn->write_msg_head) {
-                // Free messages in the queue if any
-                msg_t* msg = curr_conn->write_msg_head;
-                while (msg) {
-                    msg_t* temp = msg;
-                    msg = msg->next;
-                    free(temp->message);
-                    free(temp);
-                }
-            }
-
-            close(sd);
-            FD_CLR(sd, &(pool->read_set));
-            FD_CLR(sd, &(pool->write_set));
-            free(curr_conn);
-            if(pool->maxfd==sd){
-                pool->maxfd--;
-            }
-            pool->nr_conns--;
-            printf("removing connection with sd %d \n", sd);
-            return 0;
+    conn_t *conn = findConn(sd, pool);
+    if (conn == NULL) {
+        return -1;
+    }
+    // Publish pending broadcasts first, they are already in the ring
+    if (flushBatch(pool) == -1) {
+        return -1;
+    }
+    ring_t *history = &pool->history;
+    if (from_seq < history->first_seq) {
+        from_seq = history->first_seq;
+    }
+    if (from_seq >= history->next_seq) {
+        return sendNotice(conn, pool, "* history empty\n");
+    }
+    if (from_seq < connCursor(pool, conn)) {
+        if (detachPartial(conn, pool) == -1) {
+            return -1;
         }
-        curr_conn = curr_conn->next;
+        connCursor(pool, conn) = from_seq;
+    }
+    if (connCursor(pool, conn) < pool->min_cursor) {
+        pool->min_cursor = connCursor(pool, conn);
     }
-    return -1; // Connection not found
+    conn->replay_end = history->next_seq;
+    FD_SET(conn->fd, &pool->write_set);
+    if (sendNotice(conn, pool, "* history %llu-%llu\n", connCursor(pool, conn), history->next_seq - 1) == -1) {
+        return -1;
+    }
+    return history->next_seq - connCursor(pool, conn);
+}
+
+/* The iovecs gathered for one writev and the broadcast each one belongs to. */
+typedef struct gather {
+    struct iovec iov[WRITE_IOV_MAX];
+    /* Sequence number of the broadcast of each iovec, 0 for queued messages */
+    unsigned long long seq[WRITE_IOV_MAX];
+    /* Sequence tags and frame headers of the broadcasts (see broadcastPrefix) */
+    char pre[WRITE_IOV_MAX / 2][BROADCAST_PRE_MAX];
+    int iovcnt;
+    int npre;
+} gather_t;
+
+/**
+ * @brief Adds a broadcast to the iovecs of a writev
+ *
+ * @param g The iovecs gathered so far, with room for two more
+ * @param conn The connection
+ * @param payload The broadcast
+ * @param seq Its sequence number
+ * @param off The bytes of it already written, prefix included
+ */
+static void gatherBroadcast(gather_t* g, conn_t* conn, payload_t* payload, unsigned long long seq, int off) {
+    char *pre = g->pre[g->npre];
+    int pre_len = broadcastPrefix(conn, &payload, seq, pre);
+    if (off < pre_len) {
+        g->npre++;
+        g->iov[g->iovcnt].iov_base = pre + off;
+        g->iov[g->iovcnt].iov_len = pre_len - off;
+        g->seq[g->iovcnt++] = seq;
+        off = 0;
+    } else {
+        off -= pre_len;
+    }
+    g->iov[g->iovcnt].iov_base = payload->data + off;
+    g->iov[g->iovcnt].iov_len = payload->size - off;
+    g->seq[g->iovcnt++] = seq;
 }
 
 /**
- * @brief Adds a message to the write queue of a connection
+ * @brief Writes one batch of pending messages to a client
  *
- * This function adds a message to the write queue of a connection by creating
- * a new `msg_t` structure and appending it to the connection's write queue.
+ * Gathers, in order, the rest of a partly written broadcast, the messages
+ * queued for this connection and the published broadcasts from the
+ * connection's cursor on (skipping the client's own ones), up to
+ * WRITE_IOV_MAX iovecs, and sends them with a single non-blocking writev.
+ * What was written is dropped from the queue or passed by the cursor. The
+ * connection stays in the write set while anything is left.
  *
- * @param sd The socket descriptor of the connection
- * @param buffer The buffer containing the message data
- * @param len The length of the message data
+ * @param conn The connection to write to
  * @param pool A pointer to the connection pool structure
- * @return 0 on success, -1 on failure
+ * @param limit The most bytes to write
+ * @param more Set when the whole batch was written and more is pending
+ * @return The number of bytes written, -1 on failure
  */
-int addMsg(int sd, char* buffer, int len, conn_pool_t* pool) {
-    if (pool == NULL || buffer==NULL || len<=0) {
-        return -1;
+static ssize_t writeBatch(conn_t* conn, conn_pool_t* pool, size_t limit, int* more) {
+    *more = 0;
+    if (conn->proto == PROTO_WS_HANDSHAKE || conn->proto == PROTO_WS_CLOSING) {
+        // No broadcast before the upgrade response nor after the close frame
+        if (detachPartial(conn, pool) == -1) {
+            return -1;
+        }
+        connCursor(pool, conn) = pool->published;
     }
-    conn_t *curr_conn = pool->conn_head;
-    while (curr_conn != NULL && curr_conn->next != NULL) {
-        if (curr_conn->fd != sd) {
-            // Allocate and populate new message
-            msg_t *new_msg = (msg_t*)malloc(sizeof(msg_t));
-            if (new_msg == NULL) {
-                return -1;
+    ring_t *history = &pool->history;
+    gather_t g;
+    g.iovcnt = g.npre = 0;
+    // Iovecs taken by one broadcast
+    int per_msg = conn->proto == PROTO_FRAME || conn->session != NULL ? 2 : 1;
+    payload_t *partial = conn->cursor_off > 0 ? ringGet(history, connCursor(pool, conn)) : NULL;
+    if (partial == NULL) {
+        conn->cursor_off = 0;
+    } else {
+        gatherBroadcast(&g, conn, partial, connCursor(pool, conn), conn->cursor_off);
+    }
+    for (msg_t *msg = conn->write_msg_head; msg != NULL && g.iovcnt < WRITE_IOV_MAX; msg = msg->next) {
+        g.iov[g.iovcnt].iov_base = msg->payload->data + msg->offset;
+        g.iov[g.iovcnt].iov_len = msg->len;
+        g.seq[g.iovcnt++] = 0;
+    }
+    unsigned long long seq = connCursor(pool, conn) + (conn->cursor_off > 0);
+    if (seq < history->first_seq) {
+        seq = history->first_seq;
+    }
+    for (; seq < pool->published && g.iovcnt + per_msg <= WRITE_IOV_MAX; seq++) {
+        payload_t *payload = ringGet(history, seq);
+        if (payload == NULL || (payload->origin == conn->id && seq >= conn->replay_end)) {
+            continue; // Own broadcast
+        }
+        if (conn->proto == PROTO_WS && wsFrame(payload) == NULL) {
+            perror("Error framing broadcast");
+            continue;
+        }
+        gatherBroadcast(&g, conn, payload, seq, 0);
+    }
+    // Every broadcast below seq is gathered or skipped
+    unsigned long long scanned = seq;
+    struct iovec *iov = g.iov;
+    int iovcnt = g.iovcnt;
+    int i = 0;
+    ssize_t written = 0;
+    if (iovcnt > 0) {
+        // Cut the batch at the limit, the iovec cut keeps its length for the bookkeeping below
+        int send_cnt = iovcnt;
+        size_t cut_len = 0;
+        size_t total = 0;
+        for (int k = 0; k < iovcnt; k++) {
+            if (total + iov[k].iov_len > limit) {
+                cut_len = iov[k].iov_len;
+                iov[k].iov_len = limit - total;
+                send_cnt = k + 1;
+                break;
             }
-            new_msg->message = (char *)malloc(len + 1);
-            if (new_msg->message == NULL) {
-                free(new_msg);
-                return -1;
+            total += iov[k].iov_len;
+        }
+        ssize_t ret = writev(conn->fd, iov, send_cnt);
+        if (cut_len > 0) {
+            iov[send_cnt - 1].iov_len = cut_len;
+        }
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
             }
-            strncpy(new_msg->message, buffer, len);
-            new_msg->message[len] = '\0';
-            new_msg->size = len;
-            new_msg->prev = new_msg->next = NULL;
-            // Add message to connection's write queue
-            if (curr_conn->write_msg_head == NULL) {
-                curr_conn->write_msg_head = new_msg;
-                curr_conn->write_msg_tail = new_msg;
+            perror("send failed\n");
+            return -1;
+        } else if (ret == 0) {
+            // Handle the case where the write returns 0
+            // It could indicate that the other end of the connection closed
+            // or that the socket buffer is full.
+            return -1;
+        }
+        written = ret;
+        // Drop what was written, remember where a partly written message stopped
+        for (; i < iovcnt && (size_t)ret >= iov[i].iov_len; i++) {
+            ret -= iov[i].iov_len;
+            if (g.seq[i] == 0) {
+                msg_t *msg = conn->write_msg_head;
+                conn->write_msg_head = msg->next;
+                if (conn->write_msg_ctrl == msg) {
+                    conn->write_msg_ctrl = NULL;
+                }
+                payloadUnref(msg->payload);
+                free(msg);
+            } else if (i + 1 == iovcnt || g.seq[i + 1] != g.seq[i]) {
+                connCursor(pool, conn) = g.seq[i] + 1;
+                conn->cursor_off = 0;
             } else {
-                curr_conn->write_msg_tail->next = new_msg;
-                new_msg->prev = curr_conn->write_msg_tail;
-                curr_conn->write_msg_tail = new_msg;
+                // Prefix written, its message is next
+                if (connCursor(pool, conn) != g.seq[i]) {
+                    connCursor(pool, conn) = g.seq[i];
+                    conn->cursor_off = 0;
+                }
+                conn->cursor_off += iov[i].iov_len;
             }
-            // Update file descriptor set
-            FD_SET(curr_conn->fd, &pool->write_set);
         }
-        curr_conn = curr_conn->next;
+        if (i < iovcnt && g.seq[i] == 0) {
+            conn->write_msg_head->offset += ret;
+            conn->write_msg_head->len -= ret;
+            if (ret > 0 && conn->write_msg_ctrl == NULL) {
+                // Partly written, nothing overtakes it
+                conn->write_msg_ctrl = conn->write_msg_head;
+            }
+        } else if (i < iovcnt && ret > 0) {
+            if (conn->cursor_off == 0 || connCursor(pool, conn) != g.seq[i]) {
+                connCursor(pool, conn) = g.seq[i];
+                conn->cursor_off = 0;
+            }
+            conn->cursor_off += ret;
+        }
     }
-    return 0;
+    if (i == iovcnt) {
+        connCursor(pool, conn) = scanned;
+    }
+    if (conn->write_msg_head == NULL) {
+        conn->write_msg_tail = NULL;
+    } else {
+        conn->write_msg_head->prev = NULL;
+    }
+    if (conn->write_msg_head == NULL && conn->cursor_off == 0 && connCursor(pool, conn) >= pool->published) {
+        FD_CLR(conn->fd, &pool->write_set); // Nothing left to write for this client
+        if (conn->proto == PROTO_WS_CLOSING) {
+            // The close frame or the error response is out
+            markClosing(conn, pool);
+        }
+    } else {
+        *more = i == iovcnt;
+    }
+    return written;
 }
 
 /**
- * @brief Writes messages from the write queue to a client
+ * @brief Writes pending messages to a client, within its write budget
  *
- * This function iterates through the connections in the connection pool and
- * writes any pending messages from the write queue to the corresponding client.
- * It converts the messages to uppercase before sending them.
+ * Batches are written until the client's socket is full, nothing is left
+ * or WRITE_BUDGET bytes were written in this loop iteration. A client with
+ * more pending stays in the write set and continues in the next iteration,
+ * after the other ready connections had their turn.
  *
- * @param sender_sd The socket descriptor of the sender connection
+ * On a socket paced with TCP_NOTSENT_LOWAT, no more is written than keeps
+ * the bytes not sent yet under the low-water mark. The rest waits in the
+ * ring and the queue, where it is coalesced with later messages or dropped
+ * by the lag policy, instead of in the kernel's send buffer.
+ *
+ * @param sd The socket descriptor of the connection to write to
  * @param pool A pointer to the connection pool structure
  * @return 0 on success, -1 on failure
  */
-int writeToClient(int sender_sd, conn_pool_t* pool) {
+int writeToClient(int sd, conn_pool_t* pool) {
     if (pool == NULL) {
         return -1;
     }
-    conn_t *curr_conn = pool->conn_head;
-    while (curr_conn != NULL) {
-        if (FD_ISSET(curr_conn->fd, &pool->write_set) && curr_conn->write_msg_head != NULL) {
-            msg_t *msg = curr_conn->write_msg_head;
-            // Convert message to uppercase
-            for (int i = 0; i < msg->size; ++i) {
-                msg->message[i] = toupper((unsigned char)msg->message[i]);
-            }
-            int bytes_written = 0;
-            while (bytes_written < msg->size) {
-                int ret = write(curr_conn->fd, msg->message + bytes_written, msg->size - bytes_written);
-                if (ret < 0) {
-                    perror("send failed\n");
-                    return -1;
-                } else if (ret == 0) {
-                    // Handle the case where the write returns 0
-                    // It could indicate that the other end of the connection closed
-                    // or that the socket buffer is full.
-                    return -1;
-                } else {
-                    bytes_written += ret;
-                }
-            }
-            curr_conn->write_msg_head = msg->next;
-            if (curr_conn->write_msg_head == NULL) {
-                curr_conn->write_msg_tail = NULL;
-            }
-            free(msg->message);
-            free(msg);
+    conn_t *conn = findConn(sd, pool);
+    if (conn == NULL) {
+        return -1;
+    }
+    if (conn->closing) {
+        return 0;
+    }
+    if (conn->type == CONN_PEER) {
+        return writeToPeer(conn, pool);
+    }
+    ssize_t budget = WRITE_BUDGET;
+    int unsent;
+    if (conn->paced && ioctl(conn->fd, SIOCOUTQNSD, &unsent) == 0) {
+        int room = pool->sock_opts.notsent_lowat - unsent;
+        if (room <= 0) {
+            return 0; // Select reports the socket writable once it drained below the mark
+        }
+        if (budget > room) {
+            budget = room;
         }
-        FD_CLR(curr_conn->fd, &pool->write_set); // Clear the write flag for this client
-        curr_conn = curr_conn->next;
     }
-    return 0; // No message sent
+    int more = 1;
+    while (more && budget > 0 && !conn->closing) {
+        ssize_t written = writeBatch(conn, pool, budget, &more);
+        if (written < 0) {
+            return -1;
+        }
+        budget -= written;
+    }
+    return 0;
 }
-
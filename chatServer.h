@@ -10,9 +10,99 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
-#include <ctype.h> // Include header for toupper function
+#include <sys/uio.h>
+#include <time.h>
+#include <ctype.h>
+#include "ring.h"
+#include "msglog.h"
+#include "peer.h"
+#include "nick.h"
+#include "frame.h"
+#include "codec.h"
+#include "ws.h"
+#include "session.h"
+#include "transform.h"
+#include "filter.h"
+#include "topic.h"
+#include "shm.h"
+#include "config.h"
 
+#define USAGE "Usage: Server [-l logdir] [-F fsync_ms] [-u upgrade_socket] [-b batch_bytes [-d batch_delay_us]] [-S drop|skip] [-z zlib_level] [-G session_grace_ms] [-T transform[,transform]...] [-f filter_file [-A drop|mask]] [-M max_message_bytes] [-D drain_ms] [-C cpu] [-B spin_us] [-c config_file] [-L info|debug] [-w ws_port] [-U unix_path|@abstract_name]... [-o nodelay|sndbuf=n|rcvbuf=n|notsent_lowat=n|busy_poll=us]... [-N node_id] [-P peer_host:port]... <port>\n"
 #define BUFFER_SIZE 4096
+/*
+ * Longest message accepted from a client unless -M is given. A line longer
+ * than BUFFER_SIZE is streamed: it is broadcast in BUFFER_SIZE chunks as it
+ * arrives, and cut at the maximum.
+ */
+#define MESSAGE_MAX (1 << 20)
+/* Value of stream_chunks while the rest of a line cut at the maximum is discarded. */
+#define STREAM_DISCARD 0xFFFF
+/*
+ * Longest time SIGINT or SIGTERM waits for the queued broadcasts and
+ * messages to be written before closing, unless -D is given.
+ */
+#define DRAIN_MS 5000
+/* Number of recent broadcasts kept for replay, also how far a client may fall behind. */
+#define HISTORY_LEN 1024
+/* Upper bound for the bytes held by the history ring. */
+#define HISTORY_BYTES (1 << 20)
+/* Maximal number of messages sent by one writev. */
+#define WRITE_IOV_MAX 64
+/* Longest prefix naming the sender of a message. */
+#define SENDER_TAG_MAX (NICK_MAX + 24)
+/* Longest prefix written before a broadcast: sequence tag and frame header. */
+#define BROADCAST_PRE_MAX (SESSION_TAG_MAX + sizeof(frame_hdr_t))
+/* Bytes a connection may read and write per loop iteration before the others get their turn. */
+#define READ_BUDGET (4 * BUFFER_SIZE)
+#define WRITE_BUDGET (1 << 16)
+
+/* What to do with a client whose cursor is about to be overrun by the ring. */
+#define LAG_DROP 0      /* disconnect it */
+#define LAG_SKIP 1      /* move its cursor ahead, it loses the broadcasts skipped */
+/* Clients within this many broadcasts of being overrun are skipped along with the overrun ones. */
+#define LAG_SLACK (HISTORY_LEN / 8)
+
+/*
+ * Broadcasts held back for coalescing during the current loop iteration (or delay window).
+ *
+ * Broadcasts enter the ring right away, but connections only write up to the
+ * pool's published sequence number. With coalescing enabled, publishing
+ * waits for the end of the loop iteration, the delay or the size limit, so
+ * each recipient picks up all broadcasts of the batch with one writev.
+ */
+typedef struct batch {
+        /* Number of bytes broadcast but not published yet. */
+        int len;
+        /* Batch size that triggers publishing, 0 when coalescing is disabled. */
+        int max;
+        /* Longest time in us a message may wait in the batch, 0 to publish every loop iteration. */
+        unsigned int delay_us;
+        /* Time the first message of the batch was broadcast. */
+        struct timespec start;
+}batch_t;
+/*
+ * Hot fields of the connections writing from the ring (CONN_CLIENT and
+ * CONN_PEER), kept in contiguous arrays indexed by the connection's slot.
+ *
+ * Fan-out scans (publishing, the lowest cursor, the lag policy) walk these
+ * arrays linearly instead of chasing the connection list through the
+ * heap. A removed connection's slot is filled with the last one, so the
+ * arrays stay dense.
+ */
+typedef struct readers {
+        /* Sequence number of the next broadcast to write, per slot. */
+        unsigned long long *cursor;
+        /* Descriptor, per slot. */
+        int *fd;
+        /* Set when the connection is closing, per slot. */
+        unsigned char *closing;
+        /* Connection of each slot. */
+        struct conn **conn;
+        /* Number of slots in use. */
+        unsigned int count;
+        /* Number of slots allocated. */
+        unsigned int capacity;
+}readers_t;
 /* 
  * Data structure to keep track of active client connections (not the for main socket).
  */
@@ -33,6 +123,80 @@ typedef struct conn_pool {
         struct conn *conn_head;
         /* Number of active client connections. */
         unsigned int nr_conns;
+        /* 
+         * Ring of recent broadcasts, shared by all connections. Each client
+         * connection keeps a cursor into it instead of a queue of its own.
+         */
+        ring_t history;
+        /* Cursors and other hot fields of the connections writing from the ring. */
+        readers_t readers;
+        /* Broadcasts below this sequence number are visible to the connections. */
+        unsigned long long published;
+        /* Published sequence number the write set was last updated for. */
+        unsigned long long notified;
+        /* Lower bound of the cursors of all client connections. */
+        unsigned long long min_cursor;
+        /* One of the LAG_* policies. */
+        int lag_policy;
+        /* Id given to the next connection. */
+        unsigned long long next_conn_id;
+        /* Set when some connection is marked closing. */
+        int closing_pending;
+        /* Set once shutdown started: nothing is accepted or read, the queues are written out. */
+        int draining;
+        /* Longest time the queues are written out for after SIGINT or SIGTERM, 0 to close at once. */
+        unsigned int drain_ms;
+        /* Time the connections are closed at, drained or not. */
+        struct timespec drain_deadline;
+        /* Time the loop polls without blocking before select blocks, in us, 0 to always block. */
+        unsigned int spin_us;
+        /* Connection objects indexed by descriptor. */
+        struct conn *by_fd[FD_SETSIZE];
+        /* Persistent message log, NULL when disabled. */
+        struct msglog *log;
+        /* Broadcasts not published yet. */
+        batch_t batch;
+        /* Node id and peer links of this server. */
+        federation_t fed;
+        /* Connections by nickname, for direct messages. */
+        nick_table_t nicks;
+        /* zlib level broadcasts are compressed with, 0 to disable compression. */
+        int codec_level;
+        /* Number of connections using a codec, broadcasts are compressed only while there is one. */
+        unsigned int nr_zipping;
+        /* Compression counters. */
+        codec_stats_t codec_stats;
+        /* Options of accepted client sockets. */
+        sock_opts_t sock_opts;
+        /* Connection the next loop iteration starts serving from, NULL for the head. */
+        struct conn *sched_start;
+        /* Number of the current loop iteration, to serve each connection once per iteration. */
+        unsigned int sched_round;
+        /* Resumable sessions by token, attached or detached. */
+        session_table_t sessions;
+        /* Time a detached session is kept. */
+        unsigned int session_grace_ms;
+        /* Transforms text broadcasts and direct messages go through. */
+        transforms_t transforms;
+        /* Content filter, NULL when disabled. */
+        filter_t *filter;
+        /* FILTER_DROP or FILTER_MASK: what is done with a message matching the filter. */
+        int filter_action;
+        /* Topic subscriptions. */
+        topics_t topics;
+        /* Longest message accepted from a client, in bytes. */
+        unsigned int max_msg;
+        /* Shared memory rings of local clients. */
+        shm_ring_t *shm_rings;
+        /* Descriptors received with the bytes being handled, claimed by "/shm", closed after. */
+        int recv_fds[2];
+        int nr_recv_fds;
+        /* Config file read again on SIGHUP and "/reload", NULL if none. */
+        const char *config_path;
+        /* Defaults and command line keys, the file is applied on top of them. */
+        config_t config_base;
+        /* LOG_INFO or LOG_DEBUG. */
+        int log_level;
         
 }conn_pool_t;
 
@@ -41,41 +205,114 @@ typedef struct conn_pool {
  * complete line of message from a client.  
  *
  * The message objects are maintained per connection in a doubly-linked list. 
- * When a message is read from one connection, it is added to the list of all other connections.
+ * Broadcasts are not queued here: they are written from the shared ring at
+ * the connection's cursor. The list holds messages for this connection only,
+ * such as server notices.
  *
- * A message is added to the list only when a complete line has been read from
- * the client. 
+ * The message bytes live in a reference counted payload, which may be shared.
  */
 typedef struct msg {
         /* Points to the previous message object in the doubly-linked list. */
         struct msg *prev;
         /* Points to the next message object in the doubly-linked list. */
         struct msg *next;
-        /* Points to a dynamically allocated buffer holding the message. */
-        char *message;
-        /* Size of the message. */
-        int size;
+        /* Points to the shared payload holding the message. */
+        struct payload *payload;
+        /* Slice of the payload to write: offset and length. */
+        int offset;
+        int len;
 }msg_t;
 
+/* Lanes of a connection's write queue, see queueLane. */
+#define LANE_CHAT 0     /* direct and topic messages: written in order, after the control lane */
+#define LANE_CONTROL 1  /* notices, acks and pongs: written before the chat lane */
+#define LANE_SWITCH 2   /* protocol switch: written after everything queued before it, control included */
+
+/* Connection types: what a descriptor in the pool is used for. */
+#define CONN_CLIENT 0   /* chat client */
+#define CONN_LISTEN 1   /* listening socket accepting clients */
+#define CONN_UPGRADE 2  /* Unix socket accepting a new server process taking over */
+#define CONN_PEER 3     /* link to another chat server */
+#define CONN_SIGNAL 4   /* signalfd the server's signals are read from */
+#define CONN_SHM 5      /* eventfd a shared memory ring's client wakes the server with */
+/* Connections writing broadcasts from the ring at their own cursor. */
+#define readsRing(conn) ((conn)->type == CONN_CLIENT || (conn)->type == CONN_PEER)
+/* Sequence number of the next broadcast to write on a connection that reads the ring. */
+#define connCursor(pool, conn) ((pool)->readers.cursor[(conn)->slot])
+
 /*
  * Data structure to keep track of client connection state.
  *
  * The connection objects are also maintained in a global doubly-linked list.
  * There is a dummy connection head at the beginning of the list.
+ *
+ * An idle connection costs only this structure: input, queued messages,
+ * nickname and peer state are allocated while in use and freed after. The
+ * fields are ordered by size so the structure has no padding holes.
  */
 typedef struct conn {
         /* Points to the previous connection object in the doubly-linked list. */
         struct conn *prev;      
         /* Points to the next connection object in the doubly-linked list. */
         struct conn *next;      
-        /* File descriptor associated with this connection. */
-        int fd;                 
         /* 
          * Pointers for the doubly-linked list of messages that
          * have to be written out on this connection.
          */
         struct msg *write_msg_head;
 		struct msg *write_msg_tail;
+        /*
+         * Message the next control message is queued after, NULL to queue
+         * it first: the last control message, or a message nothing may
+         * overtake (partly written or switching protocols). The messages up
+         * to it are the control lane, the rest the chat lane.
+         */
+        struct msg *write_msg_ctrl;
+        /* 
+         * Incomplete line read from the client so far. Allocated only while a
+         * line is pending, NULL otherwise.
+         */
+        char *in_buf;
+        /* Peer link state, NULL unless the connection is a CONN_PEER. */
+        struct peer_link *link;
+        /* Nickname registered with /nick, NULL if none. */
+        char *nick;
+        /* Resumable session opened with /session or /resume, NULL if none. */
+        struct session *session;
+        /* Topic subscriptions, NULL if none. */
+        struct topic_sub *topics;
+        /* Unique id of the connection, recorded as the origin of its broadcasts. */
+        unsigned long long id;
+        /* Broadcasts below this sequence number are written even to their origin (history replay). */
+        unsigned long long replay_end;
+        /* File descriptor associated with this connection. */
+        int fd;                 
+        /* Bytes of the broadcast at cursor already written, sequence tag and frame header included. */
+        int cursor_off;
+        /* Number of bytes in in_buf. */
+        int in_len;
+        /* Loop iteration the connection was last served in. */
+        unsigned int sched_round;
+        /* Stamp of the last topic resolved with the connection among its subscribers. */
+        unsigned int topic_round;
+        /* Slot of the connection in the pool's readers, -1 unless it reads the ring (see connCursor). */
+        int slot;
+        /*
+         * Number of BUFFER_SIZE chunks of the current line already broadcast,
+         * 0 unless a line is being streamed, STREAM_DISCARD while the rest of
+         * a line cut at the maximum is discarded.
+         */
+        unsigned short stream_chunks;
+        /* One of the CONN_* types. Only CONN_CLIENT and CONN_PEER connections receive messages. */
+        unsigned char type;
+        /* One of the PROTO_* values: how a client connection frames its messages, for a listener those of the clients it accepts. */
+        unsigned char proto;
+        /* One of the CODEC_* values: how broadcasts are compressed for a framed connection. */
+        unsigned char codec;
+        /* Set when the connection is to be closed at the end of the loop iteration. */
+        unsigned char closing;
+        /* Set when writes are paced by the socket's TCP_NOTSENT_LOWAT. */
+        unsigned char paced;
 }conn_t;
 
 /*
@@ -93,6 +330,38 @@ int initPool(conn_pool_t* pool);
  */
 int addConn(int sd, conn_pool_t* pool);
 
+/*
+ * Add a descriptor of any CONN_* type to the pool. 
+ * @ sd - the descriptor
+ * @ type - the connection type
+ * @pool - the pool 
+ * @ return value - the new connection, NULL on failure 
+ */
+conn_t* newConn(int sd, int type, conn_pool_t* pool);
+
+/*
+ * Apply the configured socket options to a client socket, resetting the TCP options no longer configured. 
+ * @ conn - the client connection
+ * @ old - the options the socket had, NULL for a new socket
+ * @pool - the pool 
+ */
+void tuneSocket(conn_t* conn, const sock_opts_t* old, conn_pool_t* pool);
+
+/*
+ * Mark a connection to be removed at the end of the loop iteration. 
+ * @ conn - the connection
+ * @pool - the pool 
+ */
+void markClosing(conn_t* conn, conn_pool_t* pool);
+
+/*
+ * Move the unwritten rest of a partly written broadcast to the write queue, before the cursor jumps. 
+ * @ conn - the connection
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure 
+ */
+int detachPartial(conn_t* conn, conn_pool_t* pool);
+
 /*
  * Remove connection when a client closes connection, or clean memory if server stops. 
  * @ sd - the socket descriptor of the connection to remove
@@ -111,6 +380,123 @@ int removeConn(int sd, conn_pool_t* pool);
  */
 int addMsg(int sd,char* buffer,int len,conn_pool_t* pool);
 
+/*
+ * Register a nickname, telling the client whether it was taken, refused or registered. 
+ * @ conn - the connection
+ * @ nick - the nickname, not necessarily NUL terminated
+ * @ len - the length of the nickname
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure
+ */
+int registerNick(conn_t* conn, const char* nick, int len, conn_pool_t* pool);
+
+/*
+ * Run a message from a client through the content filter, telling the client if it is dropped.
+ * @ conn - the sending connection, NULL if unknown
+ * @ buf - the message, masked in place under FILTER_MASK
+ * @ len - the length of the message
+ * @pool - the pool 
+ * @ return value - 1 if the message is dropped, 0 if it passes, -1 on failure
+ */
+int filterMessage(conn_t* conn, char* buf, int len, conn_pool_t* pool);
+
+/*
+ * Handle one complete line read from a client: a command or a broadcast. 
+ * @ conn - the connection
+ * @ line - the line, including its newline
+ * @ len - length of the line
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure 
+ */
+int handleLine(conn_t* conn, char* line, int len, conn_pool_t* pool);
+
+/*
+ * Handle bytes read from a connection, or written to its shared memory ring. 
+ * @ conn - the connection
+ * @ buffer - the bytes, which may be changed in place
+ * @ len - the number of bytes
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure
+ */
+int processInput(conn_t* conn, char* buffer, int len, conn_pool_t* pool);
+
+/*
+ * Broadcast a payload to every connection, whether accepted from a client or received from a peer. 
+ * @ payload - the payload, its origin set; the ring takes its own reference
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure 
+ */
+int broadcastPayload(struct payload* payload, conn_pool_t* pool);
+
+/*
+ * Queue a printf style formatted line to a single connection. 
+ * @ conn - the connection
+ * @pool - the pool 
+ * @ fmt - the format of the line
+ * @ return value - 0 on success, -1 on failure 
+ */
+int sendNotice(conn_t* conn, conn_pool_t* pool, const char* fmt, ...);
+
+/*
+ * Add a shared payload to the write queue of a connection, without copying it. 
+ * @ conn - the connection
+ * @ payload - the payload, referenced by the queue entry
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure 
+ */
+int queueMsg(conn_t* conn, struct payload* payload, conn_pool_t* pool);
+
+/*
+ * Add a shared payload to a lane of the write queue of a connection. 
+ * @ conn - the connection
+ * @ payload - the payload, referenced by the queue entry
+ * @ lane - one of the LANE_* values
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure 
+ */
+int queueLane(conn_t* conn, struct payload* payload, int lane, conn_pool_t* pool);
+
+/*
+ * Add a slice of a shared payload to a lane of the write queue of a connection. 
+ * @ conn - the connection
+ * @ payload - the payload, referenced by the queue entry
+ * @ offset - offset of the slice in the payload
+ * @ len - length of the slice
+ * @ lane - one of the LANE_* values
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure 
+ */
+int queueSlice(conn_t* conn, struct payload* payload, int offset, int len, int lane, conn_pool_t* pool);
+
+/*
+ * Publish the coalesced broadcasts to every connection. 
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 on failure 
+ */
+int flushBatch(conn_pool_t* pool);
+
+/*
+ * Remove the connections marked closing. 
+ * @pool - the pool 
+ */
+void removeClosing(conn_pool_t* pool);
+
+/*
+ * Lowest cursor of all client and peer connections. 
+ * @pool - the pool 
+ * @ return value - the lowest cursor, the published sequence number if there is no client 
+ */
+unsigned long long minCursor(conn_pool_t* pool);
+
+/*
+ * Rewind the cursor of a client to replay the broadcasts still held in the history ring.
+ * @ sd - the socket descriptor of the client
+ * @ from_seq - the first sequence number to replay
+ * @pool - the pool 
+ * @ return value - number of messages to replay, -1 on failure 
+ */
+int replayHistory(int sd, unsigned long long from_seq, conn_pool_t* pool);
+
 /*
  * Write msg to client. 
  * @ sd - the socket descriptor of the connection to write msg to
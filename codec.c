@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "codec.h"
+
+/**
+ * @brief Looks up a codec by name
+ *
+ * @param name The codec name
+ * @return One of the CODEC_* values, -1 if unknown
+ */
+int codecByName(const char* name) {
+    if (strcmp(name, "none") == 0) {
+        return CODEC_NONE;
+    }
+    if (strcmp(name, "deflate") == 0) {
+        return CODEC_DEFLATE;
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns the name of a codec
+ *
+ * @param codec One of the CODEC_* values
+ * @return The name
+ */
+const char* codecName(int codec) {
+    return codec == CODEC_DEFLATE ? "deflate" : "none";
+}
+
+/**
+ * @brief Returns the CPU time used by the calling thread
+ *
+ * @return The CPU time in ns
+ */
+static unsigned long long cpuNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Compresses a message into a buffer
+ *
+ * One deflate stream is kept and reset between messages, so its state is
+ * not allocated again for every broadcast.
+ *
+ * @param data The message
+ * @param len The size of the message
+ * @param out The output buffer, at least compressBound(len) bytes
+ * @param out_len Set to the size of the compressed message
+ * @param level The zlib compression level
+ * @return 0 on success, -1 on failure
+ */
+static int deflateMsg(const char* data, int len, char* out, uLongf* out_len, int level) {
+    static z_stream zs;
+    static int zs_level = -1;
+    if (zs_level != level) {
+        if (zs_level != -1) {
+            deflateEnd(&zs);
+        }
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit(&zs, level) != Z_OK) {
+            zs_level = -1;
+            return -1;
+        }
+        zs_level = level;
+    } else if (deflateReset(&zs) != Z_OK) {
+        return -1;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = *out_len;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    *out_len = zs.total_out;
+    return 0;
+}
+
+/**
+ * @brief Compresses a broadcast once for every compressing connection
+ *
+ * @param p The payload
+ * @param level The zlib compression level
+ * @param stats The counters to update
+ * @return 0 on success, -1 on failure
+ */
+int compressPayload(payload_t* p, int level, codec_stats_t* stats) {
+    if (p->size < CODEC_MIN_SIZE || p->zipped != NULL) {
+        return 0;
+    }
+    unsigned long long start = cpuNs();
+    uLongf zlen = compressBound(p->size);
+    char *buf = malloc(sizeof(uint32_t) + zlen);
+    if (buf == NULL) {
+        return -1;
+    }
+    uint32_t size = htonl(p->size);
+    memcpy(buf, &size, sizeof(size));
+    if (deflateMsg(p->data, p->size, buf + sizeof(size), &zlen, level) == -1) {
+        free(buf);
+        return -1;
+    }
+    int ret = 0;
+    if (sizeof(size) + zlen < (size_t)p->size) {
+        p->zipped = newPayload(buf, sizeof(size) + zlen);
+        ret = p->zipped == NULL ? -1 : 0;
+    }
+    free(buf);
+    stats->msgs++;
+    stats->bytes_in += p->size;
+    stats->bytes_out += p->zipped != NULL ? (unsigned long long)p->zipped->size : (unsigned long long)p->size;
+    stats->cpu_ns += cpuNs() - start;
+    return ret;
+}
+
+/**
+ * @brief Prints the compression ratio and CPU cost per message
+ *
+ * @param stats The counters
+ */
+void printCodecStats(const codec_stats_t* stats) {
+    if (stats->msgs == 0) {
+        return;
+    }
+    printf("compression: %llu messages, %llu -> %llu bytes (ratio %.2f), %.1f us CPU per message\n",
+           stats->msgs, stats->bytes_in, stats->bytes_out,
+           (double)stats->bytes_in / stats->bytes_out, stats->cpu_ns / 1000.0 / stats->msgs);
+}
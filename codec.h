@@ -0,0 +1,61 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "ring.h"
+
+/*
+ * Compression of broadcasts for framed connections.
+ *
+ * A framed client may ask for a codec when switching to frames
+ * ("/binary deflate"). While any connection uses a codec, every broadcast
+ * of at least CODEC_MIN_SIZE bytes is compressed once, when it enters the
+ * ring, and the compressed payload hangs off the broadcast's payload, shared
+ * by all those connections. They receive it as a FRAME_ZMSG whose payload
+ * is the 4-byte size of the message in network byte order followed by the
+ * zlib stream. Broadcasts that do not shrink are sent as plain FRAME_MSG.
+ */
+#define CODEC_NONE 0
+#define CODEC_DEFLATE 1
+
+/* Smaller broadcasts are not worth compressing. */
+#define CODEC_MIN_SIZE 128
+/* Default zlib compression level. */
+#define CODEC_LEVEL 6
+
+/* Compression counters, for reporting. */
+typedef struct codec_stats {
+        /* Broadcasts compressed, including the ones that did not shrink. */
+        unsigned long long msgs;
+        /* Bytes before and after compression. */
+        unsigned long long bytes_in;
+        unsigned long long bytes_out;
+        /* CPU time spent compressing in ns. */
+        unsigned long long cpu_ns;
+}codec_stats_t;
+
+/*
+ * Look up a codec by name.
+ * @ return value - one of the CODEC_* values, -1 if unknown
+ */
+int codecByName(const char* name);
+
+/*
+ * Name of a codec.
+ */
+const char* codecName(int codec);
+
+/*
+ * Compress a broadcast, attaching the compressed payload to it.
+ * @ p - the payload
+ * @ level - the zlib compression level
+ * @ stats - the counters to update
+ * @ return value - 0 on success (p->zipped stays NULL if it did not shrink), -1 on failure
+ */
+int compressPayload(payload_t* p, int level, codec_stats_t* stats);
+
+/*
+ * Print the compression ratio and CPU cost per message.
+ */
+void printCodecStats(const codec_stats_t* stats);
+
+#endif
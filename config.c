@@ -0,0 +1,266 @@
+#include <errno.h>
+#include "chatServer.h"
+
+/* A key of the config file and its command line option. */
+typedef struct config_key {
+        const char *name;
+        char opt;
+}config_key_t;
+
+static const config_key_t keys[] = {
+    { "batch_bytes", 'b' },
+    { "batch_delay_us", 'd' },
+    { "lag_policy", 'S' },
+    { "zlib_level", 'z' },
+    { "session_grace_ms", 'G' },
+    { "transforms", 'T' },
+    { "filter_file", 'f' },
+    { "filter_action", 'A' },
+    { "max_message_bytes", 'M' },
+    { "drain_ms", 'D' },
+    { "spin_us", 'B' },
+    { "socket", 'o' },
+    { "log_level", 'L' },
+};
+#define NR_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+/**
+ * @brief Initializes a configuration with the defaults
+ *
+ * @param cfg The configuration
+ */
+void initConfig(config_t* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->lag_policy = LAG_DROP;
+    cfg->codec_level = CODEC_LEVEL;
+    cfg->session_grace_ms = SESSION_GRACE_MS;
+    parseTransforms(TRANSFORMS_DEFAULT, &cfg->transforms);
+    cfg->filter_action = FILTER_DROP;
+    cfg->max_msg = MESSAGE_MAX;
+    cfg->drain_ms = DRAIN_MS;
+    cfg->log_level = LOG_DEBUG;
+}
+
+/**
+ * @brief Parses a decimal number within bounds
+ *
+ * @param s The number
+ * @param min The lowest value accepted
+ * @param max The highest value accepted
+ * @param value Set to the number
+ * @return 0 on success, -1 if it is not a number or out of bounds
+ */
+int parseNumber(const char* s, long min, long max, long* value) {
+    char *end;
+    errno = 0;
+    *value = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || *value < min || *value > max) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets one key
+ *
+ * @param cfg The configuration
+ * @param opt The option letter of the key
+ * @param value The value
+ * @return 0 on success, -1 if the value is invalid
+ */
+static int setKey(config_t* cfg, char opt, const char* value) {
+    long n = 0;
+    switch (opt) {
+        case 'b':
+            if (parseNumber(value, 0, INT_MAX, &n) == -1) {
+                return -1;
+            }
+            cfg->batch_max = n;
+            return 0;
+        case 'd':
+            if (parseNumber(value, 0, INT_MAX, &n) == -1) {
+                return -1;
+            }
+            cfg->batch_delay_us = n;
+            return 0;
+        case 'S':
+            if (strcmp(value, "drop") == 0) {
+                cfg->lag_policy = LAG_DROP;
+            } else if (strcmp(value, "skip") == 0) {
+                cfg->lag_policy = LAG_SKIP;
+            } else {
+                return -1;
+            }
+            return 0;
+        case 'z':
+            if (parseNumber(value, 0, 9, &n) == -1) {
+                return -1;
+            }
+            cfg->codec_level = n;
+            return 0;
+        case 'G':
+            if (parseNumber(value, 0, INT_MAX, &n) == -1) {
+                return -1;
+            }
+            cfg->session_grace_ms = n;
+            return 0;
+        case 'T':
+            return parseTransforms(value, &cfg->transforms);
+        case 'f':
+            if (strlen(value) >= sizeof(cfg->filter_path)) {
+                return -1;
+            }
+            strcpy(cfg->filter_path, value);
+            return 0;
+        case 'A':
+            if (strcmp(value, "drop") == 0) {
+                cfg->filter_action = FILTER_DROP;
+            } else if (strcmp(value, "mask") == 0) {
+                cfg->filter_action = FILTER_MASK;
+            } else {
+                return -1;
+            }
+            return 0;
+        case 'M':
+            // A streamed line counts its chunks in stream_chunks
+            if (parseNumber(value, 1, (long)(STREAM_DISCARD - 1) * BUFFER_SIZE, &n) == -1) {
+                return -1;
+            }
+            cfg->max_msg = n;
+            return 0;
+        case 'D':
+            if (parseNumber(value, 0, INT_MAX, &n) == -1) {
+                return -1;
+            }
+            cfg->drain_ms = n;
+            return 0;
+        case 'B':
+            if (parseNumber(value, 0, INT_MAX, &n) == -1) {
+                return -1;
+            }
+            cfg->spin_us = n;
+            return 0;
+        case 'o':
+            return parseSockOpt(value, &cfg->sock_opts);
+        case 'L':
+            if (strcmp(value, "info") == 0) {
+                cfg->log_level = LOG_INFO;
+            } else if (strcmp(value, "debug") == 0) {
+                cfg->log_level = LOG_DEBUG;
+            } else {
+                return -1;
+            }
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Sets a key from its command line option
+ *
+ * @param cfg The configuration
+ * @param opt The option letter
+ * @param value Its argument
+ * @return 0 on success, -1 if the value is invalid, 1 if the option is not a key
+ */
+int configOption(config_t* cfg, int opt, const char* value) {
+    for (unsigned int i = 0; i < NR_KEYS; i++) {
+        if (keys[i].opt == opt) {
+            cfg->fixed |= 1u << i;
+            return setKey(cfg, keys[i].opt, value);
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Sets the keys of a config file, other than those given on the command line
+ *
+ * @param path The file
+ * @param cfg The configuration, partly changed on failure
+ * @return 0 on success, -1 on failure, the error printed
+ */
+int readConfig(const char* path, config_t* cfg) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("config %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    unsigned int line_nr = 0;
+    int ret = 0;
+    while (getline(&line, &line_cap, file) != -1) {
+        line_nr++;
+        char *key = line;
+        while (isspace((unsigned char)*key)) {
+            key++;
+        }
+        if (*key == '\0' || *key == '#') {
+            continue;
+        }
+        char *eq = strchr(key, '=');
+        if (eq == NULL) {
+            printf("config %s:%u: expected key = value\n", path, line_nr);
+            ret = -1;
+            continue;
+        }
+        char *value = eq + 1;
+        do {
+            *eq-- = '\0';
+        } while (eq >= key && isspace((unsigned char)*eq));
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+        size_t len = strlen(value);
+        while (len > 0 && isspace((unsigned char)value[len - 1])) {
+            value[--len] = '\0';
+        }
+        unsigned int i = 0;
+        while (i < NR_KEYS && strcmp(keys[i].name, key) != 0) {
+            i++;
+        }
+        if (i == NR_KEYS) {
+            printf("config %s:%u: unknown key %s\n", path, line_nr, key);
+            ret = -1;
+        } else if (!(cfg->fixed & (1u << i)) && setKey(cfg, keys[i].opt, value) == -1) {
+            printf("config %s:%u: invalid %s \"%s\"\n", path, line_nr, key, value);
+            ret = -1;
+        }
+    }
+    free(line);
+    fclose(file);
+    return ret;
+}
+
+/**
+ * @brief Parses a "-o name[=value]" socket option
+ *
+ * @param arg The option: nodelay, sndbuf=bytes, rcvbuf=bytes, notsent_lowat=bytes or busy_poll=us
+ * @param opts The options to update
+ * @return 0 on success, -1 if the option is unknown or its value invalid
+ */
+int parseSockOpt(const char* arg, sock_opts_t* opts) {
+    if (strcmp(arg, "nodelay") == 0) {
+        opts->nodelay = 1;
+        return 0;
+    }
+    const char *eq = strchr(arg, '=');
+    long value;
+    if (eq == NULL || parseNumber(eq + 1, 1, INT_MAX, &value) == -1) {
+        return -1;
+    }
+    size_t len = eq - arg;
+    if (len == 6 && strncmp(arg, "sndbuf", len) == 0) {
+        opts->sndbuf = value;
+    } else if (len == 6 && strncmp(arg, "rcvbuf", len) == 0) {
+        opts->rcvbuf = value;
+    } else if (len == 13 && strncmp(arg, "notsent_lowat", len) == 0) {
+        opts->notsent_lowat = value;
+    } else if (len == 9 && strncmp(arg, "busy_poll", len) == 0) {
+        opts->busy_poll = value;
+    } else {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <limits.h>
+#include <stdint.h>
+#include "transform.h"
+
+/*
+ * Runtime configuration.
+ *
+ * The tunables below can be given on the command line or in a config file
+ * named with -c, one "key = value" per line; empty lines and lines starting
+ * with '#' are skipped:
+ *   batch_bytes, batch_delay_us     -b, -d
+ *   lag_policy = drop|skip          -S
+ *   zlib_level                      -z
+ *   session_grace_ms                -G
+ *   transforms                      -T
+ *   filter_file, filter_action      -f, -A (drop|mask)
+ *   max_message_bytes               -M
+ *   drain_ms                        -D
+ *   spin_us                         -B
+ *   socket = <-o option>            -o, may be repeated
+ *   log_level = info|debug          -L
+ * A key given on the command line wins over the file. SIGHUP, or "/reload"
+ * from a client of the server's user on a Unix socket, reads the file
+ * again and applies it between two loop iterations, without touching the
+ * connections. A file with any error is refused as a whole, and so is one
+ * whose filter file cannot be loaded: the running configuration stays.
+ * The filter file is loaded again on every reload. Socket options apply
+ * to the connected clients too: a TCP option removed from the file goes
+ * back to its default, while sndbuf and rcvbuf keep the last size set on
+ * sockets already connected. The port, listeners, log, peers, node id
+ * and CPU are fixed at startup, as are the buffer and ring sizes.
+ */
+/* Value of log_level: debug also traces every loop iteration and read. */
+#define LOG_INFO 0
+#define LOG_DEBUG 1
+
+/*
+ * Options applied to every accepted client socket, 0 to leave the system default.
+ */
+typedef struct sock_opts {
+        /* Set TCP_NODELAY: send small messages without waiting for the ack of the previous ones. */
+        int nodelay;
+        /* SO_SNDBUF and SO_RCVBUF in bytes. */
+        int sndbuf;
+        int rcvbuf;
+        /* TCP_NOTSENT_LOWAT in bytes: most bytes left unsent in the kernel, see writeToClient. */
+        int notsent_lowat;
+        /* SO_BUSY_POLL in us: how long a read on an empty socket polls the device queue. */
+        int busy_poll;
+}sock_opts_t;
+
+typedef struct config {
+        /* Batch size that triggers publishing, 0 to disable coalescing, and longest wait in us. */
+        int batch_max;
+        int batch_delay_us;
+        /* One of the LAG_* policies. */
+        int lag_policy;
+        /* zlib level of compressed broadcasts, 0 to refuse compression. */
+        int codec_level;
+        /* Time a detached session is kept. */
+        unsigned int session_grace_ms;
+        /* Transforms of text broadcasts and direct messages. */
+        transforms_t transforms;
+        /* Pattern file of the content filter, empty for no filter, and FILTER_DROP or FILTER_MASK. */
+        char filter_path[PATH_MAX];
+        int filter_action;
+        /* Longest message accepted from a client. */
+        unsigned int max_msg;
+        /* Longest drain on shutdown. */
+        unsigned int drain_ms;
+        /* Time the loop polls before select blocks. */
+        unsigned int spin_us;
+        /* Options of accepted client sockets. */
+        sock_opts_t sock_opts;
+        /* LOG_INFO or LOG_DEBUG. */
+        int log_level;
+        /* Keys given on the command line, one bit per key: the file does not change them. */
+        uint32_t fixed;
+}config_t;
+
+/*
+ * Init a configuration with the defaults.
+ * @ cfg - allocated configuration
+ */
+void initConfig(config_t* cfg);
+
+/*
+ * Set a key from its command line option.
+ * @ cfg - the configuration
+ * @ opt - the option letter
+ * @ value - its argument
+ * @ return value - 0 on success, -1 if the value is invalid, 1 if the option is not a key
+ */
+int configOption(config_t* cfg, int opt, const char* value);
+
+/*
+ * Set the keys of a config file, other than those given on the command line.
+ * @ path - the file
+ * @ cfg - the configuration, partly changed on failure
+ * @ return value - 0 on success, -1 on failure, the error printed
+ */
+int readConfig(const char* path, config_t* cfg);
+
+/*
+ * Parse a decimal number within bounds, the whole string.
+ * @ s - the number
+ * @ min - the lowest value accepted
+ * @ max - the highest value accepted
+ * @ value - set to the number
+ * @ return value - 0 on success, -1 if it is not a number or out of bounds
+ */
+int parseNumber(const char* s, long min, long max, long* value);
+
+/*
+ * Parse a "-o name[=value]" socket option.
+ * @ arg - the option: nodelay, sndbuf=bytes, rcvbuf=bytes, notsent_lowat=bytes or busy_poll=us
+ * @ opts - the options to update
+ * @ return value - 0 on success, -1 if the option is unknown or its value invalid
+ */
+int parseSockOpt(const char* arg, sock_opts_t* opts);
+
+#endif
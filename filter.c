@@ -0,0 +1,270 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+
+/**
+ * @brief Reads the patterns of a file
+ *
+ * @param path The pattern file
+ * @param count Set to the number of patterns
+ * @param bytes Set to the total length of the patterns
+ * @return The patterns, NULL on failure
+ */
+static char** readPatterns(const char* path, uint32_t* count, size_t* bytes) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    char **patterns = NULL;
+    uint32_t capacity = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    *count = 0;
+    *bytes = 0;
+    while ((len = getline(&line, &line_cap, file)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        if (len > FILTER_PATTERN_MAX) {
+            errno = EINVAL;
+            goto fail;
+        }
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            char **grown = realloc(patterns, capacity * sizeof(char*));
+            if (grown == NULL) {
+                goto fail;
+            }
+            patterns = grown;
+        }
+        if ((patterns[*count] = strdup(line)) == NULL) {
+            goto fail;
+        }
+        (*count)++;
+        *bytes += len;
+    }
+    free(line);
+    fclose(file);
+    return patterns != NULL ? patterns : calloc(1, sizeof(char*));
+
+fail:
+    for (uint32_t i = 0; i < *count; i++) {
+        free(patterns[i]);
+    }
+    free(patterns);
+    free(line);
+    fclose(file);
+    return NULL;
+}
+
+/**
+ * @brief Compiles the patterns of a file into an automaton
+ *
+ * The patterns are inserted into a trie, then a breadth-first walk sets the
+ * failure link of each state and replaces every missing transition with the
+ * one of its failure state, which turns the trie into a DFA. A state
+ * inherits the longest match of its failure state. Last the states are
+ * numbered again, those where a pattern ends last, and the transitions
+ * turned into row offsets.
+ *
+ * @param path The pattern file
+ * @return The filter, NULL on failure
+ */
+filter_t* loadFilter(const char* path) {
+    uint32_t count;
+    size_t bytes;
+    char **patterns = readPatterns(path, &count, &bytes);
+    if (patterns == NULL) {
+        return NULL;
+    }
+    filter_t *f = calloc(1, sizeof(filter_t));
+    uint32_t *fail = NULL;
+    uint32_t *queue = NULL;
+    if (f == NULL) {
+        goto done;
+    }
+    f->nr_patterns = count;
+    // Bytes differing only in case share a class
+    f->nr_classes = 1;
+    for (uint32_t i = 0; i < count; i++) {
+        for (const unsigned char *c = (const unsigned char*)patterns[i]; *c != '\0'; c++) {
+            if (f->cls[*c] == 0) {
+                f->cls[tolower(*c)] = f->cls[toupper(*c)] = f->nr_classes++;
+            }
+        }
+    }
+    size_t max_states = bytes + 1;
+    uint32_t nc = f->nr_classes;
+    f->delta = calloc(max_states * nc, sizeof(uint32_t));
+    f->match = calloc(max_states, sizeof(uint16_t));
+    fail = calloc(max_states, sizeof(uint32_t));
+    queue = malloc(max_states * sizeof(uint32_t));
+    if (f->delta == NULL || f->match == NULL || fail == NULL || queue == NULL) {
+        goto fail;
+    }
+    // Trie, 0 marks a missing transition (no state goes back to the root)
+    f->nr_states = 1;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t state = 0;
+        uint16_t len = 0;
+        for (const unsigned char *c = (const unsigned char*)patterns[i]; *c != '\0'; c++, len++) {
+            uint32_t *next = &f->delta[(size_t)state * nc + f->cls[*c]];
+            if (*next == 0) {
+                *next = f->nr_states++;
+            }
+            state = *next;
+        }
+        if (len > f->match[state]) {
+            f->match[state] = len;
+        }
+    }
+    // Failure links, breadth first
+    uint32_t head = 0, tail = 0;
+    for (uint32_t c = 0; c < nc; c++) {
+        uint32_t child = f->delta[c];
+        if (child != 0) {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        uint32_t *row = &f->delta[(size_t)state * nc];
+        const uint32_t *fail_row = &f->delta[(size_t)fail[state] * nc];
+        if (f->match[fail[state]] > f->match[state]) {
+            f->match[state] = f->match[fail[state]];
+        }
+        for (uint32_t c = 0; c < nc; c++) {
+            if (row[c] != 0) {
+                fail[row[c]] = fail_row[c];
+                queue[tail++] = row[c];
+            } else {
+                row[c] = fail_row[c];
+            }
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        f->start[c] = f->delta[f->cls[c]] != 0;
+    }
+    if ((size_t)f->nr_states * nc > UINT32_MAX) {
+        errno = EFBIG;
+        goto fail;
+    }
+    // The root never matches, it stays state 0; fail is reused for the new numbers
+    uint32_t nr_plain = 0;
+    for (uint32_t state = 0; state < f->nr_states; state++) {
+        nr_plain += f->match[state] == 0;
+    }
+    uint32_t next_plain = 0, next_match = nr_plain;
+    for (uint32_t state = 0; state < f->nr_states; state++) {
+        fail[state] = f->match[state] == 0 ? next_plain++ : next_match++;
+    }
+    uint32_t *delta = malloc((size_t)f->nr_states * nc * sizeof(uint32_t));
+    uint16_t *match = malloc(f->nr_states * sizeof(uint16_t));
+    if (delta == NULL || match == NULL) {
+        free(delta);
+        free(match);
+        goto fail;
+    }
+    for (uint32_t state = 0; state < f->nr_states; state++) {
+        const uint32_t *row = &f->delta[(size_t)state * nc];
+        uint32_t *new_row = &delta[(size_t)fail[state] * nc];
+        for (uint32_t c = 0; c < nc; c++) {
+            new_row[c] = fail[row[c]] * nc;
+        }
+        match[fail[state]] = f->match[state];
+    }
+    free(f->delta);
+    free(f->match);
+    f->delta = delta;
+    f->match = match;
+    f->match_row = nr_plain * nc;
+    goto done;
+
+fail:
+    freeFilter(f);
+    f = NULL;
+done:
+    free(fail);
+    free(queue);
+    for (uint32_t i = 0; i < count; i++) {
+        free(patterns[i]);
+    }
+    free(patterns);
+    return f;
+}
+
+/**
+ * @brief Scans a message for the patterns, masking the matches if asked to
+ *
+ * From the root state, bytes no pattern starts with are skipped in a tight
+ * loop; most text never leaves the root for long.
+ *
+ * @param f The filter
+ * @param buf The message
+ * @param len The length of the message
+ * @param mask Set to replace the matching bytes with '*'
+ * @return The number of matches
+ */
+int filterScan(const filter_t* f, char* buf, int len, int mask) {
+    const unsigned char *in = (const unsigned char*)buf;
+    const uint32_t *delta = f->delta;
+    const uint16_t *cls = f->cls;
+    uint32_t match_row = f->match_row;
+    uint32_t row = 0;
+    int matches = 0;
+    for (int i = 0; i < len; i++) {
+        if (row == 0) {
+            while (i < len && !f->start[in[i]]) {
+                i++;
+            }
+            if (i == len) {
+                break;
+            }
+        }
+        row = delta[row + cls[in[i]]];
+        if (row >= match_row) {
+            int match = f->match[row / f->nr_classes];
+            matches++;
+            if (mask) {
+                // Already masked bytes were read before
+                memset(buf + i + 1 - match, '*', match);
+            }
+        }
+    }
+    return matches;
+}
+
+/**
+ * @brief Returns the size of a filter
+ *
+ * @param f The filter, may be NULL
+ * @return The bytes allocated for it
+ */
+size_t filterBytes(const filter_t* f) {
+    if (f == NULL) {
+        return 0;
+    }
+    return sizeof(filter_t) + (size_t)f->nr_states * (f->nr_classes * sizeof(uint32_t) + sizeof(uint16_t));
+}
+
+/**
+ * @brief Frees a filter
+ *
+ * @param f The filter, may be NULL
+ */
+void freeFilter(filter_t* f) {
+    if (f == NULL) {
+        return;
+    }
+    free(f->delta);
+    free(f->match);
+    free(f);
+}
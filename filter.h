@@ -0,0 +1,74 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+/*
+ * Content filter for banned terms.
+ *
+ * The patterns are read from a file given with -f, one per line; empty
+ * lines and lines starting with '#' are skipped. They are compiled into an
+ * Aho-Corasick automaton with its failure links resolved, so matching every
+ * pattern at once costs one table lookup per byte. Matching ignores ASCII
+ * case. Bytes that occur in no pattern share one input class, which keeps
+ * the transition table small, and runs of bytes that start no pattern are
+ * skipped without walking the automaton. Transitions hold the offset of the
+ * next state's row rather than its number, and the states where a pattern
+ * ends are numbered last, so a step is one load and one comparison.
+ *
+ * Each text broadcast and direct message is scanned once, before it is
+ * transformed and fanned out. Depending on -A it is dropped (the sender is
+ * told) or the matching bytes are masked with '*'. SIGHUP loads the file
+ * again and swaps the new automaton in; the old one stays if loading fails.
+ */
+#define FILTER_DROP 0
+#define FILTER_MASK 1
+
+/* Longest pattern. */
+#define FILTER_PATTERN_MAX 1024
+
+typedef struct filter {
+        /* Input class of each byte, 0 for bytes occurring in no pattern. */
+        uint16_t cls[256];
+        /* Set for the bytes a pattern starts with. */
+        unsigned char start[256];
+        /* Number of input classes, class 0 included. */
+        uint32_t nr_classes;
+        /* Row offset (state * nr_classes) of the next state, at delta[row + class]. */
+        uint32_t *delta;
+        /* Row offset of the first state where a pattern ends. */
+        uint32_t match_row;
+        /* Length of the longest pattern ending at each state, 0 if none does. */
+        uint16_t *match;
+        uint32_t nr_states;
+        uint32_t nr_patterns;
+}filter_t;
+
+/*
+ * Compile the patterns of a file.
+ * @ path - the pattern file
+ * @ return value - the filter, NULL on failure
+ */
+filter_t* loadFilter(const char* path);
+
+/*
+ * Scan a message for the patterns.
+ * @ f - the filter
+ * @ buf - the message; with mask set, the matching bytes are replaced with '*'
+ * @ len - length of the message
+ * @ mask - set to mask the matches
+ * @ return value - the number of matches
+ */
+int filterScan(const filter_t* f, char* buf, int len, int mask);
+
+/*
+ * Size of a filter in bytes.
+ */
+size_t filterBytes(const filter_t* f);
+
+/*
+ * Free a filter, NULL is ignored.
+ */
+void freeFilter(filter_t* f);
+
+#endif
@@ -0,0 +1,227 @@
+#include <endian.h>
+#include <arpa/inet.h>
+#include "chatServer.h"
+
+/**
+ * @brief Fills a frame header
+ *
+ * @param hdr The header
+ * @param type The frame type
+ * @param len The payload size
+ */
+void setFrameHdr(frame_hdr_t* hdr, int type, uint32_t len) {
+    hdr->len = htonl(len);
+    hdr->type = type;
+    memset(hdr->reserved, 0, sizeof(hdr->reserved));
+}
+
+/**
+ * @brief Allocates a payload holding a whole frame
+ *
+ * @param type The frame type
+ * @param data The frame payload
+ * @param len The size of the frame payload
+ * @return The payload with a reference count of 1, NULL on failure
+ */
+payload_t* newFrame(int type, const char* data, int len) {
+    char *buf = malloc(sizeof(frame_hdr_t) + len);
+    if (buf == NULL) {
+        return NULL;
+    }
+    setFrameHdr((frame_hdr_t*)buf, type, len);
+    memcpy(buf + sizeof(frame_hdr_t), data, len);
+    payload_t *payload = newPayload(buf, sizeof(frame_hdr_t) + len);
+    free(buf);
+    return payload;
+}
+
+/**
+ * @brief Queues a frame carrying a sequence number to a connection
+ *
+ * An ack takes the control lane. The join frame is the first one of the
+ * connection and switches protocols.
+ *
+ * @param conn The connection
+ * @param type The frame type
+ * @param seq The sequence number
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int queueSeqFrame(conn_t* conn, int type, unsigned long long seq, conn_pool_t* pool) {
+    uint64_t be_seq = htobe64(seq);
+    payload_t *payload = newFrame(type, (const char*)&be_seq, sizeof(be_seq));
+    if (payload == NULL) {
+        return -1;
+    }
+    int ret = queueLane(conn, payload, type == FRAME_ACK ? LANE_CONTROL : LANE_SWITCH, pool);
+    payloadUnref(payload);
+    return ret;
+}
+
+/**
+ * @brief Switches a connection to frames
+ *
+ * A codec is granted unless compression is disabled; the FRAME_JOIN frame
+ * names it.
+ *
+ * @param conn The connection that sent the "/binary" line
+ * @param codec The codec asked for
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int startFrames(conn_t* conn, int codec, conn_pool_t* pool) {
+    conn->proto = PROTO_FRAME;
+    if (pool->codec_level == 0) {
+        codec = CODEC_NONE;
+    }
+    conn->codec = codec;
+    if (codec == CODEC_NONE) {
+        return queueSeqFrame(conn, FRAME_JOIN, connCursor(pool, conn), pool);
+    }
+    pool->nr_zipping++;
+    char join[sizeof(uint64_t) + 16];
+    uint64_t be_seq = htobe64(connCursor(pool, conn));
+    memcpy(join, &be_seq, sizeof(be_seq));
+    int len = snprintf(join + sizeof(be_seq), sizeof(join) - sizeof(be_seq), "%s", codecName(codec));
+    payload_t *payload = newFrame(FRAME_JOIN, join, sizeof(be_seq) + len);
+    if (payload == NULL) {
+        return -1;
+    }
+    int ret = queueLane(conn, payload, LANE_SWITCH, pool);
+    payloadUnref(payload);
+    return ret;
+}
+
+/**
+ * @brief Chooses how a broadcast is framed for a connection
+ *
+ * @param conn The framed connection
+ * @param payload The broadcast
+ * @param type Set to FRAME_ZMSG or FRAME_MSG
+ * @return The shared compressed payload, or the broadcast itself
+ */
+payload_t* frameBody(conn_t* conn, payload_t* payload, int* type) {
+    if (conn->codec != CODEC_NONE && payload->zipped != NULL) {
+        *type = FRAME_ZMSG;
+        return payload->zipped;
+    }
+    *type = FRAME_MSG;
+    return payload;
+}
+
+/**
+ * @brief Handles one complete frame read from a client
+ *
+ * @param conn The connection
+ * @param type The frame type
+ * @param data The frame payload
+ * @param len The size of the frame payload
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int handleFrame(conn_t* conn, int type, const char* data, uint32_t len, conn_pool_t* pool) {
+    switch (type) {
+        case FRAME_MSG: {
+            if (len == 0) {
+                return 0;
+            }
+            // Filtered like a line, on the copy: masking must not touch the read buffer
+            payload_t *payload = newPayload(data, len);
+            if (payload == NULL) {
+                return -1;
+            }
+            int filtered = filterMessage(conn, payload->data, payload->size, pool);
+            if (filtered != 0) {
+                payloadUnref(payload);
+                return filtered == 1 ? 0 : -1;
+            }
+            payload->origin = conn->id;
+            payload->node = pool->fed.node_id;
+            int ret = broadcastPayload(payload, pool);
+            unsigned long long seq = payload->seq;
+            payloadUnref(payload);
+            return ret | queueSeqFrame(conn, FRAME_ACK, seq, pool);
+        }
+        case FRAME_JOIN:
+            if (len == 0) {
+                return 0;
+            }
+            // Checked like "/nick": the nickname ends up in the table and in sender tags
+            return registerNick(conn, data, len > NICK_MAX ? NICK_MAX + 1 : (int)len, pool);
+        case FRAME_LEAVE:
+            markClosing(conn, pool);
+            return 0;
+        case FRAME_ACK:
+            if (len == sizeof(uint64_t)) {
+                uint64_t be_seq;
+                memcpy(&be_seq, data, sizeof(be_seq));
+                ackSession(conn, be64toh(be_seq), pool);
+            }
+            return 0;
+        default:
+            return sendNotice(conn, pool, "* unknown frame type %d\n", type);
+    }
+}
+
+/**
+ * @brief Splits the bytes read from a framed connection into frames
+ *
+ * Only frame headers are looked at: complete frames are handled straight
+ * from the read buffer, a trailing incomplete frame is kept in the
+ * connection's input buffer. A frame larger than FRAME_MAX or than the
+ * longest message accepted (-M) closes the connection.
+ *
+ * @param conn The connection
+ * @param buffer The bytes read
+ * @param len The number of bytes read
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int frameInput(conn_t* conn, char* buffer, int len, conn_pool_t* pool) {
+    char *data = buffer;
+    size_t avail = len;
+    if (conn->in_len > 0) {
+        char *joined = realloc(conn->in_buf, conn->in_len + len);
+        if (joined == NULL) {
+            return -1;
+        }
+        memcpy(joined + conn->in_len, buffer, len);
+        conn->in_buf = data = joined;
+        conn->in_len = avail = conn->in_len + len;
+    }
+    int ret = 0;
+    size_t off = 0;
+    while (!conn->closing && avail - off >= sizeof(frame_hdr_t)) {
+        frame_hdr_t hdr;
+        memcpy(&hdr, data + off, sizeof(hdr));
+        uint32_t frame_len = ntohl(hdr.len);
+        if (frame_len > FRAME_MAX || frame_len > pool->max_msg) {
+            printf("Frame of %u bytes on sd %d, closing\n", frame_len, conn->fd);
+            markClosing(conn, pool);
+            return -1;
+        }
+        if (avail - off - sizeof(hdr) < frame_len) {
+            break;
+        }
+        ret |= handleFrame(conn, hdr.type, data + off + sizeof(hdr), frame_len, pool);
+        off += sizeof(hdr) + frame_len;
+    }
+    // Keep the incomplete frame for the next read
+    size_t rest = avail - off;
+    if (rest == 0) {
+        free(conn->in_buf);
+        conn->in_buf = NULL;
+        conn->in_len = 0;
+    } else if (data == conn->in_buf) {
+        memmove(conn->in_buf, data + off, rest);
+        conn->in_len = rest;
+    } else {
+        conn->in_buf = malloc(rest);
+        if (conn->in_buf == NULL) {
+            return -1;
+        }
+        memcpy(conn->in_buf, data + off, rest);
+        conn->in_len = rest;
+    }
+    return ret;
+}
@@ -0,0 +1,116 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+/*
+ * Length-prefixed binary protocol.
+ *
+ * A client sends the line "/binary [codec]" to switch its connection from
+ * lines to frames, optionally asking for compressed broadcasts (see
+ * codec.h); text clients on the same port are not affected. From then on
+ * every message in either direction is a frame_hdr_t followed by len bytes
+ * of payload. FRAME_MSG payloads may hold any bytes: they go through the
+ * content filter like lines (see filter.h), and are otherwise broadcast as
+ * received (text clients receive them as they are). A dropped payload is
+ * answered with a FRAME_NOTICE instead of a FRAME_ACK.
+ *
+ * Frame types:
+ *   FRAME_MSG    client: broadcast the payload. server: a broadcast.
+ *   FRAME_JOIN   client: optional nickname to register.
+ *                server: sent first, the 8-byte sequence number of the
+ *                first broadcast the client will receive, followed by the
+ *                name of the codec if one was granted.
+ *   FRAME_LEAVE  client: close the connection.
+ *   FRAME_ACK    server: the 8-byte sequence number given to the client's
+ *                last FRAME_MSG. client: the 8-byte sequence number of the
+ *                last broadcast processed, on a session (see session.h).
+ *   FRAME_NOTICE server: a server notice line.
+ *   FRAME_DIRECT server: a direct message line (see /msg).
+ *   FRAME_ZMSG   server: a compressed broadcast.
+ *   FRAME_SEQ    server: the 8-byte sequence number of the broadcast that
+ *                follows, on a session.
+ *   FRAME_TOPIC  server: a topic message line (see /pub).
+ * Sequence numbers are in network byte order.
+ */
+#define FRAME_MSG 1
+#define FRAME_JOIN 2
+#define FRAME_LEAVE 3
+#define FRAME_ACK 4
+#define FRAME_NOTICE 5
+#define FRAME_DIRECT 6
+#define FRAME_ZMSG 7
+#define FRAME_SEQ 8
+#define FRAME_TOPIC 9
+
+/* Largest frame payload accepted from a client. */
+#define FRAME_MAX (1 << 16)
+
+/* Connection protocols. */
+#define PROTO_LINE 0    /* newline terminated lines */
+#define PROTO_FRAME 1   /* length-prefixed frames */
+#define PROTO_WS_HANDSHAKE 2    /* WebSocket client, upgrade request not answered yet */
+#define PROTO_WS 3      /* WebSocket frames (see ws.h) */
+#define PROTO_WS_CLOSING 4      /* WebSocket client, closed once its queue is written */
+/* WebSocket clients, in any state. */
+#define isWs(proto) ((proto) >= PROTO_WS_HANDSHAKE)
+
+/* Header of a frame. */
+typedef struct frame_hdr {
+        /* Size of the payload, in network byte order. */
+        uint32_t len;
+        /* One of the FRAME_* types. */
+        uint8_t type;
+        uint8_t reserved[3];
+}frame_hdr_t;
+
+struct conn;
+struct conn_pool;
+struct payload;
+
+/*
+ * Fill a frame header.
+ * @ hdr - the header
+ * @ type - the frame type
+ * @ len - the payload size
+ */
+void setFrameHdr(frame_hdr_t* hdr, int type, uint32_t len);
+
+/*
+ * Allocate a payload holding a whole frame, header included.
+ * @ type - the frame type
+ * @ data - the frame payload
+ * @ len - the size of the frame payload
+ * @ return value - the payload, NULL on failure
+ */
+struct payload* newFrame(int type, const char* data, int len);
+
+/*
+ * Switch a connection to frames after its "/binary" line and queue the FRAME_JOIN frame.
+ * @ conn - the connection
+ * @ codec - the codec asked for, one of the CODEC_* values
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int startFrames(struct conn* conn, int codec, struct conn_pool* pool);
+
+/*
+ * Choose how a broadcast is framed for a connection: compressed if the connection uses a codec and the broadcast was compressed.
+ * @ conn - the framed connection
+ * @ payload - the broadcast
+ * @ type - set to the frame type
+ * @ return value - the payload to send as frame payload
+ */
+struct payload* frameBody(struct conn* conn, struct payload* payload, int* type);
+
+/*
+ * Handle bytes read from a framed connection.
+ * @ conn - the connection
+ * @ buffer - the bytes read
+ * @ len - the number of bytes
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int frameInput(struct conn* conn, char* buffer, int len, struct conn_pool* pool);
+
+#endif
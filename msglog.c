@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "msglog.h"
+
+/* Records are padded to this alignment so headers can be read in place. */
+#define LOG_ALIGN 8
+
+/**
+ * @brief Computes the CRC-32 (IEEE) of a buffer
+ *
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return The checksum
+ */
+static uint32_t crc32(const char* data, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * @brief Returns the on-disk size of a record
+ *
+ * @param len The size of the message
+ * @return The size of header, message and padding
+ */
+static size_t recordSize(size_t len) {
+    return (sizeof(log_record_t) + len + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1);
+}
+
+/**
+ * @brief Returns the milliseconds elapsed since a time
+ *
+ * @param since The start time
+ * @return The elapsed time in ms
+ */
+static long elapsedMs(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * @brief Compares two sequence numbers for qsort
+ */
+static int compareSeq(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Lists the segments of the log directory
+ *
+ * @param dir The log directory
+ * @param count Set to the number of segments found
+ * @return The sorted first sequence numbers of the segments (to be freed), NULL on failure
+ */
+static unsigned long long* listSegments(const char* dir, int* count) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return NULL;
+    }
+    int n = 0, cap = 16;
+    unsigned long long *seqs = malloc(cap * sizeof(*seqs));
+    struct dirent *entry;
+    while (seqs != NULL && (entry = readdir(d)) != NULL) {
+        char *end;
+        unsigned long long seq = strtoull(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, ".log") != 0) {
+            continue;
+        }
+        if (n == cap) {
+            unsigned long long *grown = realloc(seqs, 2 * cap * sizeof(*seqs));
+            if (grown == NULL) {
+                free(seqs);
+                seqs = NULL;
+                break;
+            }
+            seqs = grown;
+            cap *= 2;
+        }
+        seqs[n++] = seq;
+    }
+    closedir(d);
+    if (seqs != NULL) {
+        qsort(seqs, n, sizeof(*seqs), compareSeq);
+        *count = n;
+    }
+    return seqs;
+}
+
+/**
+ * @brief Opens and maps a segment for reading and appending
+ *
+ * The segment is grown to at least min_size bytes.
+ *
+ * @param log A pointer to the log structure
+ * @param first_seq The sequence number the segment is named after
+ * @param min_size The minimal size of the segment
+ * @param file_size Set to the size of the file before it was grown, may be NULL
+ * @return 0 on success, -1 on failure
+ */
+static int mapSegment(msglog_t* log, unsigned long long first_seq, size_t min_size, size_t* file_size) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%020llu.log", log->dir, first_seq);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size > min_size ? (size_t)st.st_size : min_size;
+    if ((size_t)st.st_size < size && ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    log->fd = fd;
+    log->base = base;
+    log->size = size;
+    if (file_size != NULL) {
+        *file_size = st.st_size;
+    }
+    return 0;
+}
+
+/**
+ * @brief Unmaps the current segment
+ *
+ * The file is cut to its used size so rotated segments take no spare space.
+ *
+ * @param log A pointer to the log structure
+ */
+static void unmapSegment(msglog_t* log) {
+    if (log->base == NULL) {
+        return;
+    }
+    munmap(log->base, log->size);
+    if (ftruncate(log->fd, log->write_off) < 0) {
+        perror("Error truncating log segment");
+    }
+    close(log->fd);
+    log->base = NULL;
+    log->fd = -1;
+}
+
+/**
+ * @brief Scans the records of the mapped segment
+ *
+ * Stops at the end marker or at the first record that is torn, fails its
+ * checksum or breaks the sequence. Valid records are pushed to the history
+ * ring, the ring taking their sequence numbers.
+ *
+ * @param log A pointer to the log structure, with the segment mapped
+ * @param len The number of bytes of the segment to scan
+ * @param next The sequence number expected for the first record, set to the one after the last valid record
+ * @param history The ring to push the records to, NULL to only find the end
+ * @return The offset right after the last valid record
+ */
+static size_t scanSegment(msglog_t* log, size_t len, unsigned long long* next, ring_t* history) {
+    size_t off = 0;
+    unsigned long long seq = *next;
+    if (history != NULL && history->next_seq != seq) {
+        ringReset(history, seq);
+    }
+    while (off + sizeof(log_record_t) <= len) {
+        const log_record_t *rec = (const log_record_t*)(log->base + off);
+        if (rec->seq != seq || off + recordSize(rec->len) > len) {
+            break;
+        }
+        const char *data = log->base + off + sizeof(log_record_t);
+        if (crc32(data, rec->len) != rec->crc) {
+            break;
+        }
+        if (history != NULL) {
+            payload_t *p = newPayload(data, rec->len);
+            if (p == NULL) {
+                break;
+            }
+            // Recovered broadcasts of this node are still forwarded to its peers;
+            // the origin is not kept, connection ids start again at 1
+            p->node = rec->node;
+            p->node_seq = rec->node_seq;
+            p->cont = rec->cont;
+            ringPush(history, p);
+            payloadUnref(p);
+        }
+        off += recordSize(rec->len);
+        seq++;
+    }
+    *next = seq;
+    return off;
+}
+
+/**
+ * @brief Opens the log and rebuilds the history ring
+ *
+ * Segments are named after their first sequence number, so only the segments
+ * that can still hold records within the ring's capacity are scanned. The
+ * last segment is left mapped for appending, right after its last valid
+ * record; a torn tail from a crash is zeroed.
+ *
+ * A ring taken over from a running server is kept as it is: its entries
+ * carry what the log does not (origins, compressed forms), and entries not
+ * logged yet. Only the last segment is scanned, for its end. If its last
+ * record is not the one before the ring's next sequence number, appending
+ * goes to a new segment named after that number.
+ *
+ * @param log A pointer to the log structure
+ * @param dir The log directory
+ * @param sync_ms The group commit window in ms, 0 to commit every loop iteration
+ * @param history The history ring, empty to rebuild it from the log
+ * @param taken_over Set when the ring was taken over and must be kept
+ * @return 0 on success, -1 on failure
+ */
+int openLog(msglog_t* log, const char* dir, unsigned int sync_ms, ring_t* history, int taken_over) {
+    if (log == NULL || dir == NULL || history == NULL) {
+        return -1;
+    }
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+    log->sync_ms = sync_ms;
+    clock_gettime(CLOCK_MONOTONIC, &log->last_sync);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    log->dir = strdup(dir);
+    int count = 0;
+    unsigned long long *segs = listSegments(dir, &count);
+    if (log->dir == NULL || segs == NULL) {
+        free(segs);
+        free(log->dir);
+        return -1;
+    }
+    if (count == 0) {
+        free(segs);
+        return mapSegment(log, history->next_seq, LOG_SEGMENT_SIZE, NULL);
+    }
+    // The last segment starts at or after segs[count-1], so earlier segments
+    // starting before the ring's window need no scan
+    int first = count - 1;
+    while (!taken_over && first > 0 && segs[first] + history->capacity > segs[count - 1] + 1) {
+        first--;
+    }
+    unsigned long long next = 0;
+    for (int i = first; i < count; i++) {
+        size_t file_size;
+        if (mapSegment(log, segs[i], i == count - 1 ? LOG_SEGMENT_SIZE : sizeof(log_record_t), &file_size) == -1) {
+            free(segs);
+            return -1;
+        }
+        next = segs[i];
+        log->write_off = scanSegment(log, file_size, &next, taken_over ? NULL : history);
+        if (i < count - 1) {
+            munmap(log->base, log->size);
+            close(log->fd);
+            log->base = NULL;
+        } else if (file_size > log->write_off) {
+            memset(log->base + log->write_off, 0, file_size - log->write_off);
+        }
+    }
+    free(segs);
+    if (taken_over && next != history->next_seq) {
+        unmapSegment(log);
+        size_t file_size;
+        if (mapSegment(log, history->next_seq, LOG_SEGMENT_SIZE, &file_size) == -1) {
+            return -1;
+        }
+        // A segment of that name holds no record of this ring
+        memset(log->base, 0, file_size);
+        log->write_off = 0;
+    }
+    log->sync_off = log->write_off;
+    if (taken_over) {
+        printf("log %s: appending at seq %llu\n", dir, history->next_seq);
+    } else {
+        printf("log %s: recovered up to seq %llu\n", dir, history->next_seq - 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends a broadcast to the log
+ *
+ * The record is copied into the mapped segment. When it does not fit, the
+ * segment is committed and a new one named after the record is started.
+ *
+ * @param log A pointer to the log structure
+ * @param p The payload to append, with its sequence number assigned
+ * @return 0 on success, -1 on failure
+ */
+int logAppend(msglog_t* log, payload_t* p) {
+    if (log == NULL || p == NULL) {
+        return -1;
+    }
+    size_t rec_size = recordSize(p->size);
+    if (log->base == NULL || log->write_off + rec_size > log->size) {
+        int wait_ms;
+        if (log->base != NULL && logCommit(log, 1, &wait_ms) == -1) {
+            return -1;
+        }
+        unmapSegment(log);
+        log->write_off = log->sync_off = 0;
+        if (mapSegment(log, p->seq, rec_size > LOG_SEGMENT_SIZE ? rec_size : LOG_SEGMENT_SIZE, NULL) == -1) {
+            return -1;
+        }
+    }
+    log_record_t *rec = (log_record_t*)(log->base + log->write_off);
+    memcpy(log->base + log->write_off + sizeof(log_record_t), p->data, p->size);
+    rec->len = p->size;
+    rec->crc = crc32(p->data, p->size);
+    rec->seq = p->seq;
+    rec->node = p->node;
+    rec->cont = p->cont;
+    rec->node_seq = p->node_seq;
+    log->write_off += rec_size;
+    log->records++;
+    return 0;
+}
+
+/**
+ * @brief Commits the records appended since the last commit
+ *
+ * All pending records are synced with a single msync, so the cost of
+ * durability is paid once per batch rather than once per message.
+ *
+ * @param log A pointer to the log structure
+ * @param force Commit even if the commit window has not passed yet
+ * @param wait_ms Set to the ms left until a pending commit is due, -1 if nothing is pending
+ * @return 0 on success, -1 on failure
+ */
+int logCommit(msglog_t* log, int force, int* wait_ms) {
+    *wait_ms = -1;
+    if (log == NULL || log->base == NULL || log->write_off == log->sync_off) {
+        return 0;
+    }
+    long elapsed = elapsedMs(&log->last_sync);
+    if (!force && elapsed < (long)log->sync_ms) {
+        *wait_ms = log->sync_ms - elapsed;
+        return 0;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = log->sync_off & ~(page - 1);
+    if (msync(log->base + start, log->write_off - start, MS_SYNC) < 0) {
+        return -1;
+    }
+    log->sync_off = log->write_off;
+    log->commits++;
+    clock_gettime(CLOCK_MONOTONIC, &log->last_sync);
+    return 0;
+}
+
+/**
+ * @brief Commits pending records and closes the log
+ *
+ * @param log A pointer to the log structure
+ */
+void closeLog(msglog_t* log) {
+    if (log == NULL) {
+        return;
+    }
+    int wait_ms;
+    if (logCommit(log, 1, &wait_ms) == -1) {
+        perror("Error committing log");
+    }
+    unmapSegment(log);
+    printf("log %s: %llu records in %llu commits\n", log->dir, log->records, log->commits);
+    free(log->dir);
+    log->dir = NULL;
+}
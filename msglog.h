@@ -0,0 +1,93 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stdint.h>
+#include <time.h>
+#include "ring.h"
+
+/* Size of a log segment file. A segment is rotated when the next record does not fit. */
+#define LOG_SEGMENT_SIZE (64 << 20)
+
+/*
+ * On-disk header of one log record. The record is followed by len bytes of
+ * message and padded to a multiple of 8 bytes. Unused segment space is zero,
+ * so a record with len and seq 0 marks the end of the segment.
+ */
+typedef struct log_record {
+        /* Size of the message. */
+        uint32_t len;
+        /* CRC-32 of the message bytes. */
+        uint32_t crc;
+        /* Broadcast sequence number of the message. */
+        uint64_t seq;
+        /* Node the broadcast was accepted on and its sequence number there, see payload_t. */
+        uint32_t node;
+        /* Set on the next chunks of a streamed line, see payload_t. */
+        uint32_t cont;
+        uint64_t node_seq;
+}log_record_t;
+
+/*
+ * Durable append-only log of broadcasts.
+ *
+ * The log is a directory of segment files named after the sequence number of
+ * their first record. Records are appended by copying into the mmap'd current
+ * segment; they are made durable by logCommit, which syncs everything
+ * appended since the previous commit at once (group commit).
+ */
+typedef struct msglog {
+        /* Directory holding the segment files. */
+        char *dir;
+        /* File descriptor of the current segment. */
+        int fd;
+        /* Mapping of the current segment. */
+        char *base;
+        /* Size of the current segment. */
+        size_t size;
+        /* Offset right after the last appended record. */
+        size_t write_off;
+        /* Offset right after the last committed record. */
+        size_t sync_off;
+        /* Minimal time between two commits in ms, 0 to commit every loop iteration. */
+        unsigned int sync_ms;
+        /* Time of the last commit. */
+        struct timespec last_sync;
+        /* Number of records appended and of commits done, for reporting. */
+        unsigned long long records;
+        unsigned long long commits;
+}msglog_t;
+
+/*
+ * Open the log in a directory, creating it if needed, and rebuild the history
+ * ring from the records it holds, unless the ring was taken over from a
+ * running server: the log is then only opened for appending after it.
+ * @ log - allocated log
+ * @ dir - the log directory
+ * @ sync_ms - group commit window in ms, 0 to commit every loop iteration
+ * @ history - the history ring, empty to rebuild it
+ * @ taken_over - set when the ring was taken over and must be kept
+ * @ return value - 0 on success, -1 on failure
+ */
+int openLog(msglog_t* log, const char* dir, unsigned int sync_ms, ring_t* history, int taken_over);
+
+/*
+ * Append a broadcast to the log. The record is durable only after the next commit.
+ * @ p - the payload, its sequence number already assigned by the history ring
+ * @ return value - 0 on success, -1 on failure
+ */
+int logAppend(msglog_t* log, payload_t* p);
+
+/*
+ * Commit the records appended since the last commit if the commit window has passed.
+ * @ force - commit regardless of the window
+ * @ wait_ms - set to the ms left until a pending commit is due, -1 if nothing is pending
+ * @ return value - 0 on success, -1 on failure
+ */
+int logCommit(msglog_t* log, int force, int* wait_ms);
+
+/*
+ * Commit pending records and close the log.
+ */
+void closeLog(msglog_t* log);
+
+#endif
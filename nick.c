@@ -0,0 +1,216 @@
+#include <errno.h>
+#include "chatServer.h"
+
+/* Marks the slot of a removed entry. */
+#define NICK_TOMBSTONE ((struct conn*)&nick_tombstone)
+static char nick_tombstone;
+
+/**
+ * @brief Computes the FNV-1a hash of a nickname
+ *
+ * @param nick The nickname
+ * @param len The length of the nickname
+ * @return The hash
+ */
+static uint32_t hashNick(const char* nick, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)nick[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Finds the slot of a nickname
+ *
+ * @param table A pointer to the table
+ * @param nick The nickname
+ * @param len The length of the nickname
+ * @param hash The hash of the nickname
+ * @return The slot holding the nickname, NULL if it is not in the table
+ */
+static nick_slot_t* findSlot(nick_table_t* table, const char* nick, size_t len, uint32_t hash) {
+    unsigned int mask = table->capacity - 1;
+    for (unsigned int i = hash & mask; ; i = (i + 1) & mask) {
+        nick_slot_t *slot = &table->slots[i];
+        if (slot->conn == NULL) {
+            return NULL;
+        }
+        if (slot->conn != NICK_TOMBSTONE && slot->hash == hash &&
+            strncmp(slot->conn->nick, nick, len) == 0 && slot->conn->nick[len] == '\0') {
+            return slot;
+        }
+    }
+}
+
+/**
+ * @brief Stores an entry in the first free slot of its probe sequence
+ *
+ * @param table A pointer to the table, with room for the entry
+ * @param conn The connection
+ * @param hash The hash of its nickname
+ */
+static void placeSlot(nick_table_t* table, conn_t* conn, uint32_t hash) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = hash & mask;
+    while (table->slots[i].conn != NULL && table->slots[i].conn != NICK_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (table->slots[i].conn == NICK_TOMBSTONE) {
+        table->removed--;
+    }
+    table->slots[i].hash = hash;
+    table->slots[i].conn = conn;
+    table->count++;
+}
+
+/**
+ * @brief Rebuilds the table without tombstones, doubled unless live entries fill under a quarter of it
+ *
+ * @param table A pointer to the table
+ * @return 0 on success, -1 on failure
+ */
+static int growNicks(nick_table_t* table) {
+    unsigned int capacity = table->capacity;
+    if ((table->count + 1) * 2 > capacity / 2) {
+        capacity *= 2;
+    }
+    nick_slot_t *slots = calloc(capacity, sizeof(nick_slot_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    nick_slot_t *old = table->slots;
+    unsigned int old_capacity = table->capacity;
+    table->slots = slots;
+    table->capacity = capacity;
+    table->count = 0;
+    table->removed = 0;
+    for (unsigned int i = 0; i < old_capacity; i++) {
+        if (old[i].conn != NULL && old[i].conn != NICK_TOMBSTONE) {
+            placeSlot(table, old[i].conn, old[i].hash);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Initializes the nickname table
+ *
+ * @param table A pointer to the table
+ * @return 0 on success, -1 on failure
+ */
+int initNicks(nick_table_t* table) {
+    table->slots = calloc(NICK_TABLE_MIN, sizeof(nick_slot_t));
+    if (table->slots == NULL) {
+        return -1;
+    }
+    table->capacity = NICK_TABLE_MIN;
+    table->count = 0;
+    table->removed = 0;
+    return 0;
+}
+
+/**
+ * @brief Looks up a connection by nickname
+ *
+ * @param table A pointer to the table
+ * @param nick The nickname
+ * @param len The length of the nickname
+ * @return The connection, NULL if no connection has this nickname
+ */
+conn_t* findNick(nick_table_t* table, const char* nick, size_t len) {
+    nick_slot_t *slot = findSlot(table, nick, len, hashNick(nick, len));
+    return slot != NULL ? slot->conn : NULL;
+}
+
+/**
+ * @brief Checks a nickname
+ *
+ * The nickname is hashed over its length but kept as a C string and
+ * written into sender tags, so NUL, newline and the like are refused.
+ *
+ * @param nick The nickname
+ * @param len The length of the nickname
+ * @return 1 if valid, 0 if not
+ */
+int validNick(const char* nick, size_t len) {
+    if (len == 0 || len > NICK_MAX) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)nick[i]) && nick[i] != '_' && nick[i] != '-') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Gives a connection a nickname
+ *
+ * The connection's previous nickname, if any, is removed first. An
+ * invalid nickname is refused, whoever the caller.
+ *
+ * @param table A pointer to the table
+ * @param conn The connection
+ * @param nick The nickname
+ * @param len The length of the nickname
+ * @return 0 on success, 1 if another connection has the nickname, -1 on failure
+ */
+int setNick(nick_table_t* table, conn_t* conn, const char* nick, size_t len) {
+    if (!validNick(nick, len)) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t hash = hashNick(nick, len);
+    nick_slot_t *slot = findSlot(table, nick, len, hash);
+    if (slot != NULL) {
+        return slot->conn == conn ? 0 : 1;
+    }
+    if ((table->count + table->removed + 1) * 2 > table->capacity && growNicks(table) == -1) {
+        return -1;
+    }
+    char *copy = strndup(nick, len);
+    if (copy == NULL) {
+        return -1;
+    }
+    removeNick(table, conn);
+    conn->nick = copy;
+    placeSlot(table, conn, hash);
+    return 0;
+}
+
+/**
+ * @brief Removes the nickname of a connection
+ *
+ * The slot becomes a tombstone and the connection's nickname is freed.
+ *
+ * @param table A pointer to the table
+ * @param conn The connection
+ */
+void removeNick(nick_table_t* table, conn_t* conn) {
+    if (conn->nick == NULL) {
+        return;
+    }
+    size_t len = strlen(conn->nick);
+    nick_slot_t *slot = findSlot(table, conn->nick, len, hashNick(conn->nick, len));
+    if (slot != NULL) {
+        slot->conn = NICK_TOMBSTONE;
+        table->count--;
+        table->removed++;
+    }
+    free(conn->nick);
+    conn->nick = NULL;
+}
+
+/**
+ * @brief Releases the slots of the table
+ *
+ * @param table A pointer to the table
+ */
+void freeNicks(nick_table_t* table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = table->count = table->removed = 0;
+}
@@ -0,0 +1,82 @@
+#ifndef NICK_H
+#define NICK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest nickname. */
+#define NICK_MAX 32
+/* Initial number of slots of the nickname table, a power of two. */
+#define NICK_TABLE_MIN 64
+
+/*
+ * Open-addressing hash table from nickname to connection.
+ *
+ * Slots are probed linearly from the hash of the nickname. The nickname
+ * itself is held by the connection, a slot keeps the hash and the
+ * connection. A removed entry leaves a tombstone so later entries of its
+ * probe sequence stay reachable; the table is rebuilt without tombstones
+ * when live entries and tombstones fill half of it, which keeps lookup,
+ * registration and removal O(1) on average.
+ */
+typedef struct nick_slot {
+        /* Hash of the nickname. */
+        uint32_t hash;
+        /* The connection, NULL for an empty slot, NICK_TOMBSTONE for a removed entry. */
+        struct conn *conn;
+}nick_slot_t;
+
+typedef struct nick_table {
+        /* Array of capacity slots. */
+        nick_slot_t *slots;
+        /* Number of slots, a power of two. */
+        unsigned int capacity;
+        /* Number of live entries. */
+        unsigned int count;
+        /* Number of tombstones. */
+        unsigned int removed;
+}nick_table_t;
+
+/*
+ * Init the table.
+ * @ table - allocated table
+ * @ return value - 0 on success, -1 on failure
+ */
+int initNicks(nick_table_t* table);
+
+/*
+ * Look up a connection by nickname.
+ * @ nick - the nickname, not necessarily NUL terminated
+ * @ len - the length of the nickname
+ * @ return value - the connection, NULL if no connection has this nickname
+ */
+struct conn* findNick(nick_table_t* table, const char* nick, size_t len);
+
+/*
+ * Check a nickname: 1 to NICK_MAX letters, digits, '_' and '-'.
+ * @ nick - the nickname, not necessarily NUL terminated
+ * @ len - the length of the nickname
+ * @ return value - 1 if valid, 0 if not
+ */
+int validNick(const char* nick, size_t len);
+
+/*
+ * Give a connection a nickname, replacing the one it had.
+ * @ conn - the connection
+ * @ nick - the nickname, not necessarily NUL terminated
+ * @ len - the length of the nickname
+ * @ return value - 0 on success, 1 if another connection has the nickname, -1 on failure (EINVAL if it is not valid)
+ */
+int setNick(nick_table_t* table, struct conn* conn, const char* nick, size_t len);
+
+/*
+ * Remove the nickname of a connection, if it has one.
+ */
+void removeNick(nick_table_t* table, struct conn* conn);
+
+/*
+ * Release the slots. The connections keep their nicknames.
+ */
+void freeNicks(nick_table_t* table);
+
+#endif
@@ -0,0 +1,538 @@
+#include <errno.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include "chatServer.h"
+
+/* Longest "/peer" line accepted. */
+#define PEER_LINE_MAX 256
+
+/**
+ * @brief Returns the milliseconds left until a time
+ *
+ * @param t The time
+ * @return The time left in ms, 0 or less if it has passed
+ */
+static long msUntil(const struct timespec* t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (t->tv_sec - now.tv_sec) * 1000 + (t->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/**
+ * @brief Marks a peer link closing
+ *
+ * The link is removed at the end of the loop iteration; a configured peer is
+ * connected to again by connectPeers.
+ *
+ * @param conn The peer link
+ * @param pool A pointer to the connection pool structure
+ */
+static void closeLink(conn_t* conn, conn_pool_t* pool) {
+    markClosing(conn, pool);
+}
+
+/**
+ * @brief Resolves the host of a peer
+ *
+ * Resolving blocks, so it is done once per peer and not for every
+ * connection attempt or "/peer" line.
+ *
+ * @param peer The peer, its addresses set on success
+ * @return 0 on success, -1 if the host did not resolve
+ */
+static int resolvePeer(peer_t* peer) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(peer->host, peer->port, &hints, &peer->addrs);
+    if (err != 0) {
+        printf("Cannot resolve peer %s:%s: %s\n", peer->host, peer->port, gai_strerror(err));
+        peer->addrs = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds a peer to connect to
+ *
+ * Its host is resolved now; one that does not resolve yet is tried again
+ * on the next connection attempts.
+ *
+ * @param spec The "host:port" of the peer's client port
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int addPeer(const char* spec, conn_pool_t* pool) {
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || colon[1] == '\0') {
+        return -1;
+    }
+    federation_t *fed = &pool->fed;
+    peer_t *peers = realloc(fed->peers, (fed->nr_peers + 1) * sizeof(peer_t));
+    if (peers == NULL) {
+        return -1;
+    }
+    fed->peers = peers;
+    peer_t *peer = &peers[fed->nr_peers];
+    memset(peer, 0, sizeof(*peer));
+    peer->host = strndup(spec, colon - spec);
+    peer->port = strdup(colon + 1);
+    if (peer->host == NULL || peer->port == NULL) {
+        free(peer->host);
+        free(peer->port);
+        return -1;
+    }
+    peer->fd = -1;
+    fed->nr_peers++;
+    resolvePeer(peer);
+    return 0;
+}
+
+/**
+ * @brief Starts a non-blocking connection to a peer
+ *
+ * The link enters the pool right away with the "/peer" line queued; whether
+ * the connection succeeded is checked once it becomes writable.
+ *
+ * @param peer The peer
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int dialPeer(peer_t* peer, conn_pool_t* pool) {
+    if (peer->addrs == NULL && resolvePeer(peer) == -1) {
+        return -1;
+    }
+    struct addrinfo *res = peer->addrs;
+    int sd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int on = 1;
+    if (sd < 0 || ioctl(sd, FIONBIO, (char *)&on) < 0 ||
+        (connect(sd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+        if (sd >= 0) {
+            close(sd);
+        }
+        return -1;
+    }
+    peer_link_t *link = calloc(1, sizeof(peer_link_t));
+    conn_t *conn = link != NULL ? newConn(sd, CONN_PEER, pool) : NULL;
+    if (conn == NULL) {
+        free(link);
+        close(sd);
+        return -1;
+    }
+    link->connecting = 1;
+    conn->link = link;
+    peer->fd = sd;
+    peer->conn_id = conn->id;
+    printf("Connecting to peer %s:%s on sd %d\n", peer->host, peer->port, sd);
+    return sendNotice(conn, pool, "/peer %u %llu\n", pool->fed.node_id, (unsigned long long)pool->fed.epoch);
+}
+
+/**
+ * @brief Connects to the configured peers that have no link
+ *
+ * A peer whose link went away is tried again PEER_RETRY_MS after the
+ * previous attempt.
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return The ms until the next attempt is due, -1 if every peer is connected
+ */
+long connectPeers(conn_pool_t* pool) {
+    long wait_ms = -1;
+    federation_t *fed = &pool->fed;
+    for (int i = 0; i < fed->nr_peers; i++) {
+        peer_t *peer = &fed->peers[i];
+        conn_t *conn = peer->fd >= 0 ? pool->by_fd[peer->fd] : NULL;
+        if (conn != NULL && conn->id == peer->conn_id) {
+            continue;
+        }
+        peer->fd = -1;
+        long left = msUntil(&peer->retry_at);
+        if (left <= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &peer->retry_at);
+            peer->retry_at.tv_sec += PEER_RETRY_MS / 1000;
+            peer->retry_at.tv_nsec += (PEER_RETRY_MS % 1000) * 1000000L;
+            if (peer->retry_at.tv_nsec >= 1000000000L) {
+                peer->retry_at.tv_sec++;
+                peer->retry_at.tv_nsec -= 1000000000L;
+            }
+            if (dialPeer(peer, pool) == 0) {
+                continue;
+            }
+            left = PEER_RETRY_MS;
+        }
+        if (wait_ms < 0 || left < wait_ms) {
+            wait_ms = left;
+        }
+    }
+    return wait_ms;
+}
+
+/**
+ * @brief Tells whether a connection comes from the host of a configured peer
+ *
+ * Only the address is compared: the peer connects from a port of its own.
+ * It is compared with the addresses the peers resolved to, nothing is
+ * resolved here: any client can send a "/peer" line.
+ *
+ * @param conn The client connection
+ * @param pool A pointer to the connection pool structure
+ * @return 1 if it does, 0 if not
+ */
+int knownPeer(conn_t* conn, conn_pool_t* pool) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(conn->fd, (struct sockaddr*)&addr, &addr_len) < 0 ||
+        (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)) {
+        return 0;
+    }
+    federation_t *fed = &pool->fed;
+    for (int i = 0; i < fed->nr_peers; i++) {
+        for (struct addrinfo *ai = fed->peers[i].addrs; ai != NULL; ai = ai->ai_next) {
+            if (ai->ai_family != addr.ss_family) {
+                continue;
+            }
+            if (addr.ss_family == AF_INET ?
+                ((struct sockaddr_in*)ai->ai_addr)->sin_addr.s_addr == ((struct sockaddr_in*)&addr)->sin_addr.s_addr :
+                memcmp(&((struct sockaddr_in6*)ai->ai_addr)->sin6_addr,
+                       &((struct sockaddr_in6*)&addr)->sin6_addr, sizeof(struct in6_addr)) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Turns a client connection into a peer link
+ *
+ * Answers with this node's own "/peer" line. The link writes from the
+ * connection's cursor on, so it forwards the broadcasts accepted from now on.
+ *
+ * @param conn The connection that sent the "/peer" line
+ * @param node The node id of the peer
+ * @param epoch The epoch of the peer
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int startPeer(conn_t* conn, uint32_t node, uint64_t epoch, conn_pool_t* pool) {
+    if (node == 0 || node == pool->fed.node_id) {
+        return -1;
+    }
+    peer_link_t *link = calloc(1, sizeof(peer_link_t));
+    if (link == NULL) {
+        return -1;
+    }
+    link->node = node;
+    link->epoch = epoch;
+    conn->link = link;
+    conn->type = CONN_PEER;
+    conn->replay_end = 0;
+    printf("Peer link to node %u on sd %d\n", node, conn->fd);
+    return sendNotice(conn, pool, "/peer %u %llu\n", pool->fed.node_id, (unsigned long long)pool->fed.epoch);
+}
+
+/**
+ * @brief Reads the "/peer" line answered by a peer this node connected to
+ *
+ * Lines before it (client broadcasts written before the peer turned the
+ * connection into a link) are skipped.
+ *
+ * @param link The link state, its node id set when the line is found
+ * @param data The bytes read
+ * @param len The number of bytes
+ * @return The number of bytes consumed, -1 if the peer is not answering as a peer
+ */
+static long readHandshake(peer_link_t* link, const char* data, size_t len) {
+    size_t off = 0;
+    const char *nl;
+    while ((nl = memchr(data + off, '\n', len - off)) != NULL) {
+        char line[PEER_LINE_MAX];
+        size_t n = nl - (data + off);
+        if (n >= sizeof(line)) {
+            n = sizeof(line) - 1;
+        }
+        memcpy(line, data + off, n);
+        line[n] = '\0';
+        off = nl + 1 - data;
+        unsigned int node;
+        unsigned long long epoch;
+        if (sscanf(line, "/peer %u %llu", &node, &epoch) == 2 && node != 0) {
+            link->node = node;
+            link->epoch = epoch;
+            return off;
+        }
+    }
+    return len - off > PEER_LINE_MAX ? -1 : (long)off;
+}
+
+/**
+ * @brief Broadcasts a record received from a peer to the local clients
+ *
+ * @param conn The peer link
+ * @param hdr The record header, in host byte order
+ * @param data The message bytes
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int deliverRecord(conn_t* conn, const peer_record_t* hdr, const char* data, conn_pool_t* pool) {
+    federation_t *fed = &pool->fed;
+    if (hdr->node == fed->node_id) {
+        return 0; // Own broadcast came back
+    }
+    struct peer_seen *seen = NULL;
+    for (int i = 0; i < fed->nr_seen; i++) {
+        if (fed->seen[i].node == hdr->node) {
+            seen = &fed->seen[i];
+            break;
+        }
+    }
+    if (seen == NULL) {
+        seen = realloc(fed->seen, (fed->nr_seen + 1) * sizeof(*seen));
+        if (seen == NULL) {
+            return -1;
+        }
+        fed->seen = seen;
+        seen = &fed->seen[fed->nr_seen++];
+        seen->node = hdr->node;
+        seen->epoch = conn->link->epoch;
+        seen->seq = 0;
+    }
+    if (seen->epoch != conn->link->epoch) {
+        // The origin node restarted and numbers its broadcasts anew
+        seen->epoch = conn->link->epoch;
+        seen->seq = 0;
+    }
+    if (hdr->seq <= seen->seq) {
+        return 0; // Already received over another link
+    }
+    seen->seq = hdr->seq;
+    payload_t *payload = newPayload(data, hdr->len);
+    if (payload == NULL) {
+        return -1;
+    }
+    payload->origin = conn->id;
+    payload->node = hdr->node;
+    payload->node_seq = hdr->seq;
+    int ret = broadcastPayload(payload, pool);
+    payloadUnref(payload);
+    return ret;
+}
+
+/**
+ * @brief Handles the bytes read from a peer link
+ *
+ * Complete records are broadcast straight from the read buffer; a trailing
+ * incomplete record is kept in the connection's input buffer. A link that
+ * breaks the protocol is closed.
+ *
+ * @param conn The peer link
+ * @param buffer The bytes read
+ * @param len The number of bytes read
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int peerInput(conn_t* conn, char* buffer, int len, conn_pool_t* pool) {
+    char *data = buffer;
+    size_t avail = len;
+    if (conn->in_len > 0) {
+        char *joined = realloc(conn->in_buf, conn->in_len + len);
+        if (joined == NULL) {
+            return -1;
+        }
+        memcpy(joined + conn->in_len, buffer, len);
+        conn->in_buf = data = joined;
+        conn->in_len = avail = conn->in_len + len;
+    }
+    int ret = 0;
+    size_t off = 0;
+    if (conn->link->node == 0) {
+        long used = readHandshake(conn->link, data, avail);
+        if (used < 0) {
+            closeLink(conn, pool);
+            return -1;
+        }
+        off = used;
+    }
+    while (conn->link->node != 0 && avail - off >= sizeof(peer_record_t)) {
+        peer_record_t hdr;
+        memcpy(&hdr, data + off, sizeof(hdr));
+        hdr.len = ntohl(hdr.len);
+        hdr.node = ntohl(hdr.node);
+        hdr.seq = be64toh(hdr.seq);
+        if (hdr.len == 0 || hdr.len > PEER_MAX_RECORD) {
+            closeLink(conn, pool);
+            return -1;
+        }
+        if (avail - off - sizeof(hdr) < hdr.len) {
+            break;
+        }
+        ret |= deliverRecord(conn, &hdr, data + off + sizeof(hdr), pool);
+        off += sizeof(hdr) + hdr.len;
+    }
+    // Keep the incomplete record for the next read
+    size_t rest = avail - off;
+    if (rest == 0) {
+        free(conn->in_buf);
+        conn->in_buf = NULL;
+        conn->in_len = 0;
+    } else if (data == conn->in_buf) {
+        memmove(conn->in_buf, data + off, rest);
+        conn->in_len = rest;
+    } else {
+        conn->in_buf = malloc(rest);
+        if (conn->in_buf == NULL) {
+            return -1;
+        }
+        memcpy(conn->in_buf, data + off, rest);
+        conn->in_len = rest;
+    }
+    return ret;
+}
+
+/**
+ * @brief Writes pending records to a peer link
+ *
+ * Gathers the queued messages (the "/peer" line) and every published
+ * broadcast accepted on this node from the link's cursor on, each as a
+ * record header and the message, and sends them with a single non-blocking
+ * writev: all broadcasts of a loop iteration cross the link together. The
+ * cursor offset counts the bytes of header and message already written.
+ *
+ * @param conn The peer link
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int writeToPeer(conn_t* conn, conn_pool_t* pool) {
+    peer_link_t *link = conn->link;
+    if (link->connecting) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+            printf("Peer connection on sd %d failed: %s\n", conn->fd, strerror(err));
+            closeLink(conn, pool);
+            return 0;
+        }
+        link->connecting = 0;
+    }
+    ring_t *history = &pool->history;
+    struct iovec iov[WRITE_IOV_MAX];
+    // Sequence number of the record of each iovec, 0 for queued messages
+    unsigned long long iov_seq[WRITE_IOV_MAX];
+    peer_record_t hdr[WRITE_IOV_MAX / 2];
+    int iovcnt = 0, nhdr = 0;
+    for (msg_t *msg = conn->write_msg_head; msg != NULL && iovcnt < WRITE_IOV_MAX; msg = msg->next) {
+        iov[iovcnt].iov_base = msg->payload->data + msg->offset;
+        iov[iovcnt].iov_len = msg->len;
+        iov_seq[iovcnt++] = 0;
+    }
+    unsigned long long seq = connCursor(pool, conn);
+    if (seq < history->first_seq) {
+        seq = history->first_seq;
+        conn->cursor_off = 0;
+    }
+    for (; seq < pool->published && iovcnt + 2 <= WRITE_IOV_MAX; seq++) {
+        payload_t *payload = ringGet(history, seq);
+        if (payload == NULL || payload->node != pool->fed.node_id) {
+            continue; // Only broadcasts accepted on this node are forwarded
+        }
+        size_t off = seq == connCursor(pool, conn) ? conn->cursor_off : 0;
+        hdr[nhdr].len = htonl(payload->size);
+        hdr[nhdr].node = htonl(payload->node);
+        hdr[nhdr].seq = htobe64(payload->node_seq);
+        if (off < sizeof(peer_record_t)) {
+            iov[iovcnt].iov_base = (char*)&hdr[nhdr] + off;
+            iov[iovcnt].iov_len = sizeof(peer_record_t) - off;
+            iov_seq[iovcnt++] = seq;
+            off = 0;
+        } else {
+            off -= sizeof(peer_record_t);
+        }
+        iov[iovcnt].iov_base = payload->data + off;
+        iov[iovcnt].iov_len = payload->size - off;
+        iov_seq[iovcnt++] = seq;
+        nhdr++;
+    }
+    // Every broadcast below seq is gathered or skipped
+    unsigned long long scanned = seq;
+    int i = 0;
+    if (iovcnt > 0) {
+        ssize_t ret = writev(conn->fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("Error writing to peer");
+            closeLink(conn, pool);
+            return -1;
+        }
+        // Drop what was written, remember where a partly written record stopped
+        for (; i < iovcnt && (size_t)ret >= iov[i].iov_len; i++) {
+            ret -= iov[i].iov_len;
+            if (iov_seq[i] == 0) {
+                msg_t *msg = conn->write_msg_head;
+                conn->write_msg_head = msg->next;
+                if (conn->write_msg_ctrl == msg) {
+                    conn->write_msg_ctrl = NULL;
+                }
+                payloadUnref(msg->payload);
+                free(msg);
+            } else if (i + 1 == iovcnt || iov_seq[i + 1] != iov_seq[i]) {
+                connCursor(pool, conn) = iov_seq[i] + 1;
+                conn->cursor_off = 0;
+            } else {
+                if (connCursor(pool, conn) != iov_seq[i]) {
+                    connCursor(pool, conn) = iov_seq[i];
+                    conn->cursor_off = 0;
+                }
+                conn->cursor_off += iov[i].iov_len;
+            }
+        }
+        if (i < iovcnt && iov_seq[i] == 0) {
+            conn->write_msg_head->offset += ret;
+            conn->write_msg_head->len -= ret;
+            if (ret > 0 && conn->write_msg_ctrl == NULL) {
+                conn->write_msg_ctrl = conn->write_msg_head;
+            }
+        } else if (i < iovcnt && ret > 0) {
+            if (connCursor(pool, conn) != iov_seq[i]) {
+                connCursor(pool, conn) = iov_seq[i];
+                conn->cursor_off = 0;
+            }
+            conn->cursor_off += ret;
+        }
+    }
+    if (i == iovcnt) {
+        connCursor(pool, conn) = scanned;
+    }
+    if (conn->write_msg_head == NULL) {
+        conn->write_msg_tail = NULL;
+    } else {
+        conn->write_msg_head->prev = NULL;
+    }
+    if (conn->write_msg_head == NULL && conn->cursor_off == 0 && connCursor(pool, conn) >= pool->published) {
+        FD_CLR(conn->fd, &pool->write_set); // Nothing left to forward
+    }
+    return 0;
+}
+
+/**
+ * @brief Releases the federation state
+ *
+ * @param fed A pointer to the federation state
+ */
+void freeFederation(federation_t* fed) {
+    for (int i = 0; i < fed->nr_peers; i++) {
+        free(fed->peers[i].host);
+        free(fed->peers[i].port);
+        if (fed->peers[i].addrs != NULL) {
+            freeaddrinfo(fed->peers[i].addrs);
+        }
+    }
+    free(fed->peers);
+    free(fed->seen);
+    fed->peers = NULL;
+    fed->seen = NULL;
+    fed->nr_peers = fed->nr_seen = 0;
+}
@@ -0,0 +1,145 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netdb.h>
+
+/*
+ * Federation of chat servers.
+ *
+ * Every node has a node id and an epoch, the time it started. A node
+ * connects to each configured peer's client port and sends the line
+ * "/peer <node_id> <epoch>", which turns the connection into a peer link;
+ * the peer answers with the same line. The line is accepted only from the
+ * address of a peer configured on the receiving node, anyone else gets
+ * "* peer refused": a link is trusted with every record it sends. After the line a peer link carries
+ * binary records in both directions, one per broadcast: a peer_record_t
+ * followed by len bytes of message.
+ *
+ * Each node forwards to its peers only the broadcasts that originated on
+ * it, once per link, and fans out the records it receives to its local
+ * clients only, so the nodes must form a full mesh. A record carrying the
+ * node's own id, or a sequence number not above the last one seen from its
+ * origin node in its epoch (two links between the same nodes), is dropped, so
+ * broadcasts never loop or repeat. Like clients, peer links write from the
+ * shared ring at their own cursor, so all records pending on a link go out
+ * in one writev per loop iteration.
+ */
+
+/* Delay between two connection attempts to a peer. */
+#define PEER_RETRY_MS 1000
+/* Largest record accepted from a peer. */
+#define PEER_MAX_RECORD (16 << 20)
+
+/* Header of a record on a peer link, in network byte order. */
+typedef struct peer_record {
+        /* Size of the message. */
+        uint32_t len;
+        /* Id of the node the broadcast originated on. */
+        uint32_t node;
+        /* Sequence number of the broadcast on its origin node. */
+        uint64_t seq;
+}peer_record_t;
+
+/* State of a peer link, held by its connection. */
+typedef struct peer_link {
+        /* Node id and epoch of the peer, node 0 until its "/peer" line was read. */
+        uint32_t node;
+        uint64_t epoch;
+        /* Set while the connection to the peer is being established. */
+        int connecting;
+}peer_link_t;
+
+/* A configured peer this node connects to. */
+typedef struct peer {
+        /* Host name and client port of the peer. */
+        char *host;
+        char *port;
+        /* Addresses the host resolved to, NULL until it resolved. */
+        struct addrinfo *addrs;
+        /* Descriptor and connection id of the link, fd -1 while not connected. */
+        int fd;
+        unsigned long long conn_id;
+        /* Time of the next connection attempt. */
+        struct timespec retry_at;
+}peer_t;
+
+/* Data structure to keep track of the federation state of a node. */
+typedef struct federation {
+        /* Id of this node, never 0. */
+        uint32_t node_id;
+        /* Start time of this node in us, tells a restarted peer from a second link to it. */
+        uint64_t epoch;
+        /* Peers this node connects to. */
+        peer_t *peers;
+        int nr_peers;
+        /* Highest sequence number received from every origin node in its epoch. */
+        struct peer_seen {
+                uint32_t node;
+                uint64_t epoch;
+                uint64_t seq;
+        } *seen;
+        int nr_seen;
+}federation_t;
+
+struct conn;
+struct conn_pool;
+
+/*
+ * Add a peer to connect to and resolve its host.
+ * @ spec - "host:port" of the peer's client port
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int addPeer(const char* spec, struct conn_pool* pool);
+
+/*
+ * Start connecting to the configured peers that are not connected and due for an attempt.
+ * @pool - the pool
+ * @ return value - ms until the next attempt is due, -1 if every peer is connected
+ */
+long connectPeers(struct conn_pool* pool);
+
+/*
+ * Tell whether a connection comes from the host of a configured peer.
+ * @ conn - the client connection
+ * @pool - the pool
+ * @ return value - 1 if it does, 0 if not
+ */
+int knownPeer(struct conn* conn, struct conn_pool* pool);
+
+/*
+ * Turn a client connection into a peer link after its "/peer" line.
+ * @ conn - the connection
+ * @ node - the node id announced by the peer
+ * @ epoch - the epoch announced by the peer
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int startPeer(struct conn* conn, uint32_t node, uint64_t epoch, struct conn_pool* pool);
+
+/*
+ * Handle bytes read from a peer link, broadcasting every complete record locally.
+ * @ conn - the peer link
+ * @ buffer - the bytes read
+ * @ len - the number of bytes
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure (the link should be closed)
+ */
+int peerInput(struct conn* conn, char* buffer, int len, struct conn_pool* pool);
+
+/*
+ * Write the pending local broadcasts to a peer link.
+ * @ conn - the peer link
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int writeToPeer(struct conn* conn, struct conn_pool* pool);
+
+/*
+ * Release the federation state.
+ */
+void freeFederation(federation_t* fed);
+
+#endif
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+/**
+ * @brief Allocates a payload whose bytes are written by the caller
+ *
+ * The payload header and the message bytes share one allocation. The caller
+ * may lower size after writing fewer bytes.
+ *
+ * @param len The room for the message bytes
+ * @return The payload with a reference count of 1, NULL on failure
+ */
+payload_t* allocPayload(int len) {
+    if (len < 0) {
+        return NULL;
+    }
+    payload_t *p = malloc(sizeof(payload_t) + len + 1);
+    if (p == NULL) {
+        return NULL;
+    }
+    p->refcnt = 1;
+    p->seq = 0;
+    p->origin = 0;
+    p->node = 0;
+    p->node_seq = 0;
+    p->cont = 0;
+    p->zipped = NULL;
+    p->ws_frame = NULL;
+    p->size = len;
+    p->data[len] = '\0';
+    return p;
+}
+
+/**
+ * @brief Allocates a new payload
+ *
+ * @param buffer The message bytes
+ * @param len The length of the message
+ * @return The payload with a reference count of 1, NULL on failure
+ */
+payload_t* newPayload(const char* buffer, int len) {
+    if (buffer == NULL) {
+        return NULL;
+    }
+    payload_t *p = allocPayload(len);
+    if (p != NULL) {
+        memcpy(p->data, buffer, len);
+    }
+    return p;
+}
+
+/**
+ * @brief Takes a reference to a payload
+ *
+ * @param p The payload
+ * @return p
+ */
+payload_t* payloadRef(payload_t* p) {
+    if (p != NULL) {
+        p->refcnt++;
+    }
+    return p;
+}
+
+/**
+ * @brief Drops a reference to a payload
+ *
+ * The payload is freed together with its last reference.
+ *
+ * @param p The payload
+ */
+void payloadUnref(payload_t* p) {
+    if (p != NULL && --p->refcnt == 0) {
+        payloadUnref(p->zipped);
+        payloadUnref(p->ws_frame);
+        free(p);
+    }
+}
+
+/**
+ * @brief Initializes the history ring
+ *
+ * @param ring A pointer to the ring structure
+ * @param capacity The number of slots
+ * @param max_bytes The upper bound for the payload bytes held
+ * @return 0 on success, -1 on failure
+ */
+int initRing(ring_t* ring, unsigned int capacity, size_t max_bytes) {
+    if (ring == NULL || capacity == 0) {
+        return -1;
+    }
+    ring->slots = calloc(capacity, sizeof(payload_t*));
+    if (ring->slots == NULL) {
+        return -1;
+    }
+    ring->capacity = capacity;
+    ring->first_seq = 1;
+    ring->next_seq = 1;
+    ring->bytes = 0;
+    ring->max_bytes = max_bytes;
+    return 0;
+}
+
+/**
+ * @brief Evicts the oldest payload of the ring
+ *
+ * @param ring A pointer to the ring structure
+ */
+static void ringEvict(ring_t* ring) {
+    payload_t **slot = &ring->slots[ring->first_seq % ring->capacity];
+    if (*slot != NULL) {
+        ring->bytes -= (*slot)->size;
+        payloadUnref(*slot);
+        *slot = NULL;
+    }
+    ring->first_seq++;
+}
+
+/**
+ * @brief Appends a payload to the ring
+ *
+ * Evicts the oldest entries until both the slot and the byte bound hold,
+ * then stores a reference to the payload under the next sequence number.
+ * A payload larger than the byte bound is refused without evicting anything.
+ *
+ * @param ring A pointer to the ring structure
+ * @param p The payload to append
+ * @return The sequence number assigned to the payload, 0 if it was refused
+ */
+unsigned long long ringPush(ring_t* ring, payload_t* p) {
+    if ((size_t)p->size > ring->max_bytes) {
+        return 0;
+    }
+    while (ring->first_seq < ring->next_seq &&
+           (ring->next_seq - ring->first_seq >= ring->capacity ||
+            ring->bytes + p->size > ring->max_bytes)) {
+        ringEvict(ring);
+    }
+    p->seq = ring->next_seq++;
+    ring->slots[p->seq % ring->capacity] = payloadRef(p);
+    ring->bytes += p->size;
+    return p->seq;
+}
+
+/**
+ * @brief Computes which payloads a push would evict
+ *
+ * @param ring A pointer to the ring structure
+ * @param size The size of the payload to push
+ * @return The sequence number of the oldest payload held after the push,
+ * first_seq if the payload would be refused
+ */
+unsigned long long ringFirstAfterPush(ring_t* ring, int size) {
+    unsigned long long first = ring->first_seq;
+    size_t bytes = ring->bytes;
+    if ((size_t)size > ring->max_bytes) {
+        return first;
+    }
+    while (first < ring->next_seq &&
+           (ring->next_seq - first >= ring->capacity || bytes + size > ring->max_bytes)) {
+        payload_t *p = ring->slots[first % ring->capacity];
+        if (p != NULL) {
+            bytes -= p->size;
+        }
+        first++;
+    }
+    return first;
+}
+
+/**
+ * @brief Looks up a payload by sequence number
+ *
+ * @param ring A pointer to the ring structure
+ * @param seq The sequence number
+ * @return The payload, NULL if it was evicted or not yet pushed
+ */
+payload_t* ringGet(ring_t* ring, unsigned long long seq) {
+    if (seq < ring->first_seq || seq >= ring->next_seq) {
+        return NULL;
+    }
+    return ring->slots[seq % ring->capacity];
+}
+
+/**
+ * @brief Empties the ring and restarts its numbering
+ *
+ * Used when the ring is rebuilt from a persistent log, whose sequence
+ * numbers do not start at 1.
+ *
+ * @param ring A pointer to the ring structure
+ * @param seq The sequence number the next pushed payload will get
+ */
+void ringReset(ring_t* ring, unsigned long long seq) {
+    while (ring->first_seq < ring->next_seq) {
+        ringEvict(ring);
+    }
+    ring->first_seq = seq;
+    ring->next_seq = seq;
+}
+
+/**
+ * @brief Releases the ring
+ *
+ * @param ring A pointer to the ring structure
+ */
+void freeRing(ring_t* ring) {
+    if (ring == NULL || ring->slots == NULL) {
+        return;
+    }
+    while (ring->first_seq < ring->next_seq) {
+        ringEvict(ring);
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+}
@@ -0,0 +1,125 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+/*
+ * Reference counted message payload. A payload is allocated once per broadcast
+ * and shared (never copied) by the history ring and by every connection queue
+ * the message is written to. It is freed when the last holder drops it.
+ */
+typedef struct payload {
+        /* Number of holders: the ring slot plus every queued msg_t. */
+        unsigned int refcnt;
+        /* Broadcast sequence number, 0 if the payload never entered the ring. */
+        unsigned long long seq;
+        /* Id of the connection that sent the broadcast, 0 if unknown. */
+        unsigned long long origin;
+        /* Id of the node the broadcast was accepted on and its sequence number there (federation). */
+        unsigned int node;
+        unsigned long long node_seq;
+        /* Compressed form of the message, shared by every compressing connection, NULL if none. */
+        struct payload *zipped;
+        /* WebSocket frame of the message, shared by every WebSocket client, NULL until first needed. */
+        struct payload *ws_frame;
+        /* Set on the next chunks of a streamed line, which continue the line of the broadcast before. */
+        unsigned char cont;
+        /* Size of the message. */
+        int size;
+        /* Message bytes, NUL terminated. */
+        char data[];
+}payload_t;
+
+/*
+ * Fixed-size ring of the most recent broadcasts, used to replay history to
+ * joining and reconnecting clients.
+ *
+ * The ring is bounded both by number of slots and by total payload bytes;
+ * when either limit would be exceeded the oldest entries are evicted. A
+ * payload larger than the byte bound by itself is refused.
+ * Sequence numbers start at 1 and increase by one per broadcast, the slot of
+ * sequence s is slots[s % capacity].
+ */
+typedef struct ring {
+        /* Array of capacity slots, NULL when empty. */
+        payload_t **slots;
+        /* Number of slots. */
+        unsigned int capacity;
+        /* Sequence number of the oldest payload still held. */
+        unsigned long long first_seq;
+        /* Sequence number the next pushed payload will get. */
+        unsigned long long next_seq;
+        /* Total size of the payloads held. */
+        size_t bytes;
+        /* Upper bound for bytes. */
+        size_t max_bytes;
+}ring_t;
+
+/*
+ * Allocate a payload holding a copy of buffer, with a reference count of 1.
+ * @ buffer - the message bytes
+ * @ len - length of msg
+ * @ return value - the payload, NULL on failure
+ */
+payload_t* newPayload(const char* buffer, int len);
+
+/*
+ * Allocate a payload with room for len bytes, written by the caller, with a reference count of 1.
+ * @ len - room for the message bytes; size may be lowered after writing fewer
+ * @ return value - the payload, NULL on failure
+ */
+payload_t* allocPayload(int len);
+
+/*
+ * Take another reference to a payload.
+ * @ return value - p
+ */
+payload_t* payloadRef(payload_t* p);
+
+/*
+ * Drop a reference to a payload, freeing it when it was the last one.
+ */
+void payloadUnref(payload_t* p);
+
+/*
+ * Init the ring.
+ * @ ring - allocated ring
+ * @ capacity - number of slots
+ * @ max_bytes - upper bound for the payload bytes held
+ * @ return value - 0 on success, -1 on failure
+ */
+int initRing(ring_t* ring, unsigned int capacity, size_t max_bytes);
+
+/*
+ * Append a payload, assigning it the next sequence number. The ring takes its
+ * own reference, the caller keeps its one. A payload larger than max_bytes is
+ * not pushed, so bytes never exceeds max_bytes.
+ * @ return value - the sequence number assigned, 0 if the payload is larger than max_bytes
+ */
+unsigned long long ringPush(ring_t* ring, payload_t* p);
+
+/*
+ * Sequence number of the oldest payload left after pushing a payload of a given size.
+ * @ size - the size of the payload to push
+ * @ return value - the sequence number, above first_seq if the push would evict payloads; first_seq if the payload would be refused
+ */
+unsigned long long ringFirstAfterPush(ring_t* ring, int size);
+
+/*
+ * Look up a payload by sequence number.
+ * @ return value - the payload (not referenced), NULL if it is not held
+ */
+payload_t* ringGet(ring_t* ring, unsigned long long seq);
+
+/*
+ * Drop every payload held and continue numbering at a given sequence number.
+ * @ seq - the sequence number the next pushed payload will get
+ */
+void ringReset(ring_t* ring, unsigned long long seq);
+
+/*
+ * Drop every payload held and release the slots.
+ */
+void freeRing(ring_t* ring);
+
+#endif
@@ -0,0 +1,433 @@
+#include <endian.h>
+#include <sys/random.h>
+#include "chatServer.h"
+
+/* Marks the slot of a removed entry. */
+#define SESSION_TOMBSTONE ((session_t*)&session_tombstone)
+static char session_tombstone;
+
+/**
+ * @brief Hashes a token
+ *
+ * Tokens are random, folding their halves is enough.
+ *
+ * @param token The token
+ * @return The hash
+ */
+static uint32_t hashToken(uint64_t token) {
+    return (uint32_t)(token ^ (token >> 32));
+}
+
+/**
+ * @brief Finds the slot of a token
+ *
+ * @param table A pointer to the table
+ * @param token The token
+ * @return The slot holding the session, NULL if it is not in the table
+ */
+static session_t** findSlot(session_table_t* table, uint64_t token) {
+    unsigned int mask = table->capacity - 1;
+    for (unsigned int i = hashToken(token) & mask; ; i = (i + 1) & mask) {
+        session_t **slot = &table->slots[i];
+        if (*slot == NULL) {
+            return NULL;
+        }
+        if (*slot != SESSION_TOMBSTONE && (*slot)->token == token) {
+            return slot;
+        }
+    }
+}
+
+/**
+ * @brief Stores a session in the first free slot of its probe sequence
+ *
+ * @param table A pointer to the table, with room for the session
+ * @param s The session
+ */
+static void placeSlot(session_table_t* table, session_t* s) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = hashToken(s->token) & mask;
+    while (table->slots[i] != NULL && table->slots[i] != SESSION_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (table->slots[i] == SESSION_TOMBSTONE) {
+        table->removed--;
+    }
+    table->slots[i] = s;
+    table->count++;
+}
+
+/**
+ * @brief Rebuilds the table without tombstones, doubled unless live entries fill under a quarter of it
+ *
+ * @param table A pointer to the table
+ * @return 0 on success, -1 on failure
+ */
+static int growSessions(session_table_t* table) {
+    unsigned int capacity = table->capacity;
+    if ((table->count + 1) * 2 > capacity / 2) {
+        capacity *= 2;
+    }
+    session_t **slots = calloc(capacity, sizeof(session_t*));
+    if (slots == NULL) {
+        return -1;
+    }
+    session_t **old = table->slots;
+    unsigned int old_capacity = table->capacity;
+    table->slots = slots;
+    table->capacity = capacity;
+    table->count = 0;
+    table->removed = 0;
+    for (unsigned int i = 0; i < old_capacity; i++) {
+        if (old[i] != NULL && old[i] != SESSION_TOMBSTONE) {
+            placeSlot(table, old[i]);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Appends a session to the detached list
+ *
+ * @param table A pointer to the table
+ * @param s The session, just detached
+ */
+static void linkDetached(session_table_t* table, session_t* s) {
+    s->next = NULL;
+    s->prev = table->detached_tail;
+    if (table->detached_tail == NULL) {
+        table->detached_head = s;
+    } else {
+        table->detached_tail->next = s;
+    }
+    table->detached_tail = s;
+}
+
+/**
+ * @brief Removes a session from the detached list
+ *
+ * @param table A pointer to the table
+ * @param s The session, detached
+ */
+static void unlinkDetached(session_table_t* table, session_t* s) {
+    if (s->prev == NULL) {
+        table->detached_head = s->next;
+    } else {
+        s->prev->next = s->next;
+    }
+    if (s->next == NULL) {
+        table->detached_tail = s->prev;
+    } else {
+        s->next->prev = s->prev;
+    }
+    s->prev = s->next = NULL;
+}
+
+/**
+ * @brief Initializes the session table
+ *
+ * @param table A pointer to the table
+ * @return 0 on success, -1 on failure
+ */
+int initSessions(session_table_t* table) {
+    table->slots = calloc(SESSION_TABLE_MIN, sizeof(session_t*));
+    if (table->slots == NULL) {
+        return -1;
+    }
+    table->capacity = SESSION_TABLE_MIN;
+    table->count = 0;
+    table->removed = 0;
+    table->detached_head = NULL;
+    table->detached_tail = NULL;
+    return 0;
+}
+
+/**
+ * @brief Finds a session by token
+ *
+ * @param pool A pointer to the connection pool structure
+ * @param token The token
+ * @return The session, NULL if there is none
+ */
+session_t* findSession(conn_pool_t* pool, uint64_t token) {
+    session_t **slot = findSlot(&pool->sessions, token);
+    return slot != NULL ? *slot : NULL;
+}
+
+/**
+ * @brief Adds a session to the table
+ *
+ * A detached session goes to the end of the detached list.
+ *
+ * @param pool A pointer to the connection pool structure
+ * @param s The session, its token not in the table
+ * @return 0 on success, -1 on failure
+ */
+int addSession(conn_pool_t* pool, session_t* s) {
+    session_table_t *table = &pool->sessions;
+    if ((table->count + table->removed + 1) * 2 > table->capacity && growSessions(table) == -1) {
+        return -1;
+    }
+    placeSlot(table, s);
+    s->prev = s->next = NULL;
+    if (s->conn == NULL) {
+        linkDetached(table, s);
+    }
+    return 0;
+}
+
+/**
+ * @brief Walks the sessions
+ *
+ * @param pool A pointer to the connection pool structure
+ * @param pos The slot to continue from, 0 to start; moved past the session returned
+ * @return The next session, NULL after the last one
+ */
+session_t* nextSession(conn_pool_t* pool, unsigned int* pos) {
+    session_table_t *table = &pool->sessions;
+    while (*pos < table->capacity) {
+        session_t *s = table->slots[(*pos)++];
+        if (s != NULL && s != SESSION_TOMBSTONE) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Removes a session from the table and frees it
+ *
+ * @param pool A pointer to the connection pool structure
+ * @param s The session
+ */
+static void freeSession(conn_pool_t* pool, session_t* s) {
+    session_table_t *table = &pool->sessions;
+    session_t **slot = findSlot(table, s->token);
+    if (slot != NULL) {
+        *slot = SESSION_TOMBSTONE;
+        table->count--;
+        table->removed++;
+    }
+    if (s->conn != NULL) {
+        s->conn->session = NULL;
+    } else {
+        unlinkDetached(table, s);
+    }
+    free(s);
+}
+
+/**
+ * @brief Draws a token no session has
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return The token, never 0
+ */
+static uint64_t newToken(conn_pool_t* pool) {
+    static uint64_t counter;
+    uint64_t token = 0;
+    while (token == 0 || findSession(pool, token) != NULL) {
+        if (getrandom(&token, sizeof(token), GRND_NONBLOCK) != sizeof(token)) {
+            // No entropy yet: unique, if guessable
+            token = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ ++counter;
+        }
+    }
+    return token;
+}
+
+/**
+ * @brief Opens a session for a connection
+ *
+ * Broadcasts before the connection's cursor count as acknowledged. A
+ * connection that already has a session is told its token again. With
+ * SESSION_MAX sessions kept, the oldest detached one is dropped for it.
+ *
+ * @param conn The connection that sent "/session"
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int startSession(conn_t* conn, conn_pool_t* pool) {
+    if (isWs(conn->proto)) {
+        return sendNotice(conn, pool, "* sessions need a line or framed connection\n");
+    }
+    session_t *s = conn->session;
+    if (s == NULL) {
+        // Tags must not start in the middle of a broadcast
+        if (detachPartial(conn, pool) == -1) {
+            return -1;
+        }
+        if (pool->sessions.count >= SESSION_MAX) {
+            if (pool->sessions.detached_head == NULL) {
+                return sendNotice(conn, pool, "* too many sessions\n");
+            }
+            freeSession(pool, pool->sessions.detached_head);
+        }
+        s = malloc(sizeof(session_t));
+        if (s == NULL) {
+            return -1;
+        }
+        s->token = newToken(pool);
+        s->id = conn->id;
+        s->acked = connCursor(pool, conn) - 1;
+        s->conn = conn;
+        if (addSession(pool, s) == -1) {
+            free(s);
+            return -1;
+        }
+        conn->session = s;
+    }
+    return sendNotice(conn, pool, "* session %016llx %llu\n", (unsigned long long)s->token, s->acked + 1);
+}
+
+/**
+ * @brief Takes over a detached session
+ *
+ * The connection gets the session's origin id and its cursor moves to the
+ * broadcast after the last one acknowledged. A session the connection had
+ * is dropped.
+ *
+ * @param conn The connection that sent "/resume"
+ * @param token The token of the session
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int resumeSession(conn_t* conn, uint64_t token, conn_pool_t* pool) {
+    session_t *s = findSession(pool, token);
+    if (s == NULL || s->conn != NULL || isWs(conn->proto)) {
+        return sendNotice(conn, pool, "* no such session %016llx\n", (unsigned long long)token);
+    }
+    if (detachPartial(conn, pool) == -1) {
+        return -1;
+    }
+    if (conn->session != NULL) {
+        freeSession(pool, conn->session);
+    }
+    unlinkDetached(&pool->sessions, s);
+    s->conn = conn;
+    conn->session = s;
+    conn->id = s->id;
+    conn->replay_end = 0;
+    unsigned long long from = s->acked + 1;
+    unsigned long long lost = 0;
+    if (from < pool->history.first_seq) {
+        lost = pool->history.first_seq - from;
+        from = pool->history.first_seq;
+    }
+    connCursor(pool, conn) = from;
+    if (from < pool->min_cursor) {
+        pool->min_cursor = from;
+    }
+    FD_SET(conn->fd, &pool->write_set);
+    if (lost > 0 && sendNotice(conn, pool, "* skipped %llu messages\n", lost) == -1) {
+        return -1;
+    }
+    return sendNotice(conn, pool, "* resumed %016llx %llu\n", (unsigned long long)token, from);
+}
+
+/**
+ * @brief Records that a session client processed the broadcasts up to seq
+ *
+ * A line client sees one number per streamed line, the first chunk's: it
+ * acknowledges the chunks continuing the line too, all in the ring once
+ * the client read the line's end.
+ *
+ * @param conn The connection
+ * @param seq The sequence number acknowledged
+ * @param pool A pointer to the connection pool structure
+ */
+void ackSession(conn_t* conn, unsigned long long seq, conn_pool_t* pool) {
+    session_t *s = conn->session;
+    if (s == NULL || seq <= s->acked || seq >= pool->history.next_seq) {
+        return;
+    }
+    payload_t *next;
+    while (conn->proto == PROTO_LINE && (next = ringGet(&pool->history, seq + 1)) != NULL && next->cont) {
+        seq++;
+    }
+    s->acked = seq;
+}
+
+/**
+ * @brief Keeps the session of a connection being removed for the grace period
+ *
+ * @param conn The connection
+ * @param pool A pointer to the connection pool structure
+ */
+void detachSession(conn_t* conn, conn_pool_t* pool) {
+    session_t *s = conn->session;
+    if (s == NULL) {
+        return;
+    }
+    s->conn = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &s->detached);
+    linkDetached(&pool->sessions, s);
+    conn->session = NULL;
+}
+
+/**
+ * @brief Drops the detached sessions whose grace period is over
+ *
+ * The detached list is in the order of the detach times, so only its
+ * expired head is looked at.
+ *
+ * @param pool A pointer to the connection pool structure
+ */
+void expireSessions(conn_pool_t* pool) {
+    if (pool->sessions.detached_head == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    session_t *s;
+    while ((s = pool->sessions.detached_head) != NULL) {
+        long long elapsed_ms = (now.tv_sec - s->detached.tv_sec) * 1000LL + (now.tv_nsec - s->detached.tv_nsec) / 1000000;
+        if (elapsed_ms < pool->session_grace_ms) {
+            break;
+        }
+        freeSession(pool, s);
+    }
+}
+
+/**
+ * @brief Writes the sequence tag preceding a broadcast to a session connection
+ *
+ * @param conn The connection
+ * @param seq The sequence number of the broadcast
+ * @param buf The buffer, at least SESSION_TAG_MAX bytes
+ * @return The length of the tag, 0 if the connection has no session
+ */
+int sessionTag(conn_t* conn, unsigned long long seq, char* buf) {
+    if (conn->session == NULL) {
+        return 0;
+    }
+    if (conn->proto == PROTO_FRAME) {
+        frame_hdr_t hdr;
+        uint64_t be_seq = htobe64(seq);
+        setFrameHdr(&hdr, FRAME_SEQ, sizeof(be_seq));
+        memcpy(buf, &hdr, sizeof(hdr));
+        memcpy(buf + sizeof(hdr), &be_seq, sizeof(be_seq));
+        return sizeof(hdr) + sizeof(be_seq);
+    }
+    return snprintf(buf, SESSION_TAG_MAX, "%llu ", seq);
+}
+
+/**
+ * @brief Frees every session and releases the table
+ *
+ * @param pool A pointer to the connection pool structure
+ */
+void freeSessions(conn_pool_t* pool) {
+    session_table_t *table = &pool->sessions;
+    unsigned int pos = 0;
+    session_t *s;
+    while ((s = nextSession(pool, &pos)) != NULL) {
+        if (s->conn != NULL) {
+            s->conn->session = NULL;
+        }
+        free(s);
+    }
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = table->count = table->removed = 0;
+    table->detached_head = table->detached_tail = NULL;
+}
@@ -0,0 +1,164 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Resumable sessions.
+ *
+ * A client sends "/session" to open a session; the server answers with
+ * "* session <token> <seq>", the token naming the session and seq the
+ * sequence number of the next broadcast. From then on every broadcast
+ * written to the client carries its sequence number: a line starts with
+ * "<seq> ", a frame is preceded by a FRAME_SEQ frame. A line streamed in
+ * chunks (see processInput) is one line with the first chunk's number,
+ * and acknowledging it covers the other chunks. The client
+ * acknowledges what it processed with "/ack <seq>" (a FRAME_ACK frame on a
+ * framed connection). A framed client opens or resumes its session before
+ * sending "/binary".
+ *
+ * When the connection is lost the session is kept for the grace period.
+ * A new connection sending "/resume <token>" takes it over: it gets the
+ * session's origin id back, so its own broadcasts are still not echoed,
+ * and its cursor moves to the broadcast after the last one acknowledged,
+ * so what was in flight is written again. Broadcasts the ring no longer
+ * holds are reported as skipped. Notices and direct messages in flight
+ * are not resent.
+ */
+/* Time a session is kept after its connection was lost, unless -G is given. */
+#define SESSION_GRACE_MS 30000
+/* Most sessions kept, attached or detached. */
+#define SESSION_MAX 4096
+/* Initial number of slots of the session table, a power of two. */
+#define SESSION_TABLE_MIN 64
+
+typedef struct session {
+        /* Previous and next detached session, oldest first. */
+        struct session *prev;
+        struct session *next;
+        /* Random token naming the session. */
+        uint64_t token;
+        /* Origin id of the session's broadcasts, the id of the connection that opened it. */
+        unsigned long long id;
+        /* Sequence number of the last broadcast acknowledged. */
+        unsigned long long acked;
+        /* Connection holding the session, NULL while detached. */
+        struct conn *conn;
+        /* Time the session was detached (CLOCK_MONOTONIC). */
+        struct timespec detached;
+}session_t;
+
+/*
+ * Open-addressing hash table from token to session, probed linearly like
+ * the nickname table, with tombstones for removed entries. The detached
+ * sessions are also listed in the order they were detached, so expiring
+ * them looks at the oldest ones only. When SESSION_MAX sessions are kept, a
+ * new one replaces the oldest detached session, or is refused if none is.
+ */
+typedef struct session_table {
+        /* Array of capacity slots, NULL when empty. */
+        session_t **slots;
+        /* Number of slots, a power of two. */
+        unsigned int capacity;
+        /* Number of live entries. */
+        unsigned int count;
+        /* Number of tombstones. */
+        unsigned int removed;
+        /* Detached sessions, oldest first. */
+        session_t *detached_head;
+        session_t *detached_tail;
+}session_table_t;
+
+struct conn;
+struct conn_pool;
+
+/*
+ * Init the session table.
+ * @ table - allocated table
+ * @ return value - 0 on success, -1 on failure
+ */
+int initSessions(session_table_t* table);
+
+/*
+ * Open a session for a connection, or tell it its current one.
+ * @ conn - the connection
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int startSession(struct conn* conn, struct conn_pool* pool);
+
+/*
+ * Take over a detached session: the cursor moves after its last acknowledged broadcast.
+ * @ conn - the new connection
+ * @ token - the token of the session
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int resumeSession(struct conn* conn, uint64_t token, struct conn_pool* pool);
+
+/*
+ * Record that a session client processed the broadcasts up to seq.
+ * @ conn - the connection
+ * @ seq - the sequence number acknowledged
+ * @pool - the pool
+ */
+void ackSession(struct conn* conn, unsigned long long seq, struct conn_pool* pool);
+
+/*
+ * Keep the session of a connection being removed for the grace period.
+ * @ conn - the connection
+ * @pool - the pool
+ */
+void detachSession(struct conn* conn, struct conn_pool* pool);
+
+/*
+ * Drop the detached sessions whose grace period is over.
+ * @pool - the pool
+ */
+void expireSessions(struct conn_pool* pool);
+
+/*
+ * Write the sequence tag preceding a broadcast to a session connection.
+ * @ conn - the connection
+ * @ seq - the sequence number of the broadcast
+ * @ buf - the buffer, at least SESSION_TAG_MAX bytes
+ * @ return value - the length of the tag, 0 if the connection has no session
+ */
+int sessionTag(struct conn* conn, unsigned long long seq, char* buf);
+
+/* Longest sequence tag. */
+#define SESSION_TAG_MAX 24
+
+/*
+ * Find a session by token.
+ * @pool - the pool
+ * @ token - the token
+ * @ return value - the session, NULL if there is none
+ */
+session_t* findSession(struct conn_pool* pool, uint64_t token);
+
+/*
+ * Add a session handed over by the previous process; a detached one goes to
+ * the end of the detached list.
+ * @pool - the pool
+ * @ s - the session, its token not in the table
+ * @ return value - 0 on success, -1 on failure
+ */
+int addSession(struct conn_pool* pool, session_t* s);
+
+/*
+ * Walk the sessions.
+ * @pool - the pool
+ * @ pos - the slot to continue from, 0 to start; moved past the session returned
+ * @ return value - the next session, NULL after the last one
+ */
+session_t* nextSession(struct conn_pool* pool, unsigned int* pos);
+
+/*
+ * Free every session and release the table.
+ * @pool - the pool
+ */
+void freeSessions(struct conn_pool* pool);
+
+#endif
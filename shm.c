@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chatServer.h"
+
+/**
+ * @brief Tells whether a descriptor is an eventfd
+ *
+ * @param fd The descriptor
+ * @return 1 if it is, 0 if not
+ */
+static int isEventFd(int fd) {
+    char path[32], target[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len < 0) {
+        return 0;
+    }
+    target[len] = '\0';
+    return strcmp(target, "anon_inode:[eventfd]") == 0;
+}
+
+/**
+ * @brief Maps the ring of a client and watches its eventfd
+ *
+ * The header is read before mapping and the size kept by the server, so
+ * the client cannot grow the area read after the checks. The ring starts
+ * at the tail in the header, which lets a client attach again after an
+ * upgrade without losing what the old server did not read.
+ *
+ * @param conn The client connection
+ * @param mem_fd The memfd, closed in any case
+ * @param event_fd The eventfd, owned by the ring on success, closed on failure
+ * @param pool A pointer to the connection pool structure
+ * @return The size of the data area, -1 on failure with errno set
+ */
+int attachShm(conn_t* conn, int mem_fd, int event_fd, conn_pool_t* pool) {
+    shm_ring_t *ring = NULL;
+    void *map = MAP_FAILED;
+    size_t map_len = 0;
+    for (shm_ring_t *r = pool->shm_rings; r != NULL; r = r->next) {
+        if (r->owner == conn) {
+            errno = EBUSY;
+            goto fail;
+        }
+    }
+    int seals = fcntl(mem_fd, F_GET_SEALS);
+    if (seals == -1) {
+        goto fail;
+    }
+    if (!(seals & F_SEAL_SHRINK)) {
+        errno = EPERM;
+        goto fail;
+    }
+    if (!isEventFd(event_fd)) {
+        errno = EBADF;
+        goto fail;
+    }
+    shm_hdr_t hdr;
+    struct stat st;
+    if (pread(mem_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(mem_fd, &st) == -1) {
+        errno = EINVAL;
+        goto fail;
+    }
+    if (hdr.magic != SHM_MAGIC) {
+        errno = EPROTO;
+        goto fail;
+    }
+    if (hdr.size < SHM_SIZE_MIN || hdr.size > SHM_SIZE_MAX || (hdr.size & (hdr.size - 1)) != 0 ||
+        (size_t)st.st_size < sizeof(shm_hdr_t) + hdr.size || hdr.head - hdr.tail > hdr.size) {
+        errno = EINVAL;
+        goto fail;
+    }
+    map_len = sizeof(shm_hdr_t) + hdr.size;
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    ring = malloc(sizeof(shm_ring_t));
+    if (ring == NULL || fcntl(event_fd, F_SETFL, O_NONBLOCK) == -1) {
+        goto fail;
+    }
+    errno = EMFILE;
+    if ((ring->event = newConn(event_fd, CONN_SHM, pool)) == NULL) {
+        goto fail;
+    }
+    close(mem_fd);
+    ring->owner = conn;
+    ring->hdr = map;
+    ring->data = (char*)map + sizeof(shm_hdr_t);
+    ring->mask = hdr.size - 1;
+    ring->tail = hdr.tail;
+    ring->hdr->waiting = 0;
+    __atomic_store_n(&ring->hdr->closed, 0, __ATOMIC_RELEASE);
+    ring->next = pool->shm_rings;
+    pool->shm_rings = ring;
+    return hdr.size;
+
+fail:
+    free(ring);
+    if (map != MAP_FAILED) {
+        munmap(map, map_len);
+    }
+    int err = errno;
+    close(mem_fd);
+    close(event_fd);
+    errno = err;
+    return -1;
+}
+
+/**
+ * @brief Hands the bytes written to every ring to their connections
+ *
+ * At most READ_BUDGET bytes per ring and loop iteration are copied out
+ * of the ring, then handed to the same input path as a socket read. The
+ * client can write to the mapping at any time, so the bytes are never
+ * checked or changed in place: a check and a later read of the same bytes
+ * could see different values. A client whose head ran more than a ring
+ * ahead of the tail broke the protocol: its ring is detached, and the
+ * client told so when the eventfd is removed.
+ *
+ * @param pool A pointer to the connection pool structure
+ */
+void pollShm(conn_pool_t* pool) {
+    for (shm_ring_t *ring = pool->shm_rings; ring != NULL; ring = ring->next) {
+        conn_t *conn = ring->owner;
+        shm_hdr_t *hdr = ring->hdr;
+        if (conn->closing || ring->event->closing) {
+            continue;
+        }
+        // The loop is awake: writes need no wakeup until the next armShm
+        if (__atomic_load_n(&hdr->waiting, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&hdr->waiting, 0, __ATOMIC_RELAXED);
+        }
+        uint64_t avail = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) - ring->tail;
+        if (avail == 0) {
+            continue;
+        }
+        if (avail > (uint64_t)ring->mask + 1) {
+            printf("shm ring of sd %d overrun, detaching\n", conn->fd);
+            markClosing(ring->event, pool);
+            continue;
+        }
+        char buffer[READ_BUDGET];
+        int len = avail < READ_BUDGET ? (int)avail : READ_BUDGET;
+        uint32_t off = ring->tail & ring->mask;
+        int first = len < (int)(ring->mask + 1 - off) ? len : (int)(ring->mask + 1 - off);
+        memcpy(buffer, ring->data + off, first);
+        memcpy(buffer + first, ring->data, len - first);
+        // Free the space before the input is handled: the copy is ours
+        ring->tail += len;
+        __atomic_store_n(&hdr->tail, ring->tail, __ATOMIC_RELEASE);
+        if (processInput(conn, buffer, len, pool) == -1) {
+            perror("Error handling shm input");
+        }
+    }
+}
+
+/**
+ * @brief Asks the clients to signal before select blocks
+ *
+ * Setting waiting and then checking head, with a full fence between, pairs
+ * with the client advancing head and then checking waiting: either the
+ * server sees the new head, or the client sees waiting and signals.
+ *
+ * @param pool A pointer to the connection pool structure
+ * @return 1 if some ring has bytes pending and select must not block, 0 otherwise
+ */
+int armShm(conn_pool_t* pool) {
+    int pending = 0;
+    for (shm_ring_t *ring = pool->shm_rings; ring != NULL; ring = ring->next) {
+        if (ring->owner->closing || ring->event->closing) {
+            continue;
+        }
+        __atomic_store_n(&ring->hdr->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        pending |= __atomic_load_n(&ring->hdr->head, __ATOMIC_RELAXED) != ring->tail;
+    }
+    return pending;
+}
+
+/**
+ * @brief Clears the wakeups counted by a readable eventfd
+ *
+ * The ring itself is read by pollShm.
+ *
+ * @param conn The CONN_SHM connection
+ */
+void readShmEvent(conn_t* conn) {
+    uint64_t count;
+    while (read(conn->fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+}
+
+/**
+ * @brief Stops reading the ring of a connection being removed
+ *
+ * Removing either the client or its eventfd ends the ring: the other one
+ * is marked closing if it is the eventfd, the client is told otherwise.
+ *
+ * @param conn The connection, the client or the CONN_SHM connection of a ring
+ * @param pool A pointer to the connection pool structure
+ */
+void detachShm(conn_t* conn, conn_pool_t* pool) {
+    for (shm_ring_t **link = &pool->shm_rings; *link != NULL; link = &(*link)->next) {
+        shm_ring_t *ring = *link;
+        if (ring->owner != conn && ring->event != conn) {
+            continue;
+        }
+        __atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+        munmap(ring->hdr, sizeof(shm_hdr_t) + ring->mask + 1);
+        if (ring->owner == conn) {
+            markClosing(ring->event, pool);
+        } else if (!ring->owner->closing && sendNotice(ring->owner, pool, "* shm detached\n") == -1) {
+            perror("Error queueing shm notice");
+        }
+        *link = ring->next;
+        free(ring);
+        return;
+    }
+}
+
+/**
+ * @brief Counts the rings and the bytes they map
+ *
+ * @param pool A pointer to the connection pool structure
+ * @param bytes Set to the bytes mapped
+ * @return The number of rings
+ */
+size_t shmRings(conn_pool_t* pool, size_t* bytes) {
+    size_t rings = 0;
+    *bytes = 0;
+    for (shm_ring_t *ring = pool->shm_rings; ring != NULL; ring = ring->next) {
+        rings++;
+        *bytes += sizeof(shm_hdr_t) + ring->mask + 1;
+    }
+    return rings;
+}
@@ -0,0 +1,122 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory ingest for publishers on the same host.
+ *
+ * A client connected over a Unix socket creates a memfd holding a ring
+ * (shm_hdr_t followed by the data area) and an eventfd, and sends both
+ * with SCM_RIGHTS along with the line "/shm". The server checks them,
+ * maps the ring and answers "* shm attached, <size> bytes", or "* shm
+ * refused: <reason>". The memfd must be sealed against shrinking
+ * (F_SEAL_SHRINK), so the mapping cannot be cut under the server.
+ *
+ * The client is the only producer of its ring and the server the only
+ * consumer. The client copies bytes to data[head % size] and advances
+ * head; the server copies data[tail % size] up to head out of the ring,
+ * advances tail and hands the copy to the connection's input, as if read
+ * from the socket. Both count bytes from 0 and never wrap the counters.
+ * The client ends each write on a line boundary (it may not mix a line
+ * between the ring and the socket), and waits for tail to move when the
+ * ring is full.
+ *
+ * The server polls the rings every loop iteration, so while it is busy the
+ * client writes without any system call. Before select blocks, the server
+ * sets waiting and checks head again. After advancing head, the client
+ * issues a full fence and, if waiting is set, writes 1 to the eventfd to
+ * wake the server. The server sets closed when it stops reading the ring:
+ * the connection was closed, or the server handed over to a new process,
+ * which the client sends "/shm" to again.
+ */
+/* Value of shm_hdr_t.magic. */
+#define SHM_MAGIC 0x43485352u
+/* Smallest and largest data area, both powers of two. */
+#define SHM_SIZE_MIN 4096
+#define SHM_SIZE_MAX (1 << 30)
+
+/* Start of the memfd, each cache line written by one side only. */
+typedef struct shm_hdr {
+        /* SHM_MAGIC, set by the client. */
+        uint32_t magic;
+        /* Size of the data area in bytes, a power of two, set by the client. */
+        uint32_t size;
+        char pad0[56];
+        /* Bytes written by the client so far. */
+        uint64_t head;
+        char pad1[56];
+        /* Bytes consumed by the server so far. */
+        uint64_t tail;
+        /* Set by the server while it may block in select: the client then signals the eventfd. */
+        uint32_t waiting;
+        /* Set by the server when it stopped reading the ring. */
+        uint32_t closed;
+        char pad2[48];
+}shm_hdr_t;
+
+struct conn;
+struct conn_pool;
+
+typedef struct shm_ring {
+        /* Next ring in the pool's list. */
+        struct shm_ring *next;
+        /* Client connection the ring's bytes are input of. */
+        struct conn *owner;
+        /* CONN_SHM connection of the eventfd. */
+        struct conn *event;
+        /* The shared mapping: header, then data. */
+        shm_hdr_t *hdr;
+        char *data;
+        /* Bytes consumed so far, the server's copy of hdr->tail. */
+        uint64_t tail;
+        /* Size of the data area minus 1. */
+        uint32_t mask;
+}shm_ring_t;
+
+/*
+ * Map the ring of a client and watch its eventfd.
+ * @ conn - the client connection
+ * @ mem_fd - the memfd, closed in any case
+ * @ event_fd - the eventfd, owned by the ring on success, closed on failure
+ * @pool - the pool
+ * @ return value - the size of the data area, -1 on failure with errno set
+ */
+int attachShm(struct conn* conn, int mem_fd, int event_fd, struct conn_pool* pool);
+
+/*
+ * Hand the bytes written to every ring to their connections, up to READ_BUDGET per ring.
+ * @pool - the pool
+ */
+void pollShm(struct conn_pool* pool);
+
+/*
+ * Ask the clients to signal before select blocks.
+ * @pool - the pool
+ * @ return value - 1 if some ring has bytes pending and select must not block, 0 otherwise
+ */
+int armShm(struct conn_pool* pool);
+
+/*
+ * Clear the wakeups counted by a readable eventfd.
+ * @ conn - the CONN_SHM connection
+ */
+void readShmEvent(struct conn* conn);
+
+/*
+ * Stop reading the ring of a connection being removed, the client or its eventfd.
+ * @ conn - the connection
+ * @pool - the pool
+ */
+void detachShm(struct conn* conn, struct conn_pool* pool);
+
+/*
+ * Number of rings and of bytes they map.
+ * @pool - the pool
+ * @ bytes - set to the bytes mapped
+ * @ return value - the number of rings
+ */
+size_t shmRings(struct conn_pool* pool, size_t* bytes);
+
+#endif
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "harness.h"
+
+/* Servers started and not stopped yet, killed when a check fails. */
+#define MAX_SERVERS 8
+static pid_t servers[MAX_SERVERS];
+
+/**
+ * @brief Kills the servers left running when the test exits
+ */
+static void killServers(void) {
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        if (servers[i] > 0) {
+            kill(servers[i], SIGKILL);
+            waitpid(servers[i], NULL, 0);
+            servers[i] = 0;
+        }
+    }
+}
+
+/**
+ * @brief Finds a free TCP port on 127.0.0.1
+ *
+ * @return The port
+ */
+int freePort(void) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(sd >= 0 && bind(sd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+          getsockname(sd, (struct sockaddr*)&addr, &len) == 0, "%s", strerror(errno));
+    close(sd);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Tries to connect to the server once
+ *
+ * @param port The client port
+ * @return The socket, -1 if the server does not accept connections yet
+ */
+static int tryConnect(int port) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (sd >= 0 && connect(sd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        return sd;
+    }
+    if (sd >= 0) {
+        close(sd);
+    }
+    return -1;
+}
+
+/**
+ * @brief Starts the server and waits until it accepts connections
+ *
+ * The server's output goes to /dev/null. Servers still running when the
+ * test exits, after a failed check, are killed.
+ *
+ * @param argv The command line, NULL terminated
+ * @param port The client port
+ * @return The pid of the server
+ */
+pid_t startServer(char* const argv[], int port) {
+    static int registered;
+    if (!registered) {
+        atexit(killServers);
+        registered = 1;
+    }
+    int slot = 0;
+    while (slot < MAX_SERVERS && servers[slot] > 0) {
+        slot++;
+    }
+    CHECK(slot < MAX_SERVERS, "more than %d servers", MAX_SERVERS);
+    pid_t pid = fork();
+    CHECK(pid >= 0, "%s", strerror(errno));
+    if (pid == 0) {
+        if (freopen("/dev/null", "w", stdout) == NULL) {
+            _exit(127);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    servers[slot] = pid;
+    for (int i = 0; i < 200; i++) {
+        int sd = tryConnect(port);
+        if (sd >= 0) {
+            close(sd);
+            return pid;
+        }
+        int status;
+        if (waitpid(pid, &status, WNOHANG) != 0) {
+            servers[slot] = 0;
+            CHECK(0, "server exited with status %d", status);
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    CHECK(0, "server not accepting on port %d", port);
+    return -1;
+}
+
+/**
+ * @brief Drops a server that exited from the servers killed at exit
+ *
+ * @param pid The pid of the server
+ */
+static void forgetServer(pid_t pid) {
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        if (servers[i] == pid) {
+            servers[i] = 0;
+        }
+    }
+}
+
+/**
+ * @brief Waits for a server to exit on its own
+ *
+ * @param pid The pid of the server
+ * @return Its exit status as returned by waitpid
+ */
+int waitServer(pid_t pid) {
+    int status = 0;
+    for (int i = 0; i < 500; i++) {
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            forgetServer(pid);
+            return status;
+        }
+        usleep(10000);
+    }
+    CHECK(0, "server %d still running", (int)pid);
+    return -1;
+}
+
+/**
+ * @brief Stops the server with SIGINT and waits for it
+ *
+ * @param pid The pid of the server
+ * @return Its exit status as returned by waitpid
+ */
+int stopServer(pid_t pid) {
+    kill(pid, SIGINT);
+    for (int i = 0; i < 500; i++) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            forgetServer(pid);
+            return status;
+        }
+        usleep(10000);
+    }
+    return waitServer(pid);
+}
+
+/**
+ * @brief Connects to the server
+ *
+ * @param port The client port
+ * @return The socket
+ */
+int connectTo(int port) {
+    int sd = tryConnect(port);
+    CHECK(sd >= 0, "connecting to port %d: %s", port, strerror(errno));
+    return sd;
+}
+
+/**
+ * @brief Sends a whole buffer
+ *
+ * @param sd The socket
+ * @param data The bytes
+ * @param len The number of bytes
+ */
+void sendAll(int sd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sd, data, len, MSG_NOSIGNAL);
+        CHECK(n > 0, "%s", strerror(errno));
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief Reads until nothing arrived for quiet_ms, or the buffer is full
+ *
+ * @param sd The socket
+ * @param buf The buffer, NUL terminated on return
+ * @param cap Its size
+ * @param quiet_ms Time without input that ends the read
+ * @return The number of bytes read
+ */
+size_t readQuiet(int sd, char* buf, size_t cap, int quiet_ms) {
+    size_t len = 0;
+    struct pollfd pfd = { sd, POLLIN, 0 };
+    while (len < cap - 1 && poll(&pfd, 1, quiet_ms) == 1) {
+        ssize_t n = recv(sd, buf + len, cap - 1 - len, 0);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    buf[len] = '\0';
+    return len;
+}
@@ -0,0 +1,75 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Helpers of the end-to-end tests: each test runs the server binary given
+ * as its first argument and talks to it over TCP on 127.0.0.1.
+ */
+
+/* Exit the test with a message if cond does not hold. */
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/*
+ * Find a free TCP port on 127.0.0.1.
+ * @ return value - the port
+ */
+int freePort(void);
+
+/*
+ * Start the server and wait until it accepts connections.
+ * @ argv - the command line, the server binary first, NULL terminated; the port is the last argument
+ * @ port - the client port
+ * @ return value - the pid of the server
+ */
+pid_t startServer(char* const argv[], int port);
+
+/*
+ * Stop the server with SIGINT and wait for it.
+ * @ pid - the pid of the server
+ * @ return value - its exit status as returned by waitpid
+ */
+int stopServer(pid_t pid);
+
+/*
+ * Wait for a server to exit on its own, as an old server does after an upgrade.
+ * @ pid - the pid of the server
+ * @ return value - its exit status as returned by waitpid
+ */
+int waitServer(pid_t pid);
+
+/*
+ * Connect to the server.
+ * @ port - the client port
+ * @ return value - the socket
+ */
+int connectTo(int port);
+
+/*
+ * Send a whole buffer.
+ * @ sd - the socket
+ * @ data - the bytes
+ * @ len - the number of bytes
+ */
+void sendAll(int sd, const char* data, size_t len);
+
+/*
+ * Read until nothing arrived for quiet_ms, or the buffer is full.
+ * @ sd - the socket
+ * @ buf - the buffer, NUL terminated on return
+ * @ cap - its size
+ * @ quiet_ms - time without input that ends the read
+ * @ return value - the number of bytes read
+ */
+size_t readQuiet(int sd, char* buf, size_t cap, int quiet_ms);
+
+#endif
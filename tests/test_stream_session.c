@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "harness.h"
+
+/*
+ * A line longer than BUFFER_SIZE is streamed in chunks, each one its own
+ * broadcast. A line client with a session must see it as one line with
+ * one sequence tag, and acknowledging that tag must cover the whole line.
+ */
+
+/* Several chunks of BUFFER_SIZE (4096) bytes and a partial one. */
+#define LINE_LEN (3 * 4096 + 100)
+
+int main(int argc, char *argv[]) {
+    CHECK(argc == 2, "usage: %s <server>", argv[0]);
+    int port = freePort();
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    char *server[] = { argv[1], "-T", "none", port_arg, NULL };
+    pid_t pid = startServer(server, port);
+
+    static char buf[4 * LINE_LEN];
+    int reader = connectTo(port);
+    sendAll(reader, "/session\n", 9);
+    readQuiet(reader, buf, sizeof(buf), 200);
+    unsigned long long token, first;
+    CHECK(sscanf(buf, "* session %llx %llu", &token, &first) == 2, "got \"%s\"", buf);
+
+    // Sent in pieces, so the server streams it instead of reading it whole
+    static char line[LINE_LEN + 1];
+    for (int i = 0; i < LINE_LEN; i++) {
+        line[i] = 'a' + i % 26;
+    }
+    line[LINE_LEN] = '\n';
+    int sender = connectTo(port);
+    for (int off = 0; off <= LINE_LEN; off += 3000) {
+        sendAll(sender, line + off, off + 3000 <= LINE_LEN + 1 ? 3000 : LINE_LEN + 1 - off);
+        usleep(20000);
+    }
+    sendAll(sender, "short\n", 6);
+
+    size_t len = readQuiet(reader, buf, sizeof(buf), 300);
+    char tag[32];
+    int tag_len = snprintf(tag, sizeof(tag), "%llu ", first);
+    CHECK(len > (size_t)tag_len + LINE_LEN && memcmp(buf, tag, tag_len) == 0, "no tag \"%s\" first", tag);
+    CHECK(memcmp(buf + tag_len, line, LINE_LEN + 1) == 0, "streamed line broken by \"%.20s\"",
+          buf + tag_len + strspn(buf + tag_len, "abcdefghijklmnopqrstuvwxyz"));
+    unsigned long long next;
+    char rest[16];
+    CHECK(sscanf(buf + tag_len + LINE_LEN + 1, "%llu %15s", &next, rest) == 2 && next > first &&
+          strcmp(rest, "short") == 0, "got \"%s\" after the line", buf + tag_len + LINE_LEN + 1);
+
+    // The line's tag acknowledges all of its chunks: only "short" is resent
+    char cmd[64];
+    int cmd_len = snprintf(cmd, sizeof(cmd), "/ack %llu\n", first);
+    sendAll(reader, cmd, cmd_len);
+    usleep(100000);
+    close(reader);
+    usleep(100000);
+    int resumed = connectTo(port);
+    cmd_len = snprintf(cmd, sizeof(cmd), "/resume %016llx\n", token);
+    sendAll(resumed, cmd, cmd_len);
+    readQuiet(resumed, buf, sizeof(buf), 300);
+    char expected[128];
+    snprintf(expected, sizeof(expected), "* resumed %016llx %llu\n%llu short\n", token, next, next);
+    CHECK(strcmp(buf, expected) == 0, "got \"%s\", expected \"%s\"", buf, expected);
+
+    close(resumed);
+    close(sender);
+    stopServer(pid);
+    return 0;
+}
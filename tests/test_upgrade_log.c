@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "harness.h"
+
+/*
+ * A server running with both -u and -l hands over to a new one. The ring
+ * taken over must be kept as handed over, not rebuilt from the log: a
+ * broadcast still held back by coalescing keeps its origin, so its sender
+ * does not get it back. The new server appends to the log after it, so a
+ * restart recovers every line once and in order.
+ */
+
+/**
+ * @brief Counts the occurrences of a string
+ *
+ * @param s The string searched
+ * @param what The string counted
+ * @return The number of occurrences
+ */
+static int count(const char* s, const char* what) {
+    int n = 0;
+    while ((s = strstr(s, what)) != NULL) {
+        n++;
+        s += strlen(what);
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    CHECK(argc == 2, "usage: %s <server>", argv[0]);
+    char dir[] = "/tmp/test_upgrade_logXXXXXX";
+    CHECK(mkdtemp(dir) != NULL, "cannot create a directory");
+    char log_dir[64], upgrade_path[64];
+    snprintf(log_dir, sizeof(log_dir), "%s/log", dir);
+    snprintf(upgrade_path, sizeof(upgrade_path), "%s/up.sock", dir);
+    int port = freePort();
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    // Broadcasts wait up to 2 s to be published, so one is pending at the handover
+    char *server[] = { argv[1], "-T", "none", "-l", log_dir, "-u", upgrade_path,
+                       "-b", "1000000", "-d", "2000000", port_arg, NULL };
+    static char buf[8192];
+
+    pid_t old = startServer(server, port);
+    int sender = connectTo(port);
+    int reader = connectTo(port);
+    sendAll(sender, "before\n", 7);
+    usleep(100000);
+    pid_t pid = startServer(server, port);
+    waitServer(old);
+    readQuiet(sender, buf, sizeof(buf), 300);
+    CHECK(count(buf, "before") == 0, "sender got its own line back: \"%s\"", buf);
+    readQuiet(reader, buf, sizeof(buf), 2500);
+    CHECK(count(buf, "before\n") == 1, "reader got \"%s\"", buf);
+
+    sendAll(sender, "after\n", 6);
+    readQuiet(reader, buf, sizeof(buf), 2500);
+    CHECK(count(buf, "after\n") == 1, "reader got \"%s\"", buf);
+    stopServer(pid);
+    close(sender);
+    close(reader);
+
+    char *restart[] = { argv[1], "-T", "none", "-l", log_dir, port_arg, NULL };
+    pid = startServer(restart, port);
+    int late = connectTo(port);
+    sendAll(late, "/history 10\n", 12);
+    readQuiet(late, buf, sizeof(buf), 300);
+    CHECK(strstr(buf, "before\nafter\n") != NULL && count(buf, "before") == 1 && count(buf, "after") == 1,
+          "history after restart: \"%s\"", buf);
+    close(late);
+    stopServer(pid);
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return system(cmd) == 0 ? 0 : 1;
+}
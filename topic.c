@@ -0,0 +1,502 @@
+#include "chatServer.h"
+
+/**
+ * @brief Computes the FNV-1a hash of some bytes, continuing from a hash
+ *
+ * @param hash The hash so far, 2166136261 to start
+ * @param s The bytes
+ * @param len Their number
+ * @return The hash
+ */
+static uint32_t fnv(uint32_t hash, const void* s, size_t len) {
+    const unsigned char *p = s;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Computes the hash of a child node: its parent and its segment
+ */
+static uint32_t hashChild(const topic_node_t* parent, const char* seg, int len) {
+    return fnv(fnv(2166136261u, &parent, sizeof(parent)), seg, len);
+}
+
+/**
+ * @brief Splits a topic or pattern into its segments
+ *
+ * @param s The topic or pattern
+ * @param len Its length
+ * @param segs Set to the start of each segment
+ * @param lens Set to the length of each segment
+ * @return The number of segments, -1 if there are more than TOPIC_DEPTH_MAX
+ */
+static int splitTopic(const char* s, int len, const char** segs, int* lens) {
+    int depth = 0;
+    const char *end = s + len;
+    while (1) {
+        const char *dot = memchr(s, '.', end - s);
+        if (depth == TOPIC_DEPTH_MAX) {
+            return -1;
+        }
+        segs[depth] = s;
+        lens[depth++] = (dot != NULL ? dot : end) - s;
+        if (dot == NULL) {
+            return depth;
+        }
+        s = dot + 1;
+    }
+}
+
+/**
+ * @brief Checks a topic or pattern
+ *
+ * @param s The topic or pattern
+ * @param len Its length
+ * @param wildcards Set to allow "*" segments and a last "#" segment
+ * @return 1 if valid, 0 if not
+ */
+int validTopic(const char* s, int len, int wildcards) {
+    const char *segs[TOPIC_DEPTH_MAX];
+    int lens[TOPIC_DEPTH_MAX];
+    if (len <= 0 || len > TOPIC_MAX) {
+        return 0;
+    }
+    int depth = splitTopic(s, len, segs, lens);
+    if (depth == -1) {
+        return 0;
+    }
+    for (int i = 0; i < depth; i++) {
+        if (lens[i] == 0) {
+            return 0;
+        }
+        for (int j = 0; j < lens[i]; j++) {
+            char c = segs[i][j];
+            if ((unsigned char)c <= ' ' || c == 0x7f) {
+                return 0;
+            }
+            if ((c == '*' || c == '#') && (!wildcards || lens[i] != 1 || (c == '#' && i != depth - 1))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Checks whether a pattern matches a topic
+ *
+ * @return 1 if it does, 0 if not
+ */
+static int topicMatches(const char* pattern, int plen, const char* topic, int tlen) {
+    const char *psegs[TOPIC_DEPTH_MAX], *tsegs[TOPIC_DEPTH_MAX];
+    int plens[TOPIC_DEPTH_MAX], tlens[TOPIC_DEPTH_MAX];
+    int pdepth = splitTopic(pattern, plen, psegs, plens);
+    int tdepth = splitTopic(topic, tlen, tsegs, tlens);
+    for (int i = 0; i < pdepth; i++) {
+        if (plens[i] == 1 && psegs[i][0] == '#') {
+            return 1;
+        }
+        if (i == tdepth) {
+            return 0;
+        }
+        if (!(plens[i] == 1 && psegs[i][0] == '*') &&
+            (plens[i] != tlens[i] || memcmp(psegs[i], tsegs[i], plens[i]) != 0)) {
+            return 0;
+        }
+    }
+    return pdepth == tdepth;
+}
+
+/**
+ * @brief Adds a connection to a set
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int setAdd(conn_set_t* set, conn_t* conn) {
+    if (set->count == set->capacity) {
+        uint32_t capacity = set->capacity == 0 ? 4 : set->capacity * 2;
+        conn_t **conns = realloc(set->conns, capacity * sizeof(conn_t*));
+        if (conns == NULL) {
+            return -1;
+        }
+        set->conns = conns;
+        set->capacity = capacity;
+    }
+    set->conns[set->count++] = conn;
+    return 0;
+}
+
+/**
+ * @brief Removes a connection from a set, if it is in it
+ */
+static void setRemove(conn_set_t* set, conn_t* conn) {
+    for (uint32_t i = 0; i < set->count; i++) {
+        if (set->conns[i] == conn) {
+            set->conns[i] = set->conns[--set->count];
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Init the trie
+ *
+ * @param topics The trie
+ * @return 0 on success, -1 on failure
+ */
+int initTopics(topics_t* topics) {
+    memset(topics, 0, sizeof(topics_t));
+    topics->buckets = calloc(TOPIC_TABLE_MIN, sizeof(topic_node_t*));
+    if (topics->buckets == NULL) {
+        return -1;
+    }
+    topics->nr_buckets = TOPIC_TABLE_MIN;
+    return 0;
+}
+
+/**
+ * @brief Finds a child of a node
+ *
+ * @return The child, NULL if there is none
+ */
+static topic_node_t* findChild(const topics_t* topics, const topic_node_t* parent, const char* seg, int len) {
+    if (len == 1 && seg[0] == '*') {
+        return parent->star;
+    }
+    if (len == 1 && seg[0] == '#') {
+        return parent->rest;
+    }
+    uint32_t hash = hashChild(parent, seg, len);
+    for (topic_node_t *node = topics->buckets[hash & (topics->nr_buckets - 1)]; node != NULL; node = node->bucket_next) {
+        if (node->hash == hash && node->parent == parent && node->len == len && memcmp(node->seg, seg, len) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Doubles the child table once it holds as many nodes as buckets
+ */
+static void growTopics(topics_t* topics) {
+    uint32_t nr_buckets = topics->nr_buckets * 2;
+    topic_node_t **buckets = calloc(nr_buckets, sizeof(topic_node_t*));
+    if (buckets == NULL) {
+        return; // Longer chains, still correct
+    }
+    for (uint32_t i = 0; i < topics->nr_buckets; i++) {
+        topic_node_t *node = topics->buckets[i];
+        while (node != NULL) {
+            topic_node_t *next = node->bucket_next;
+            node->bucket_next = buckets[node->hash & (nr_buckets - 1)];
+            buckets[node->hash & (nr_buckets - 1)] = node;
+            node = next;
+        }
+    }
+    free(topics->buckets);
+    topics->buckets = buckets;
+    topics->nr_buckets = nr_buckets;
+}
+
+/**
+ * @brief Adds a child to a node
+ *
+ * @return The child, NULL on failure
+ */
+static topic_node_t* addChild(topics_t* topics, topic_node_t* parent, const char* seg, int len) {
+    topic_node_t *node = calloc(1, sizeof(topic_node_t) + len);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->parent = parent;
+    node->hash = hashChild(parent, seg, len);
+    node->len = len;
+    memcpy(node->seg, seg, len);
+    if (topics->nr_nodes >= topics->nr_buckets) {
+        growTopics(topics);
+    }
+    topic_node_t **bucket = &topics->buckets[node->hash & (topics->nr_buckets - 1)];
+    node->bucket_next = *bucket;
+    *bucket = node;
+    topics->nr_nodes++;
+    if (len == 1 && seg[0] == '*') {
+        parent->star = node;
+    } else if (len == 1 && seg[0] == '#') {
+        parent->rest = node;
+    }
+    parent->nr_children++;
+    return node;
+}
+
+/**
+ * @brief Frees the nodes left without subscribers nor children, from a node up
+ */
+static void pruneNodes(topics_t* topics, topic_node_t* node) {
+    while (node != &topics->root && node->subs.count == 0 && node->nr_children == 0) {
+        topic_node_t *parent = node->parent;
+        topic_node_t **link = &topics->buckets[node->hash & (topics->nr_buckets - 1)];
+        while (*link != node) {
+            link = &(*link)->bucket_next;
+        }
+        *link = node->bucket_next;
+        topics->nr_nodes--;
+        if (parent->star == node) {
+            parent->star = NULL;
+        } else if (parent->rest == node) {
+            parent->rest = NULL;
+        }
+        parent->nr_children--;
+        free(node->subs.conns);
+        free(node);
+        node = parent;
+    }
+}
+
+/**
+ * @brief Checks whether another subscription of a connection matches a topic
+ *
+ * @param conn The connection
+ * @param skip The subscription to leave out, NULL for none
+ * @param topic The topic
+ * @param len Its length
+ * @return 1 if one does, 0 if not
+ */
+static int otherMatch(const conn_t* conn, const topic_sub_t* skip, const char* topic, int len) {
+    for (const topic_sub_t *sub = conn->topics; sub != NULL; sub = sub->next) {
+        if (sub != skip && topicMatches(sub->pattern, sub->len, topic, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Subscribes a connection to a pattern
+ *
+ * The connection joins the cached sets of the topics the pattern matches.
+ *
+ * @param topics The trie
+ * @param conn The connection
+ * @param pattern A valid pattern
+ * @param len Its length
+ * @return 0 on success, 1 if already subscribed, -1 on failure
+ */
+int subscribeTopic(topics_t* topics, conn_t* conn, const char* pattern, int len) {
+    for (topic_sub_t *sub = conn->topics; sub != NULL; sub = sub->next) {
+        if (sub->len == len && memcmp(sub->pattern, pattern, len) == 0) {
+            return 1;
+        }
+    }
+    const char *segs[TOPIC_DEPTH_MAX];
+    int lens[TOPIC_DEPTH_MAX];
+    int depth = splitTopic(pattern, len, segs, lens);
+    topic_node_t *node = &topics->root;
+    for (int i = 0; i < depth; i++) {
+        topic_node_t *child = findChild(topics, node, segs[i], lens[i]);
+        if (child == NULL && (child = addChild(topics, node, segs[i], lens[i])) == NULL) {
+            pruneNodes(topics, node);
+            return -1;
+        }
+        node = child;
+    }
+    topic_sub_t *sub = malloc(sizeof(topic_sub_t) + len);
+    if (sub == NULL || setAdd(&node->subs, conn) == -1) {
+        free(sub);
+        pruneNodes(topics, node);
+        return -1;
+    }
+    sub->node = node;
+    sub->len = len;
+    memcpy(sub->pattern, pattern, len);
+    sub->next = conn->topics;
+    conn->topics = sub;
+    for (int i = 0; i < TOPIC_CACHE_SIZE; i++) {
+        topic_cache_t *entry = &topics->cache[i];
+        if (entry->topic != NULL && topicMatches(pattern, len, entry->topic, entry->len) &&
+            !otherMatch(conn, sub, entry->topic, entry->len) && setAdd(&entry->conns, conn) == -1) {
+            entry->len = 0; // Cannot be updated, resolved again
+            entry->hash = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Drops one subscription of a connection
+ *
+ * The connection leaves the cached sets of the topics it no longer matches.
+ *
+ * @param topics The trie
+ * @param conn The connection
+ * @param sub The subscription, unlinked from the connection
+ */
+static void dropSub(topics_t* topics, conn_t* conn, topic_sub_t* sub) {
+    for (int i = 0; i < TOPIC_CACHE_SIZE; i++) {
+        topic_cache_t *entry = &topics->cache[i];
+        if (entry->topic != NULL && topicMatches(sub->pattern, sub->len, entry->topic, entry->len) &&
+            !otherMatch(conn, NULL, entry->topic, entry->len)) {
+            setRemove(&entry->conns, conn);
+        }
+    }
+    setRemove(&sub->node->subs, conn);
+    pruneNodes(topics, sub->node);
+    free(sub);
+}
+
+/**
+ * @brief Unsubscribes a connection from a pattern
+ *
+ * @return 0 on success, 1 if not subscribed
+ */
+int unsubscribeTopic(topics_t* topics, conn_t* conn, const char* pattern, int len) {
+    for (topic_sub_t **link = &conn->topics; *link != NULL; link = &(*link)->next) {
+        topic_sub_t *sub = *link;
+        if (sub->len == len && memcmp(sub->pattern, pattern, len) == 0) {
+            *link = sub->next;
+            dropSub(topics, conn, sub);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Removes every subscription of a connection
+ */
+void unsubscribeAll(topics_t* topics, conn_t* conn) {
+    while (conn->topics != NULL) {
+        topic_sub_t *sub = conn->topics;
+        conn->topics = sub->next;
+        dropSub(topics, conn, sub);
+    }
+}
+
+/**
+ * @brief Adds the connections of a set not added yet to the set being resolved
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int collectSet(topics_t* topics, const conn_set_t* from, conn_set_t* set) {
+    for (uint32_t i = 0; i < from->count; i++) {
+        conn_t *conn = from->conns[i];
+        if (conn->topic_round != topics->round) {
+            conn->topic_round = topics->round;
+            if (setAdd(set, conn) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Collects the subscribers of the topic segments from i on, below a node
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int collectNode(topics_t* topics, const topic_node_t* node, const char** segs, const int* lens, int i, int depth,
+                       conn_set_t* set) {
+    // "#" matches the rest, none of it included
+    if (node->rest != NULL && collectSet(topics, &node->rest->subs, set) == -1) {
+        return -1;
+    }
+    if (i == depth) {
+        return collectSet(topics, &node->subs, set);
+    }
+    const topic_node_t *child = findChild(topics, node, segs[i], lens[i]);
+    if (child != NULL && collectNode(topics, child, segs, lens, i + 1, depth, set) == -1) {
+        return -1;
+    }
+    if (node->star != NULL && collectNode(topics, node->star, segs, lens, i + 1, depth, set) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Resolves a topic to its subscribers
+ *
+ * A topic in the cache is answered from it. Otherwise the trie is walked
+ * and the set replaces the cache entry of the topic's hash.
+ *
+ * @param topics The trie
+ * @param topic A valid topic without wildcards
+ * @param len Its length
+ * @return The subscriber set, valid until the next change of the subscriptions; NULL on failure
+ */
+const conn_set_t* resolveTopic(topics_t* topics, const char* topic, int len) {
+    uint32_t hash = fnv(2166136261u, topic, len);
+    topic_cache_t *entry = &topics->cache[hash & (TOPIC_CACHE_SIZE - 1)];
+    topics->lookups++;
+    if (entry->topic != NULL && entry->hash == hash && entry->len == len && memcmp(entry->topic, topic, len) == 0) {
+        topics->hits++;
+        return &entry->conns;
+    }
+    if (entry->topic == NULL && (entry->topic = malloc(TOPIC_MAX)) == NULL) {
+        return NULL;
+    }
+    memcpy(entry->topic, topic, len);
+    entry->len = len;
+    entry->hash = hash;
+    entry->conns.count = 0;
+    // Zero is the stamp of connections never resolved
+    if (++topics->round == 0) {
+        topics->round = 1;
+    }
+    const char *segs[TOPIC_DEPTH_MAX];
+    int lens[TOPIC_DEPTH_MAX];
+    int depth = splitTopic(topic, len, segs, lens);
+    if (collectNode(topics, &topics->root, segs, lens, 0, depth, &entry->conns) == -1) {
+        entry->len = 0;
+        entry->hash = 0;
+        return NULL;
+    }
+    return &entry->conns;
+}
+
+/**
+ * @brief Returns the bytes held by the trie and the cache
+ *
+ * Subscriptions are held by their connections and not counted here.
+ */
+size_t topicsBytes(const topics_t* topics) {
+    size_t bytes = topics->nr_buckets * sizeof(topic_node_t*);
+    for (uint32_t i = 0; i < topics->nr_buckets; i++) {
+        for (const topic_node_t *node = topics->buckets[i]; node != NULL; node = node->bucket_next) {
+            bytes += sizeof(topic_node_t) + node->len + node->subs.capacity * sizeof(conn_t*);
+        }
+    }
+    for (int i = 0; i < TOPIC_CACHE_SIZE; i++) {
+        if (topics->cache[i].topic != NULL) {
+            bytes += TOPIC_MAX + topics->cache[i].conns.capacity * sizeof(conn_t*);
+        }
+    }
+    return bytes;
+}
+
+/**
+ * @brief Frees the trie and the cache
+ *
+ * The connections must have been unsubscribed.
+ */
+void freeTopics(topics_t* topics) {
+    for (uint32_t i = 0; i < topics->nr_buckets; i++) {
+        topic_node_t *node = topics->buckets[i];
+        while (node != NULL) {
+            topic_node_t *next = node->bucket_next;
+            free(node->subs.conns);
+            free(node);
+            node = next;
+        }
+    }
+    free(topics->buckets);
+    free(topics->root.subs.conns);
+    for (int i = 0; i < TOPIC_CACHE_SIZE; i++) {
+        free(topics->cache[i].topic);
+        free(topics->cache[i].conns.conns);
+    }
+    memset(topics, 0, sizeof(topics_t));
+}
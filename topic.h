@@ -0,0 +1,153 @@
+#ifndef TOPIC_H
+#define TOPIC_H
+
+#include <stdint.h>
+
+/*
+ * Topic publish/subscribe.
+ *
+ * Topics are dot separated segments ("ops.alerts.cpu"). A client subscribes
+ * with "/sub <pattern>", where a "*" segment matches exactly one segment and
+ * a "#" last segment matches any number of segments, none included
+ * ("ops.alerts.*", "team.#"), and leaves with "/unsub <pattern>". "/pub
+ * <topic> <text>" sends the text to every subscriber of the topic other
+ * than the sender, prefixed with "{topic} ". Topic messages are private to
+ * their subscribers, like direct messages: they are queued to each one and
+ * do not enter the ring.
+ *
+ * Patterns are kept in a trie with one node per segment. The children of a
+ * node are found through one hash table keyed by parent and segment, the
+ * "*" and "#" children through pointers of the parent, so resolving a topic
+ * visits a node per segment and per wildcard branch, whatever the number of
+ * subscriptions. The subscriber sets of recently published topics are
+ * cached; subscribing, unsubscribing and closing a connection update the
+ * cached sets the pattern matches instead of flushing the cache.
+ */
+/* Longest topic or pattern. */
+#define TOPIC_MAX 255
+/* Most segments of a topic or pattern. */
+#define TOPIC_DEPTH_MAX 32
+/* Number of cached topics, a power of two. */
+#define TOPIC_CACHE_SIZE 64
+/* Initial number of buckets of the child table, a power of two. */
+#define TOPIC_TABLE_MIN 64
+
+struct conn;
+
+/* Set of connections. */
+typedef struct conn_set {
+        struct conn **conns;
+        uint32_t count;
+        uint32_t capacity;
+}conn_set_t;
+
+typedef struct topic_node {
+        /* Parent node, NULL for the root. */
+        struct topic_node *parent;
+        /* Next node in the same bucket of the child table. */
+        struct topic_node *bucket_next;
+        /* The "*" and "#" children, NULL if none. */
+        struct topic_node *star;
+        struct topic_node *rest;
+        /* Connections whose pattern ends at this node. */
+        conn_set_t subs;
+        /* Number of children, wildcard children included. */
+        uint32_t nr_children;
+        /* Hash of parent and segment. */
+        uint32_t hash;
+        /* The segment. */
+        uint16_t len;
+        char seg[];
+}topic_node_t;
+
+/* One subscription of a connection. */
+typedef struct topic_sub {
+        /* Next subscription of the same connection. */
+        struct topic_sub *next;
+        /* Node the pattern ends at. */
+        topic_node_t *node;
+        uint16_t len;
+        char pattern[];
+}topic_sub_t;
+
+/* Cached subscriber set of a published topic. */
+typedef struct topic_cache {
+        /* The topic, NULL for an empty entry. */
+        char *topic;
+        uint16_t len;
+        uint32_t hash;
+        conn_set_t conns;
+}topic_cache_t;
+
+typedef struct topics {
+        topic_node_t root;
+        /* Child table: buckets of nodes chained through bucket_next. */
+        topic_node_t **buckets;
+        /* Number of buckets, a power of two. */
+        uint32_t nr_buckets;
+        /* Number of nodes in the table. */
+        uint32_t nr_nodes;
+        /* Stamp marking the connections already in a set being resolved. */
+        unsigned int round;
+        /* Direct mapped cache of subscriber sets, indexed by topic hash. */
+        topic_cache_t cache[TOPIC_CACHE_SIZE];
+        /* Cache lookups and hits, for reporting. */
+        unsigned long long lookups;
+        unsigned long long hits;
+}topics_t;
+
+/*
+ * Init the trie.
+ * @ topics - allocated trie
+ * @ return value - 0 on success, -1 on failure
+ */
+int initTopics(topics_t* topics);
+
+/*
+ * Check a topic or pattern.
+ * @ s - the topic or pattern, not necessarily NUL terminated
+ * @ len - its length
+ * @ wildcards - set to allow "*" and "#" segments
+ * @ return value - 1 if valid, 0 if not
+ */
+int validTopic(const char* s, int len, int wildcards);
+
+/*
+ * Subscribe a connection to a pattern.
+ * @ conn - the connection
+ * @ pattern - a valid pattern
+ * @ len - its length
+ * @ return value - 0 on success, 1 if already subscribed, -1 on failure
+ */
+int subscribeTopic(topics_t* topics, struct conn* conn, const char* pattern, int len);
+
+/*
+ * Unsubscribe a connection from a pattern.
+ * @ return value - 0 on success, 1 if not subscribed
+ */
+int unsubscribeTopic(topics_t* topics, struct conn* conn, const char* pattern, int len);
+
+/*
+ * Remove every subscription of a connection being removed.
+ */
+void unsubscribeAll(topics_t* topics, struct conn* conn);
+
+/*
+ * Resolve a topic to its subscribers.
+ * @ topic - a valid topic without wildcards
+ * @ len - its length
+ * @ return value - the subscriber set, valid until the next change of the subscriptions; NULL on failure
+ */
+const conn_set_t* resolveTopic(topics_t* topics, const char* topic, int len);
+
+/*
+ * Number of bytes held by the trie, the subscriptions and the cache.
+ */
+size_t topicsBytes(const topics_t* topics);
+
+/*
+ * Free the trie, the subscriptions and the cache.
+ */
+void freeTopics(topics_t* topics);
+
+#endif
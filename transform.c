@@ -0,0 +1,139 @@
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transform.h"
+
+/**
+ * @brief Builds a chain from its comma separated spec
+ *
+ * Transforms are folded into the byte map in the order given, so
+ * "sanitize,upper" and "upper,sanitize" give the same map.
+ *
+ * @param spec The spec, e.g. "upper,trim=200,tag"
+ * @param t The chain to fill
+ * @return 0 on success, -1 if the spec is invalid
+ */
+int parseTransforms(const char* spec, transforms_t* t) {
+    for (int c = 0; c < 256; c++) {
+        t->map[c] = c;
+        t->keep[c] = 1;
+    }
+    t->max_len = 0;
+    t->tag = 0;
+    while (*spec != '\0') {
+        size_t len = strcspn(spec, ",");
+        char *end;
+        if (len == 5 && memcmp(spec, "upper", 5) == 0) {
+            for (int c = 0; c < 256; c++) {
+                t->map[c] = toupper(t->map[c]);
+            }
+        } else if (len == 5 && memcmp(spec, "lower", 5) == 0) {
+            for (int c = 0; c < 256; c++) {
+                t->map[c] = tolower(t->map[c]);
+            }
+        } else if (len == 8 && memcmp(spec, "sanitize", 8) == 0) {
+            for (int c = 0; c < 256; c++) {
+                if ((t->map[c] < 0x20 || t->map[c] == 0x7f) && t->map[c] != '\t' && t->map[c] != '\n') {
+                    t->keep[c] = 0;
+                }
+            }
+        } else if (len == 3 && memcmp(spec, "tag", 3) == 0) {
+            t->tag = 1;
+        } else if (len == 4 && memcmp(spec, "none", 4) == 0) {
+            // Nothing to add
+        } else if (len > 5 && memcmp(spec, "trim=", 5) == 0) {
+            long max_len = strtol(spec + 5, &end, 10);
+            if (end != spec + len || max_len <= 0 || max_len > INT_MAX) {
+                return -1;
+            }
+            t->max_len = max_len;
+        } else {
+            return -1;
+        }
+        spec += len;
+        if (*spec == ',') {
+            spec++;
+        }
+    }
+    t->identity = 1;
+    t->drops = 0;
+    for (int c = 0; c < 256; c++) {
+        if (t->map[c] != c || !t->keep[c]) {
+            t->identity = 0;
+        }
+        if (!t->keep[c]) {
+            t->drops = 1;
+        }
+    }
+    int lo = 0, hi = 255;
+    while (lo < 256 && t->map[lo] == lo) {
+        lo++;
+    }
+    while (hi > lo && t->map[hi] == hi) {
+        hi--;
+    }
+    t->shift = lo < 256;
+    for (int c = lo; c <= hi && t->shift; c++) {
+        t->shift = t->map[c] == (unsigned char)(c + t->map[lo] - lo);
+    }
+    if (t->shift) {
+        t->shift_lo = lo;
+        t->shift_span = hi - lo;
+        t->shift_delta = t->map[lo] - lo;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies a message through the chain, in a single pass
+ *
+ * A trimmed message keeps its newline.
+ *
+ * @param t The chain
+ * @param tag The sender prefix, written first, NULL for none
+ * @param tag_len The length of tag
+ * @param in The message, including its newline if any
+ * @param len The length of the message
+ * @param out The output, at least tag_len + len bytes
+ * @return The number of bytes written to out
+ */
+int runTransforms(const transforms_t* t, const char* tag, int tag_len, const char* in, int len, char* out) {
+    char *o = out;
+    if (tag != NULL) {
+        memcpy(o, tag, tag_len);
+        o += tag_len;
+    }
+    int newline = len > 0 && in[len - 1] == '\n';
+    int body = len - newline;
+    int n = t->max_len > 0 && t->max_len < body ? t->max_len : body;
+    if (t->identity) {
+        memcpy(o, in, n);
+        o += n;
+    } else if (!t->drops && t->shift) {
+        unsigned char lo = t->shift_lo, span = t->shift_span, delta = t->shift_delta;
+        for (int i = 0; i < n; i++) {
+            unsigned char c = in[i];
+            o[i] = c + ((unsigned char)(c - lo) <= span ? delta : 0);
+        }
+        o += n;
+    } else if (!t->drops) {
+        for (int i = 0; i < n; i++) {
+            o[i] = t->map[(unsigned char)in[i]];
+        }
+        o += n;
+    } else {
+        // Branch free: a dropped byte is written and overwritten by the next one
+        const unsigned char *i = (const unsigned char*)in;
+        const unsigned char *end = i + body;
+        char *limit = o + n;
+        for (; i < end && o < limit; i++) {
+            *o = t->map[*i];
+            o += t->keep[*i];
+        }
+    }
+    if (newline) {
+        *o++ = '\n';
+    }
+    return o - out;
+}
@@ -0,0 +1,67 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+/*
+ * Transforms applied to text broadcasts.
+ *
+ * The chain is given as a comma separated list ("-T upper,tag", or the
+ * transforms key of the config file):
+ *   upper, lower  map letters to upper or lower case
+ *   sanitize      drop control characters other than tab and newline
+ *   trim=<n>      keep at most n bytes of each message, newline excluded
+ *   tag           prefix each broadcast with its sender ("[nick] " or "[#id] ")
+ *   none          no transform
+ * Case mapping and sanitizing are folded into one byte map, so the whole
+ * chain runs in a single pass over the bytes, once per message when it is
+ * accepted, while copying it into its payload. Direct messages go through
+ * the same chain, always tagged. Frames and WebSocket binary messages are
+ * broadcast as received.
+ */
+/* Chain used unless -T is given. */
+#define TRANSFORMS_DEFAULT "upper"
+
+typedef struct transforms {
+        /* What each byte becomes. */
+        unsigned char map[256];
+        /* 1 if a byte is kept, 0 if it is dropped. */
+        unsigned char keep[256];
+        /* Set when map and keep leave every byte as it is. */
+        int identity;
+        /* Set when some byte is dropped. */
+        int drops;
+        /*
+         * Set when map only adds shift_delta to the bytes from shift_lo to
+         * shift_lo + shift_span, as case mapping does; such a map is applied
+         * without table lookups, which lets the compiler vectorize it.
+         */
+        int shift;
+        unsigned char shift_lo;
+        unsigned char shift_span;
+        unsigned char shift_delta;
+        /* Most bytes kept of a message, newline excluded, 0 for no limit. */
+        int max_len;
+        /* Set when broadcasts are prefixed with their sender. */
+        int tag;
+}transforms_t;
+
+/*
+ * Build a chain from its comma separated spec.
+ * @ spec - the spec, see above
+ * @ t - the chain to fill
+ * @ return value - 0 on success, -1 if the spec is invalid
+ */
+int parseTransforms(const char* spec, transforms_t* t);
+
+/*
+ * Copy a message through the chain.
+ * @ t - the chain
+ * @ tag - the sender prefix, written first, NULL for none
+ * @ tag_len - length of tag
+ * @ in - the message, including its newline if any
+ * @ len - length of the message
+ * @ out - the output, at least tag_len + len bytes
+ * @ return value - the number of bytes written to out
+ */
+int runTransforms(const transforms_t* t, const char* tag, int tag_len, const char* in, int len, char* out);
+
+#endif
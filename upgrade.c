@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <sys/un.h>
+#include "upgrade.h"
+
+/**
+ * @brief Sends a whole buffer on the upgrade connection
+ *
+ * @param sock The upgrade connection
+ * @param buf The bytes to send
+ * @param len The number of bytes
+ * @return 0 on success, -1 on failure
+ */
+static int sendAll(int sock, const void* buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t ret = send(sock, p, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives exactly len bytes from the upgrade connection
+ *
+ * @param sock The upgrade connection
+ * @param buf The buffer to fill
+ * @param len The number of bytes
+ * @return 0 on success, -1 on failure or end of stream
+ */
+static int recvAll(int sock, void* buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t ret = recv(sock, p, len, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a buffer together with a descriptor (SCM_RIGHTS)
+ *
+ * @param sock The upgrade connection
+ * @param buf The bytes to send
+ * @param len The number of bytes
+ * @param fd The descriptor to pass
+ * @return 0 on success, -1 on failure
+ */
+static int sendWithFd(int sock, const void* buf, size_t len, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { (void*)buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (ret < 0) {
+        return -1;
+    }
+    return sendAll(sock, (const char*)buf + ret, len - ret);
+}
+
+/**
+ * @brief Receives a buffer together with a descriptor (SCM_RIGHTS)
+ *
+ * @param sock The upgrade connection
+ * @param buf The buffer to fill
+ * @param len The number of bytes
+ * @param fd Set to the descriptor received
+ * @return 0 on success, -1 on failure
+ */
+static int recvWithFd(int sock, void* buf, size_t len, int* fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t ret = recvmsg(sock, &msg, 0);
+    if (ret <= 0) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return recvAll(sock, (char*)buf + ret, len - ret);
+}
+
+/**
+ * @brief Sends one queued message, by sequence number if the ring still holds it
+ *
+ * @param sock The upgrade connection
+ * @param msg The queued message
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int sendMsg(int sock, msg_t* msg, conn_pool_t* pool) {
+    payload_t *p = msg->payload;
+    upgrade_msg_t hdr;
+    hdr.seq = p->seq;
+    hdr.origin = p->origin;
+    hdr.node = p->node;
+    hdr.node_seq = p->node_seq;
+    hdr.cont = p->cont;
+    hdr.pad = 0;
+    hdr.len = msg->len;
+    if (ringGet(&pool->history, p->seq) == p && msg->offset == 0 && msg->len == p->size) {
+        hdr.len = 0;
+    }
+    if (sendAll(sock, &hdr, sizeof(hdr)) == -1) {
+        return -1;
+    }
+    return sendAll(sock, p->data + msg->offset, hdr.len);
+}
+
+/**
+ * @brief Receives the bytes of one message into a new payload
+ *
+ * @param sock The upgrade connection
+ * @param hdr The message header already received
+ * @return The payload, NULL on failure
+ */
+static payload_t* recvPayload(int sock, const upgrade_msg_t* hdr) {
+    char *data = malloc(hdr->len);
+    if (data == NULL || recvAll(sock, data, hdr->len) == -1) {
+        free(data);
+        return NULL;
+    }
+    payload_t *p = newPayload(data, hdr->len);
+    free(data);
+    if (p != NULL) {
+        p->origin = hdr->origin;
+        p->node = hdr->node;
+        p->node_seq = hdr->node_seq;
+        p->cont = hdr->cont;
+    }
+    return p;
+}
+
+/**
+ * @brief Listens for a new server process on the upgrade socket
+ *
+ * A socket file left at the path is replaced: either it is stale, or this
+ * process just took over from its owner.
+ *
+ * @param path The path of the Unix socket
+ * @return The listening descriptor, -1 on failure
+ */
+int listenUpgrade(const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(sd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sd, 1) < 0) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * @brief Takes over from a running server
+ *
+ * Receives the listening sockets, the broadcast ring and every client with
+ * its pending input, nickname, cursor and queued messages, then waits for the old server to close
+ * the connection, which it does only after closing its log.
+ *
+ * @param path The path of the upgrade socket of the running server
+ * @param pool A pointer to the empty connection pool structure
+ * @return 0 on success, -1 if no server is running, -2 on failure
+ */
+int takeOver(const char* path, conn_pool_t* pool) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    upgrade_hdr_t hdr;
+    if (recvAll(sock, &hdr, sizeof(hdr)) == -1 || hdr.magic != UPGRADE_MAGIC) {
+        goto fail;
+    }
+    for (uint32_t i = 0; i < hdr.nr_listen; i++) {
+        upgrade_listen_t listen_hdr;
+        int fd;
+        if (recvWithFd(sock, &listen_hdr, sizeof(listen_hdr), &fd) == -1) {
+            goto fail;
+        }
+        conn_t *conn = newConn(fd, CONN_LISTEN, pool);
+        if (conn == NULL) {
+            close(fd);
+            goto fail;
+        }
+        conn->proto = listen_hdr.proto;
+    }
+    ringReset(&pool->history, hdr.first_seq);
+    for (uint32_t i = 0; i < hdr.nr_history; i++) {
+        upgrade_msg_t msg_hdr;
+        if (recvAll(sock, &msg_hdr, sizeof(msg_hdr)) == -1) {
+            goto fail;
+        }
+        payload_t *p = recvPayload(sock, &msg_hdr);
+        if (p == NULL) {
+            goto fail;
+        }
+        ringPush(&pool->history, p);
+        payloadUnref(p);
+    }
+    for (uint32_t i = 0; i < hdr.nr_conns; i++) {
+        upgrade_conn_t conn_hdr;
+        int fd;
+        if (recvWithFd(sock, &conn_hdr, sizeof(conn_hdr), &fd) == -1) {
+            goto fail;
+        }
+        conn_t *conn = newConn(fd, CONN_CLIENT, pool);
+        if (conn == NULL) {
+            close(fd);
+            goto fail;
+        }
+        conn->id = conn_hdr.id;
+        connCursor(pool, conn) = conn_hdr.cursor;
+        conn->cursor_off = conn_hdr.cursor_off;
+        conn->replay_end = conn_hdr.replay_end;
+        conn->proto = conn_hdr.proto;
+        conn->codec = conn_hdr.codec;
+        conn->stream_chunks = conn_hdr.stream_chunks;
+        // The old process may have set any TCP option: set them all again
+        static const sock_opts_t inherited = { .nodelay = 1, .notsent_lowat = 1, .busy_poll = 1 };
+        tuneSocket(conn, &inherited, pool);
+        if (conn->codec != CODEC_NONE) {
+            pool->nr_zipping++;
+        }
+        if (conn_hdr.in_len > 0) {
+            conn->in_buf = malloc(conn_hdr.in_len);
+            if (conn->in_buf == NULL || recvAll(sock, conn->in_buf, conn_hdr.in_len) == -1) {
+                goto fail;
+            }
+            conn->in_len = conn_hdr.in_len;
+        }
+        if (conn_hdr.nick_len > 0) {
+            char nick[NICK_MAX];
+            if (conn_hdr.nick_len > NICK_MAX || recvAll(sock, nick, conn_hdr.nick_len) == -1 ||
+                setNick(&pool->nicks, conn, nick, conn_hdr.nick_len) != 0) {
+                goto fail;
+            }
+        }
+        for (uint32_t m = 0; m < conn_hdr.nr_msgs; m++) {
+            upgrade_msg_t msg_hdr;
+            if (recvAll(sock, &msg_hdr, sizeof(msg_hdr)) == -1) {
+                goto fail;
+            }
+            payload_t *p;
+            if (msg_hdr.len == 0) {
+                p = payloadRef(ringGet(&pool->history, msg_hdr.seq));
+            } else if ((p = recvPayload(sock, &msg_hdr)) != NULL) {
+                p->seq = msg_hdr.seq;
+            }
+            if (p == NULL || queueMsg(conn, p, pool) == -1) {
+                payloadUnref(p);
+                goto fail;
+            }
+            payloadUnref(p);
+        }
+        // Lanes are not handed over, control messages queue after the messages taken over
+        conn->write_msg_ctrl = conn->write_msg_tail;
+        for (uint32_t t = 0; t < conn_hdr.nr_topics; t++) {
+            uint32_t pattern_len;
+            char pattern[TOPIC_MAX];
+            if (recvAll(sock, &pattern_len, sizeof(pattern_len)) == -1 || pattern_len > TOPIC_MAX ||
+                recvAll(sock, pattern, pattern_len) == -1 ||
+                subscribeTopic(&pool->topics, conn, pattern, pattern_len) == -1) {
+                goto fail;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < hdr.nr_sessions; i++) {
+        upgrade_session_t session_hdr;
+        session_t *session = malloc(sizeof(session_t));
+        if (session == NULL || recvAll(sock, &session_hdr, sizeof(session_hdr)) == -1) {
+            free(session);
+            goto fail;
+        }
+        session->token = session_hdr.token;
+        session->id = session_hdr.id;
+        session->acked = session_hdr.acked;
+        session->conn = NULL;
+        session->detached.tv_sec = session_hdr.detached_sec;
+        session->detached.tv_nsec = session_hdr.detached_nsec;
+        for (conn_t *conn = pool->conn_head; session_hdr.attached && conn != NULL; conn = conn->next) {
+            if (conn->type == CONN_CLIENT && conn->id == session->id) {
+                session->conn = conn;
+                conn->session = session;
+                break;
+            }
+        }
+        if (addSession(pool, session) == -1) {
+            if (session->conn != NULL) {
+                session->conn->session = NULL;
+            }
+            free(session);
+            goto fail;
+        }
+    }
+    pool->next_conn_id = hdr.next_conn_id;
+    // Frames not started yet; partly written ones came as queued messages
+    for (unsigned long long seq = hdr.first_seq; pool->nr_zipping > 0 && seq < pool->history.next_seq; seq++) {
+        if (compressPayload(ringGet(&pool->history, seq), pool->codec_level, &pool->codec_stats) == -1) {
+            goto fail;
+        }
+    }
+    // The old server closes the connection once its log is closed
+    char c;
+    if (recv(sock, &c, 1, 0) != 0) {
+        goto fail;
+    }
+    close(sock);
+    printf("took over %u connections from %s\n", hdr.nr_conns, path);
+    return 0;
+
+fail:
+    close(sock);
+    return -2;
+}
+
+/**
+ * @brief Sends a session to the new process
+ *
+ * The session of a connection not handed over is detached now.
+ *
+ * @param sock The upgrade socket
+ * @param session The session
+ * @param now The time of the handover (CLOCK_MONOTONIC)
+ * @return 0 on success, -1 on failure
+ */
+static int sendSession(int sock, session_t* session, const struct timespec* now) {
+    upgrade_session_t session_hdr = { session->token, session->id, session->acked, 0, 0, now->tv_sec, now->tv_nsec };
+    if (session->conn != NULL && !session->conn->closing) {
+        session_hdr.attached = 1;
+    } else if (session->conn == NULL) {
+        session_hdr.detached_sec = session->detached.tv_sec;
+        session_hdr.detached_nsec = session->detached.tv_nsec;
+    }
+    return sendAll(sock, &session_hdr, sizeof(session_hdr));
+}
+
+/**
+ * @brief Hands the server over to a new process
+ *
+ * Accepts the new process on the upgrade socket and sends it the listening
+ * sockets, the broadcast ring, every client connection and the sessions. The log is closed
+ * before the upgrade connection, so the new process can open it.
+ *
+ * @param sd The upgrade listening descriptor
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int handOver(int sd, conn_pool_t* pool) {
+    int sock = accept(sd, NULL, NULL);
+    if (sock < 0) {
+        return -1;
+    }
+    // The new server publishes the whole ring
+    if (flushBatch(pool) == -1) {
+        goto fail;
+    }
+    upgrade_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = UPGRADE_MAGIC;
+    hdr.first_seq = pool->history.first_seq;
+    hdr.nr_history = pool->history.next_seq - pool->history.first_seq;
+    hdr.next_conn_id = pool->next_conn_id;
+    for (conn_t *conn = pool->conn_head; conn != NULL; conn = conn->next) {
+        if (conn->type == CONN_CLIENT && !conn->closing) {
+            hdr.nr_conns++;
+        } else if (conn->type == CONN_LISTEN) {
+            hdr.nr_listen++;
+        }
+    }
+    hdr.nr_sessions = pool->sessions.count;
+    if (sendAll(sock, &hdr, sizeof(hdr)) == -1) {
+        goto fail;
+    }
+    for (conn_t *conn = pool->conn_head; conn != NULL; conn = conn->next) {
+        upgrade_listen_t listen_hdr = { conn->proto };
+        if (conn->type == CONN_LISTEN && sendWithFd(sock, &listen_hdr, sizeof(listen_hdr), conn->fd) == -1) {
+            goto fail;
+        }
+    }
+    for (unsigned long long seq = hdr.first_seq; seq < pool->history.next_seq; seq++) {
+        payload_t *p = ringGet(&pool->history, seq);
+        upgrade_msg_t msg_hdr = { p->size, p->node, seq, p->origin, p->node_seq, p->cont, 0 };
+        if (sendAll(sock, &msg_hdr, sizeof(msg_hdr)) == -1 || sendAll(sock, p->data, p->size) == -1) {
+            goto fail;
+        }
+    }
+    for (conn_t *conn = pool->conn_head; conn != NULL; conn = conn->next) {
+        if (conn->type != CONN_CLIENT || conn->closing) {
+            continue;
+        }
+        // A partly written broadcast goes over as the bytes already framed and compressed
+        if (conn->cursor_off > 0 && detachPartial(conn, pool) == -1) {
+            goto fail;
+        }
+        uint32_t nick_len = conn->nick != NULL ? strlen(conn->nick) : 0;
+        upgrade_conn_t conn_hdr = { conn->in_len, 0, conn->id, connCursor(pool, conn), conn->replay_end, conn->cursor_off, nick_len, conn->proto, conn->codec, 0, conn->stream_chunks };
+        for (msg_t *msg = conn->write_msg_head; msg != NULL; msg = msg->next) {
+            conn_hdr.nr_msgs++;
+        }
+        for (topic_sub_t *sub = conn->topics; sub != NULL; sub = sub->next) {
+            conn_hdr.nr_topics++;
+        }
+        if (sendWithFd(sock, &conn_hdr, sizeof(conn_hdr), conn->fd) == -1 ||
+            sendAll(sock, conn->in_buf, conn->in_len) == -1 || sendAll(sock, conn->nick, nick_len) == -1) {
+            goto fail;
+        }
+        for (msg_t *msg = conn->write_msg_head; msg != NULL; msg = msg->next) {
+            if (sendMsg(sock, msg, pool) == -1) {
+                goto fail;
+            }
+        }
+        for (topic_sub_t *sub = conn->topics; sub != NULL; sub = sub->next) {
+            uint32_t pattern_len = sub->len;
+            if (sendAll(sock, &pattern_len, sizeof(pattern_len)) == -1 || sendAll(sock, sub->pattern, pattern_len) == -1) {
+                goto fail;
+            }
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // Detached sessions oldest first, so the new process expires them in order
+    for (session_t *session = pool->sessions.detached_head; session != NULL; session = session->next) {
+        if (sendSession(sock, session, &now) == -1) {
+            goto fail;
+        }
+    }
+    unsigned int pos = 0;
+    session_t *session;
+    while ((session = nextSession(pool, &pos)) != NULL) {
+        if (session->conn != NULL && sendSession(sock, session, &now) == -1) {
+            goto fail;
+        }
+    }
+    if (pool->log != NULL) {
+        closeLog(pool->log);
+        pool->log = NULL;
+    }
+    close(sock);
+    printf("handed over %u connections\n", hdr.nr_conns);
+    return 0;
+
+fail:
+    close(sock);
+    return -1;
+}
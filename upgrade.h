@@ -0,0 +1,112 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdint.h>
+#include "chatServer.h"
+
+/*
+ * Zero-downtime restart.
+ *
+ * A server started with an upgrade socket path listens on that Unix socket.
+ * A new server process started with the same path connects to it and the
+ * running server hands over, over SCM_RIGHTS, its listening sockets and every
+ * client socket together with its pending input, nickname, ring cursor and
+ * queued messages, and the broadcast ring. The old process then exits
+ * without the clients noticing.
+ *
+ * Stream layout: upgrade_hdr_t, nr_listen upgrade_listen_t (each carrying a
+ * listening socket), nr_history ring entries, then per client an
+ * upgrade_conn_t (carrying the client socket), its in_len input bytes, its
+ * nick_len nickname bytes, nr_msgs queued messages and nr_topics topic
+ * patterns (each a uint32_t length and the pattern bytes), and last
+ * nr_sessions upgrade_session_t, the detached ones first and oldest first. Ring entries and messages are an upgrade_msg_t followed
+ * by the message bytes, except for queued messages still held by the ring,
+ * which are sent by sequence number only. A broadcast partly written to a
+ * client is first moved to its queue, so the rest of its frame goes over as
+ * bytes. Compressed broadcasts are not sent otherwise: the new process
+ * compresses the ring again with its own level, for frames not started yet.
+ */
+#define UPGRADE_MAGIC 0x43485359u
+
+typedef struct upgrade_hdr {
+        uint32_t magic;
+        uint32_t nr_conns;
+        uint32_t nr_history;
+        uint32_t nr_listen;
+        uint32_t nr_sessions;
+        uint32_t pad;
+        uint64_t first_seq;
+        uint64_t next_conn_id;
+}upgrade_hdr_t;
+
+typedef struct upgrade_listen {
+        /* Protocol of the clients accepted. */
+        uint32_t proto;
+}upgrade_listen_t;
+
+typedef struct upgrade_conn {
+        uint32_t in_len;
+        uint32_t nr_msgs;
+        uint64_t id;
+        uint64_t cursor;
+        uint64_t replay_end;
+        uint32_t cursor_off;
+        uint32_t nick_len;
+        uint32_t proto;
+        uint32_t codec;
+        uint32_t nr_topics;
+        uint32_t stream_chunks;
+}upgrade_conn_t;
+
+typedef struct upgrade_session {
+        uint64_t token;
+        /* Origin id, also the id of the connection holding the session. */
+        uint64_t id;
+        uint64_t acked;
+        /* Set when a connection handed over holds the session. */
+        uint32_t attached;
+        uint32_t pad;
+        /* Time the session was detached (CLOCK_MONOTONIC, shared by both processes). */
+        int64_t detached_sec;
+        int64_t detached_nsec;
+}upgrade_session_t;
+
+typedef struct upgrade_msg {
+        /* Size of the message, 0 if the message is the ring entry seq. */
+        uint32_t len;
+        /* Node the broadcast was accepted on and its sequence number there, see payload_t. */
+        uint32_t node;
+        uint64_t seq;
+        uint64_t origin;
+        uint64_t node_seq;
+        /* Set on the next chunks of a streamed line, see payload_t. */
+        uint32_t cont;
+        uint32_t pad;
+}upgrade_msg_t;
+
+/*
+ * Listen for a new server process on the upgrade socket path.
+ * @ path - the path of the Unix socket
+ * @ return value - the listening descriptor, -1 on failure
+ */
+int listenUpgrade(const char* path);
+
+/*
+ * Take over from a server running with the same upgrade socket path, if any.
+ * Blocks until the old server finished handing over and closed its log.
+ * @ path - the path of the Unix socket
+ * @pool - the (empty) pool, filled with the listeners and clients handed over
+ * @ return value - 0 on success, -1 if no server is running, -2 on failure
+ */
+int takeOver(const char* path, conn_pool_t* pool);
+
+/*
+ * Hand over to a new server process connecting to the upgrade socket.
+ * On success the caller must exit without further touching its clients.
+ * @ sd - the upgrade listening descriptor
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int handOver(int sd, conn_pool_t* pool);
+
+#endif
@@ -0,0 +1,522 @@
+#include <strings.h>
+#include <endian.h>
+#include "chatServer.h"
+
+/**
+ * @brief Computes the SHA-1 digest of a buffer
+ *
+ * @param data The bytes
+ * @param len The number of bytes
+ * @param digest Set to the 20-byte digest
+ */
+static void sha1(const unsigned char* data, size_t len, unsigned char digest[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint64_t bits = (uint64_t)len * 8;
+    size_t total = (len + 9 + 63) / 64 * 64;
+    for (size_t block = 0; block < total; block += 64) {
+        unsigned char chunk[64];
+        for (int i = 0; i < 64; i++) {
+            size_t pos = block + i;
+            if (pos < len) {
+                chunk[i] = data[pos];
+            } else if (pos == len) {
+                chunk[i] = 0x80;
+            } else if (pos >= total - 8) {
+                chunk[i] = bits >> (8 * (total - 1 - pos));
+            } else {
+                chunk[i] = 0;
+            }
+        }
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)chunk[4 * i] << 24 | chunk[4 * i + 1] << 16 | chunk[4 * i + 2] << 8 | chunk[4 * i + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = x << 1 | x >> 31;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = b << 30 | b >> 2;
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) {
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+    }
+}
+
+/**
+ * @brief Encodes bytes in base64
+ *
+ * @param data The bytes
+ * @param len The number of bytes
+ * @param out The output, at least 4 * ((len + 2) / 3) + 1 bytes
+ */
+static void base64(const unsigned char* data, size_t len, char* out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = data[i] << 16;
+        if (i + 1 < len) {
+            v |= data[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            v |= data[i + 2];
+        }
+        *out++ = alphabet[v >> 18 & 63];
+        *out++ = alphabet[v >> 12 & 63];
+        *out++ = i + 1 < len ? alphabet[v >> 6 & 63] : '=';
+        *out++ = i + 2 < len ? alphabet[v & 63] : '=';
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Checks whether bytes are valid UTF-8, as text frames must be
+ *
+ * @param s The bytes
+ * @param len The number of bytes
+ * @return 1 if valid, 0 otherwise
+ */
+static int validUtf8(const unsigned char* s, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        size_t n;
+        if (s[i] < 0x80) {
+            n = 0;
+        } else if (s[i] >= 0xC2 && s[i] <= 0xDF) {
+            n = 1;
+        } else if ((s[i] & 0xF0) == 0xE0) {
+            n = 2;
+        } else if (s[i] >= 0xF0 && s[i] <= 0xF4) {
+            n = 3;
+        } else {
+            return 0;
+        }
+        if (len - i <= n) {
+            return 0;
+        }
+        for (size_t k = 1; k <= n; k++) {
+            if ((s[i + k] & 0xC0) != 0x80) {
+                return 0;
+            }
+        }
+        i += n + 1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Allocates a payload holding a whole server frame
+ *
+ * Server frames are never masked.
+ *
+ * @param opcode The frame opcode
+ * @param data The frame payload
+ * @param len The size of the frame payload
+ * @return The payload with a reference count of 1, NULL on failure
+ */
+payload_t* newWsFrame(int opcode, const char* data, int len) {
+    char *buf = malloc(10 + len);
+    if (buf == NULL) {
+        return NULL;
+    }
+    int hlen = 2;
+    buf[0] = 0x80 | opcode;
+    if (len < 126) {
+        buf[1] = len;
+    } else if (len <= 0xFFFF) {
+        buf[1] = 126;
+        uint16_t be_len = htobe16(len);
+        memcpy(buf + 2, &be_len, 2);
+        hlen = 4;
+    } else {
+        buf[1] = 127;
+        uint64_t be_len = htobe64(len);
+        memcpy(buf + 2, &be_len, 8);
+        hlen = 10;
+    }
+    memcpy(buf + hlen, data, len);
+    payload_t *payload = newPayload(buf, hlen + len);
+    free(buf);
+    return payload;
+}
+
+/**
+ * @brief Returns the frame of a broadcast, building it on first use
+ *
+ * The trailing newline of a line broadcast is left out.
+ *
+ * @param p The broadcast
+ * @return The frame, NULL on failure
+ */
+payload_t* wsFrame(payload_t* p) {
+    if (p->ws_frame == NULL) {
+        int len = p->size;
+        if (len > 0 && p->data[len - 1] == '\n') {
+            len--;
+        }
+        if (len > 0 && p->data[len - 1] == '\r') {
+            len--;
+        }
+        int opcode = validUtf8((const unsigned char*)p->data, len) ? WS_OP_TEXT : WS_OP_BINARY;
+        p->ws_frame = newWsFrame(opcode, p->data, len);
+    }
+    return p->ws_frame;
+}
+
+/**
+ * @brief Queues a frame to a WebSocket client
+ *
+ * A pong takes the control lane. A close frame ends the output, so it goes
+ * after everything queued.
+ *
+ * @param conn The connection
+ * @param opcode The frame opcode
+ * @param data The frame payload
+ * @param len The size of the frame payload
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int queueWsFrame(conn_t* conn, int opcode, const char* data, int len, conn_pool_t* pool) {
+    payload_t *payload = newWsFrame(opcode, data, len);
+    if (payload == NULL) {
+        return -1;
+    }
+    int ret = queueLane(conn, payload, opcode == WS_OP_PONG ? LANE_CONTROL : LANE_SWITCH, pool);
+    payloadUnref(payload);
+    return ret;
+}
+
+/**
+ * @brief Starts closing a WebSocket connection
+ *
+ * The close frame is queued and the connection is removed once its queue
+ * is written; nothing more is read from it.
+ *
+ * @param conn The connection
+ * @param code The close status code
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int wsClose(conn_t* conn, int code, conn_pool_t* pool) {
+    uint16_t be_code = htobe16(code);
+    conn->proto = PROTO_WS_CLOSING;
+    return queueWsFrame(conn, WS_OP_CLOSE, (const char*)&be_code, sizeof(be_code), pool);
+}
+
+/**
+ * @brief Returns the value of a header line if it is the header named
+ *
+ * @param line The header line
+ * @param name The header name, compared ignoring case
+ * @return The value, leading blanks skipped, NULL if the line is another header
+ */
+static const char* headerValue(const char* line, const char* name) {
+    size_t len = strlen(name);
+    if (strncasecmp(line, name, len) != 0 || line[len] != ':') {
+        return NULL;
+    }
+    line += len + 1;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return line;
+}
+
+/**
+ * @brief Tells whether a comma-separated header value lists a token
+ *
+ * @param value The value, up to the end of its line
+ * @param token The token, compared ignoring case
+ * @return 1 if it does, 0 if not
+ */
+static int hasToken(const char* value, const char* token) {
+    size_t token_len = strlen(token);
+    const char *end = value + strcspn(value, "\r\n");
+    while (value < end) {
+        if (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+            continue;
+        }
+        size_t len = strcspn(value, ",\r\n");
+        size_t n = len;
+        while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t')) {
+            n--;
+        }
+        if (n == token_len && strncasecmp(value, token, n) == 0) {
+            return 1;
+        }
+        value += len;
+    }
+    return 0;
+}
+
+/**
+ * @brief Answers the HTTP upgrade request of a WebSocket client
+ *
+ * The request must be a GET with "Upgrade: websocket", "Connection:
+ * Upgrade", a Sec-WebSocket-Key and "Sec-WebSocket-Version: 13" (RFC 6455
+ * section 4.2.1). Another version is answered with 426 and the version
+ * supported, anything else missing with 400.
+ *
+ * @param conn The connection
+ * @param request The request, NUL terminated
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int wsHandshake(conn_t* conn, char* request, conn_pool_t* pool) {
+    const char *key = NULL;
+    size_t key_len = 0;
+    // version: -1 without the header, 0 for another version than 13
+    int upgrade = 0, connection = 0, version = -1;
+    if (strncmp(request, "GET ", 4) == 0) {
+        for (char *line = strstr(request, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+            line += 2;
+            const char *value;
+            if ((value = headerValue(line, "Sec-WebSocket-Key")) != NULL) {
+                key = value;
+                key_len = strcspn(key, " \t\r\n");
+            } else if ((value = headerValue(line, "Upgrade")) != NULL) {
+                upgrade |= hasToken(value, "websocket");
+            } else if ((value = headerValue(line, "Connection")) != NULL) {
+                connection |= hasToken(value, "Upgrade");
+            } else if ((value = headerValue(line, "Sec-WebSocket-Version")) != NULL) {
+                version = strncmp(value, "13", 2) == 0 && strcspn(value, " \t\r\n") == 2;
+            }
+        }
+    }
+    if (key == NULL || key_len == 0 || key_len > 64 || !upgrade || !connection || version != 1) {
+        static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        static const char old[] = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\n"
+                                  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        int wrong_version = key != NULL && upgrade && connection && version == 0;
+        payload_t *payload = wrong_version ? newPayload(old, sizeof(old) - 1) : newPayload(bad, sizeof(bad) - 1);
+        conn->proto = PROTO_WS_CLOSING;
+        if (payload == NULL) {
+            return -1;
+        }
+        int ret = queueLane(conn, payload, LANE_SWITCH, pool);
+        payloadUnref(payload);
+        return ret;
+    }
+    char accept_src[64 + sizeof(WS_GUID)];
+    memcpy(accept_src, key, key_len);
+    memcpy(accept_src + key_len, WS_GUID, sizeof(WS_GUID) - 1);
+    unsigned char digest[20];
+    sha1((const unsigned char*)accept_src, key_len + sizeof(WS_GUID) - 1, digest);
+    char accept[29];
+    base64(digest, sizeof(digest), accept);
+    char response[256];
+    int len = snprintf(response, sizeof(response),
+                       "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    payload_t *payload = newPayload(response, len);
+    if (payload == NULL) {
+        return -1;
+    }
+    int ret = queueLane(conn, payload, LANE_SWITCH, pool);
+    payloadUnref(payload);
+    // Broadcasts start from here
+    conn->proto = PROTO_WS;
+    connCursor(pool, conn) = pool->published;
+    return ret;
+}
+
+/**
+ * @brief Handles one complete message from a WebSocket client
+ *
+ * @param conn The connection
+ * @param opcode The frame opcode
+ * @param data The unmasked payload
+ * @param len The size of the payload
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+static int wsMessage(conn_t* conn, int opcode, const char* data, size_t len, conn_pool_t* pool) {
+    switch (opcode) {
+        case WS_OP_TEXT: {
+            if (len == 0) {
+                return 0;
+            }
+            // A text message is a line, commands included
+            char *line = malloc(len + 1);
+            if (line == NULL) {
+                return -1;
+            }
+            memcpy(line, data, len);
+            if (line[len - 1] != '\n') {
+                line[len++] = '\n';
+            }
+            int ret = handleLine(conn, line, len, pool);
+            free(line);
+            return ret;
+        }
+        case WS_OP_BINARY: {
+            if (len == 0) {
+                return 0;
+            }
+            payload_t *payload = newPayload(data, len);
+            if (payload == NULL) {
+                return -1;
+            }
+            int filtered = filterMessage(conn, payload->data, payload->size, pool);
+            if (filtered != 0) {
+                payloadUnref(payload);
+                return filtered == 1 ? 0 : -1;
+            }
+            payload->origin = conn->id;
+            payload->node = pool->fed.node_id;
+            int ret = broadcastPayload(payload, pool);
+            payloadUnref(payload);
+            return ret;
+        }
+        case WS_OP_PING:
+            return queueWsFrame(conn, WS_OP_PONG, data, len, pool);
+        case WS_OP_PONG:
+            return 0;
+        case WS_OP_CLOSE:
+            return wsClose(conn, 1000, pool);
+        default:
+            return wsClose(conn, 1002, pool);
+    }
+}
+
+/**
+ * @brief Handles the bytes read from a WebSocket client
+ *
+ * During the handshake the request is collected in the input buffer. After
+ * it, complete frames are unmasked in place and handled straight from the
+ * read buffer; a trailing incomplete frame is kept in the input buffer.
+ *
+ * @param conn The connection
+ * @param buffer The bytes read
+ * @param len The number of bytes read
+ * @param pool A pointer to the connection pool structure
+ * @return 0 on success, -1 on failure
+ */
+int wsInput(conn_t* conn, char* buffer, int len, conn_pool_t* pool) {
+    if (conn->proto == PROTO_WS_CLOSING) {
+        return 0;
+    }
+    char *data = buffer;
+    size_t avail = len;
+    if (conn->in_len > 0 || conn->proto == PROTO_WS_HANDSHAKE) {
+        char *joined = realloc(conn->in_buf, conn->in_len + len + 1);
+        if (joined == NULL) {
+            return -1;
+        }
+        memcpy(joined + conn->in_len, buffer, len);
+        conn->in_buf = data = joined;
+        conn->in_len = avail = conn->in_len + len;
+    }
+    int ret = 0;
+    size_t off = 0;
+    if (conn->proto == PROTO_WS_HANDSHAKE) {
+        data[avail] = '\0';
+        char *end = strstr(data, "\r\n\r\n");
+        if (end == NULL) {
+            if (avail > WS_REQUEST_MAX) {
+                free(conn->in_buf);
+                conn->in_buf = NULL;
+                conn->in_len = 0;
+                return wsHandshake(conn, "", pool);
+            }
+            return 0;
+        }
+        end[2] = '\0';
+        off = end + 4 - data;
+        ret = wsHandshake(conn, data, pool);
+    }
+    while (conn->proto == PROTO_WS && avail - off >= 2) {
+        const unsigned char *p = (const unsigned char*)data + off;
+        int fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0F;
+        uint64_t plen = p[1] & 0x7F;
+        size_t hlen = 2;
+        if (!(p[1] & 0x80)) {
+            ret |= wsClose(conn, 1002, pool); // Client frames must be masked
+            break;
+        }
+        if ((opcode & 0x08) && (!fin || plen > 125)) {
+            ret |= wsClose(conn, 1002, pool); // Control frames are never fragmented nor extended
+            break;
+        }
+        if (plen == 126) {
+            if (avail - off < 4) {
+                break;
+            }
+            uint16_t be_len;
+            memcpy(&be_len, p + 2, 2);
+            plen = be16toh(be_len);
+            hlen = 4;
+        } else if (plen == 127) {
+            if (avail - off < 10) {
+                break;
+            }
+            uint64_t be_len;
+            memcpy(&be_len, p + 2, 8);
+            plen = be64toh(be_len);
+            hlen = 10;
+        }
+        if (plen > FRAME_MAX || plen > pool->max_msg) {
+            ret |= wsClose(conn, 1009, pool);
+            break;
+        }
+        if (avail - off < hlen + 4 + plen) {
+            break;
+        }
+        if (!fin || opcode == 0) {
+            ret |= wsClose(conn, 1003, pool); // Fragmented messages are not supported
+            break;
+        }
+        const unsigned char *mask = p + hlen;
+        char *payload = data + off + hlen + 4;
+        for (uint64_t i = 0; i < plen; i++) {
+            payload[i] ^= mask[i & 3];
+        }
+        ret |= wsMessage(conn, opcode, payload, plen, pool);
+        off += hlen + 4 + plen;
+    }
+    // Keep the incomplete frame for the next read
+    size_t rest = conn->proto == PROTO_WS ? avail - off : 0;
+    if (rest == 0) {
+        free(conn->in_buf);
+        conn->in_buf = NULL;
+        conn->in_len = 0;
+    } else if (data == conn->in_buf) {
+        memmove(conn->in_buf, data + off, rest);
+        conn->in_len = rest;
+    } else {
+        conn->in_buf = malloc(rest);
+        if (conn->in_buf == NULL) {
+            return -1;
+        }
+        memcpy(conn->in_buf, data + off, rest);
+        conn->in_len = rest;
+    }
+    return ret;
+}
@@ -0,0 +1,65 @@
+#ifndef WS_H
+#define WS_H
+
+#include <stdint.h>
+
+/*
+ * WebSocket clients (RFC 6455), served by the same event loop.
+ *
+ * A client accepted on the WebSocket port starts in PROTO_WS_HANDSHAKE:
+ * its HTTP upgrade request is answered with "101 Switching Protocols" and
+ * the connection moves to PROTO_WS. A request without the Upgrade,
+ * Connection and Sec-WebSocket-Key headers gets 400, one asking for
+ * another version than 13 gets 426, and the connection is closed. Each text message from the client is
+ * handled like a line from a line client (commands included); a binary
+ * message goes through the content filter and is broadcast as is.
+ *
+ * Broadcasts reach WebSocket clients as unmasked text frames (binary
+ * frames if they are not valid UTF-8) without the trailing newline. The
+ * frame of a broadcast is built the first time a WebSocket client writes
+ * it and is kept with the broadcast's payload, shared by all WebSocket
+ * clients. Fragmented messages are not supported and close the connection;
+ * a fragmented control frame, or one over 125 bytes, is a protocol error
+ * (close code 1002).
+ */
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+/* Longest HTTP upgrade request accepted. */
+#define WS_REQUEST_MAX 8192
+
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+struct conn;
+struct conn_pool;
+struct payload;
+
+/*
+ * Allocate a payload holding a whole server frame.
+ * @ opcode - the frame opcode
+ * @ data - the frame payload
+ * @ len - the size of the frame payload
+ * @ return value - the payload, NULL on failure
+ */
+struct payload* newWsFrame(int opcode, const char* data, int len);
+
+/*
+ * The frame of a broadcast, built on first use and kept with the broadcast.
+ * @ p - the broadcast
+ * @ return value - the frame (not referenced), NULL on failure
+ */
+struct payload* wsFrame(struct payload* p);
+
+/*
+ * Handle bytes read from a WebSocket client, in handshake or frame mode.
+ * @ conn - the connection
+ * @ buffer - the bytes read
+ * @ len - the number of bytes
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int wsInput(struct conn* conn, char* buffer, int len, struct conn_pool* pool);
+
+#endif